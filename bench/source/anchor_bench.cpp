@@ -0,0 +1,163 @@
+/* Measures how often the substring prefilter fires without a real match,
+ * comparing the classic needle[0] / needle[k - 1] anchors with the pair
+ * chosen by compile_needle from the byte frequency table.
+ *
+ *   oystr_anchor_bench [DIRECTORY] [QUERY...]
+ *
+ * Every regular file under DIRECTORY (default: the current directory) is
+ * read once; for each query the candidate counts are computed exactly, the
+ * way the vector loop sees them, and the scan time of the kernel with each
+ * anchor pair is reported. */
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <sse2_strstr.hpp>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+std::vector<std::string> load_tree(const fs::path& root)
+{
+  std::vector<std::string> files;
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator(
+           root, fs::directory_options::skip_permission_denied, ec);
+       it != fs::recursive_directory_iterator();
+       it.increment(ec))
+  {
+    if (ec || !it->is_regular_file(ec)) {
+      continue;
+    }
+    std::ifstream in(it->path(), std::ios::binary);
+    files.emplace_back(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  }
+  return files;
+}
+
+struct anchor_stats
+{
+  std::size_t candidates = 0;
+  std::size_t matches = 0;
+};
+
+anchor_stats count_candidates(const std::vector<std::string>& files,
+                              const search::strstr_needle& needle)
+{
+  const auto k = needle.text.size();
+  const char a = needle.text[needle.first];
+  const char b = needle.text[needle.second];
+
+  anchor_stats stats;
+  for (const auto& file : files) {
+    for (std::size_t i = 0; i + k <= file.size(); ++i) {
+      if (file[i + needle.first] == a && file[i + needle.second] == b) {
+        ++stats.candidates;
+        stats.matches += file.compare(i, k, needle.text) == 0;
+      }
+    }
+  }
+  return stats;
+}
+
+double scan_ms(const std::vector<std::string>& files,
+               const search::strstr_needle& needle)
+{
+  const auto start = std::chrono::steady_clock::now();
+  std::size_t found = 0;
+  for (const auto& file : files) {
+    std::string_view rest = file;
+    for (;;) {
+      const auto pos = search::sse2_strstr_v2(rest, needle);
+      if (pos == std::string_view::npos) {
+        break;
+      }
+      ++found;
+      rest.remove_prefix(pos + 1);
+    }
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  // Keep the loop from being optimized away
+  std::fprintf(stderr, "%s", found == std::size_t(-1) ? "?" : "");
+  return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+double rate(const anchor_stats& stats, std::size_t positions)
+{
+  return positions == 0
+      ? 0.0
+      : 100.0 * static_cast<double>(stats.candidates - stats.matches)
+          / static_cast<double>(positions);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+  const fs::path root = argc > 1 ? argv[1] : ".";
+
+  std::vector<std::string> queries(argv + std::min(argc, 2), argv + argc);
+  if (queries.empty()) {
+    queries = {" return ", "e(", "_t ", "(void)", "std::string", " = nullptr;"};
+  }
+
+  const auto files = load_tree(root);
+  std::size_t bytes = 0;
+  for (const auto& file : files) {
+    bytes += file.size();
+  }
+  std::printf("%zu files, %zu bytes under %s, kernel %s\n\n",
+              files.size(),
+              bytes,
+              root.c_str(),
+              search::strstr_kernel_name());
+
+  std::printf("%-14s %8s | %-7s %11s %8s %9s | %-7s %11s %8s %9s\n",
+              "query",
+              "matches",
+              "anchors",
+              "candidates",
+              "false %",
+              "scan ms",
+              "anchors",
+              "candidates",
+              "false %",
+              "scan ms");
+
+  for (const auto& query : queries) {
+    if (query.size() < 2) {
+      continue;
+    }
+
+    const search::strstr_needle classic {query, 0, query.size() - 1};
+    const auto chosen = search::compile_needle(query);
+
+    const auto before = count_candidates(files, classic);
+    const auto after = count_candidates(files, chosen);
+
+    std::printf(
+        "%-14s %8zu | %3zu,%-3zu %11zu %8.3f %9.2f | %3zu,%-3zu %11zu %8.3f "
+        "%9.2f\n",
+        ("\"" + query + "\"").c_str(),
+        before.matches,
+        classic.first,
+        classic.second,
+        before.candidates,
+        rate(before, bytes),
+        scan_ms(files, classic),
+        chosen.first,
+        chosen.second,
+        after.candidates,
+        rate(after, bytes),
+        scan_ms(files, chosen));
+  }
+
+  std::printf("\nfalse %% = candidates without a match per byte scanned\n");
+  return 0;
+}
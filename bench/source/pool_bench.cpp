@@ -0,0 +1,98 @@
+/* Measures the overhead of handing work to the thread pool, which
+ * dominates searching a tree of many small files: each file is a task that
+ * takes a few microseconds, and directories hand out their files in bursts.
+ *
+ *   oystr_pool_bench [FILES] [THREADS]
+ *
+ * A temporary tree of FILES (default: 20000) small files, 16 per directory,
+ * is created and searched with directory_search a few times; the fastest
+ * run is reported. Then bursts of empty tasks are pushed and waited for,
+ * to show the latency of waking up the workers and of wait_for_tasks. */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <searcher.hpp>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+constexpr std::size_t files_per_directory = 16;
+constexpr int search_runs = 5;
+constexpr int bursts = 2000;
+constexpr int tasks_per_burst = 64;
+
+void make_tree(const fs::path& root, std::size_t files)
+{
+  for (std::size_t i = 0; i < files; ++i) {
+    const auto directory =
+        root / ("d" + std::to_string(i / files_per_directory));
+    if (i % files_per_directory == 0) {
+      fs::create_directories(directory);
+    }
+    std::ofstream out(directory / ("f" + std::to_string(i) + ".cpp"));
+    for (int line = 0; line < 20; ++line) {
+      out << "int value_" << line << " = " << i * line << ";\n";
+    }
+  }
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+  const std::size_t files = argc > 1 ? std::stoul(argv[1]) : 20000;
+  const unsigned threads =
+      argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+
+  const auto root = fs::temp_directory_path()
+      / ("oystr_pool_bench." + std::to_string(::getpid()));
+  make_tree(root, files);
+
+  using search::searcher;
+  searcher::m_ts = std::make_unique<thread_pool>(threads);
+  searcher::m_query = "value_7 = 7";
+  searcher::m_needle = search::compile_needle(searcher::m_query, false);
+  searcher::m_ignore_case = false;
+  searcher::m_out = std::fopen("/dev/null", "w");
+
+  double best = 1e300;
+  for (int run = 0; run < search_runs; ++run) {
+    const auto start = std::chrono::steady_clock::now();
+    searcher::directory_search(root.c_str());
+    best = std::min(best, elapsed_ms(start));
+  }
+  std::printf("search of %zu files on %u threads: %.2f ms\n",
+              files,
+              searcher::m_ts->get_thread_count(),
+              best);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (int burst = 0; burst < bursts; ++burst) {
+    for (int task = 0; task < tasks_per_burst; ++task) {
+      searcher::m_ts->push_task([] {});
+    }
+    searcher::m_ts->wait_for_tasks();
+  }
+  std::printf("%d bursts of %d empty tasks: %.2f us per burst\n",
+              bursts,
+              tasks_per_burst,
+              elapsed_ms(start) * 1000 / bursts);
+
+  searcher::m_ts.reset();
+  std::fclose(searcher::m_out);
+  fs::remove_all(root);
+}
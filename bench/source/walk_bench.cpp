@@ -0,0 +1,123 @@
+/* Counts the heap allocations of a directory walk, per file found, and
+ * times it, on a generated tree of many small files.
+ *
+ *   oystr_walk_bench [FILES] [THREADS]
+ *
+ * A temporary tree of FILES (default: 1000000) files of a few bytes, 64 per
+ * directory, is created. It is then walked with walk_files and a visitor
+ * that does nothing, which is the cost of finding the files and handing
+ * them to the pool, and searched with directory_search, which adds reading
+ * and searching them. */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <searcher.hpp>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+std::atomic<std::size_t> allocations = 0;
+
+constexpr std::size_t files_per_directory = 64;
+
+void make_tree(const fs::path& root, std::size_t files)
+{
+  for (std::size_t i = 0; i < files; ++i) {
+    const auto directory =
+        root / ("d" + std::to_string(i / files_per_directory));
+    if (i % files_per_directory == 0) {
+      fs::create_directories(directory);
+    }
+    std::ofstream(directory / ("file_" + std::to_string(i) + ".cpp"))
+        << "int x = " << i << ";\n";
+  }
+}
+
+template<typename F>
+void measure(const char* name, std::size_t files, F&& run)
+{
+  const auto before = allocations.load();
+  const auto start = std::chrono::steady_clock::now();
+  run();
+  const auto elapsed = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+  const auto count = allocations.load() - before;
+  std::printf("%-8s %10.1f ms %12zu allocations %8.3f per file\n",
+              name,
+              elapsed,
+              count,
+              static_cast<double>(count) / files);
+}
+
+}  // namespace
+
+void* operator new(std::size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* pointer = std::malloc(size ? size : 1)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+int main(int argc, char* argv[])
+{
+  const std::size_t files = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  const unsigned threads =
+      argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+
+  const auto root = fs::temp_directory_path()
+      / ("oystr_walk_bench." + std::to_string(::getpid()));
+  std::printf("creating %zu files in %s\n", files, root.c_str());
+  make_tree(root, files);
+
+  using search::searcher;
+  searcher::m_ts = std::make_unique<thread_pool>(threads);
+  searcher::m_query = "not in any file";
+  searcher::m_needle = search::compile_needle(searcher::m_query, false);
+  searcher::m_ignore_case = false;
+  searcher::m_out = std::fopen("/dev/null", "w");
+
+  // Once to warm the page cache and the allocator
+  searcher::directory_search(root.c_str());
+
+  std::atomic<std::size_t> visited = 0;
+  measure("walk",
+          files,
+          [&]
+          {
+            searcher::walk_files(root.c_str(),
+                                 [&](std::string_view, std::size_t)
+                                 { visited.fetch_add(1); });
+          });
+  measure("search",
+          files,
+          [&] { searcher::directory_search(root.c_str()); });
+  if (visited != files) {
+    std::printf("walked %zu files instead of %zu\n", visited.load(), files);
+  }
+
+  searcher::m_ts.reset();
+  std::fclose(searcher::m_out);
+  fs::remove_all(root);
+}
@@ -5,6 +5,11 @@ if(BUILD_TESTING)
   add_subdirectory(test)
 endif()
 
+option(BUILD_BENCHMARKS "Build the benchmark programs in bench/" OFF)
+if(BUILD_BENCHMARKS)
+  add_subdirectory(bench)
+endif()
+
 add_custom_target(
     run-exe
     COMMAND oystr_exe
@@ -0,0 +1,102 @@
+#include <immintrin.h>
+#include <sse2_strstr.hpp>
+
+#if defined(__AVX2__)
+
+#  include <strstr_kernel.hpp>
+
+namespace search
+{
+namespace
+{
+struct avx2_block
+{
+  using vector = __m256i;
+  using mask = uint32_t;
+  static constexpr size_t size = 32;
+
+  static FORCE_INLINE vector broadcast(char c)
+  {
+    return _mm256_set1_epi8(c);
+  }
+
+  static FORCE_INLINE mask match(vector first,
+                                 vector last,
+                                 const char* a,
+                                 const char* b)
+  {
+    const __m256i block_first =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+    const __m256i block_last =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+
+    const __m256i eq_first = _mm256_cmpeq_epi8(first, block_first);
+    const __m256i eq_last = _mm256_cmpeq_epi8(last, block_last);
+
+    return static_cast<mask>(
+        _mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last)));
+  }
+
+  static FORCE_INLINE mask match_fold(vector first,
+                                      vector last,
+                                      vector first_fold,
+                                      vector last_fold,
+                                      const char* a,
+                                      const char* b)
+  {
+    const __m256i block_first = _mm256_or_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)), first_fold);
+    const __m256i block_last = _mm256_or_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)), last_fold);
+
+    const __m256i eq_first = _mm256_cmpeq_epi8(first, block_first);
+    const __m256i eq_last = _mm256_cmpeq_epi8(last, block_last);
+
+    return static_cast<mask>(
+        _mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last)));
+  }
+
+  static FORCE_INLINE mask equal(vector c, const char* a)
+  {
+    return static_cast<mask>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        c, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)))));
+  }
+};
+
+}  // namespace
+
+size_t avx2_strstr(const char* s, size_t n, const strstr_needle& needle)
+{
+  return strstr_v2<avx2_block, false>(s, n, needle);
+}
+
+size_t avx2_strcasestr(const char* s, size_t n, const strstr_needle& needle)
+{
+  return strstr_v2<avx2_block, true>(s, n, needle);
+}
+
+size_t avx2_strstr_all(const char* s,
+                       size_t n,
+                       const strstr_needle& needle,
+                       size_t* positions,
+                       size_t max)
+{
+  return strstr_all<avx2_block, false>(s, n, needle, positions, max);
+}
+
+size_t avx2_strcasestr_all(const char* s,
+                           size_t n,
+                           const strstr_needle& needle,
+                           size_t* positions,
+                           size_t max)
+{
+  return strstr_all<avx2_block, true>(s, n, needle, positions, max);
+}
+
+size_t avx2_count_byte(const char* s, size_t n, char c)
+{
+  return count_byte<avx2_block>(s, n, c);
+}
+
+}  // namespace search
+#endif
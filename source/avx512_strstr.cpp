@@ -0,0 +1,97 @@
+#include <immintrin.h>
+#include <sse2_strstr.hpp>
+
+#if defined(__AVX512BW__)
+
+#  include <strstr_kernel.hpp>
+
+namespace search
+{
+namespace
+{
+struct avx512bw_block
+{
+  using vector = __m512i;
+  using mask = uint64_t;
+  static constexpr size_t size = 64;
+
+  static FORCE_INLINE vector broadcast(char c)
+  {
+    return _mm512_set1_epi8(c);
+  }
+
+  static FORCE_INLINE mask match(vector first,
+                                 vector last,
+                                 const char* a,
+                                 const char* b)
+  {
+    const __m512i block_first = _mm512_loadu_si512(a);
+    const __m512i block_last = _mm512_loadu_si512(b);
+
+    const __mmask64 eq_first = _mm512_cmpeq_epi8_mask(first, block_first);
+
+    return _mm512_mask_cmpeq_epi8_mask(eq_first, last, block_last);
+  }
+
+  static FORCE_INLINE mask match_fold(vector first,
+                                      vector last,
+                                      vector first_fold,
+                                      vector last_fold,
+                                      const char* a,
+                                      const char* b)
+  {
+    const __m512i block_first =
+        _mm512_or_si512(_mm512_loadu_si512(a), first_fold);
+    const __m512i block_last =
+        _mm512_or_si512(_mm512_loadu_si512(b), last_fold);
+
+    const __mmask64 eq_first = _mm512_cmpeq_epi8_mask(first, block_first);
+
+    return _mm512_mask_cmpeq_epi8_mask(eq_first, last, block_last);
+  }
+
+  static FORCE_INLINE mask equal(vector c, const char* a)
+  {
+    return _mm512_cmpeq_epi8_mask(c, _mm512_loadu_si512(a));
+  }
+};
+
+}  // namespace
+
+size_t avx512bw_strstr(const char* s, size_t n, const strstr_needle& needle)
+{
+  return strstr_v2<avx512bw_block, false>(s, n, needle);
+}
+
+size_t avx512bw_strcasestr(const char* s,
+                           size_t n,
+                           const strstr_needle& needle)
+{
+  return strstr_v2<avx512bw_block, true>(s, n, needle);
+}
+
+size_t avx512bw_strstr_all(const char* s,
+                           size_t n,
+                           const strstr_needle& needle,
+                           size_t* positions,
+                           size_t max)
+{
+  return strstr_all<avx512bw_block, false>(s, n, needle, positions, max);
+}
+
+size_t avx512bw_strcasestr_all(const char* s,
+                               size_t n,
+                               const strstr_needle& needle,
+                               size_t* positions,
+                               size_t max)
+{
+  return strstr_all<avx512bw_block, true>(s, n, needle, positions, max);
+}
+
+size_t avx512bw_count_byte(const char* s, size_t n, char c)
+{
+  return count_byte<avx512bw_block>(s, n, c);
+}
+
+}  // namespace search
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+
+namespace search
+{
+/* Rank of every byte value by how often it occurs in source trees, from
+ * 0 (rarest) to 255 (space). Measured over C/C++ headers, Rust crates and
+ * the Python standard library; the substring prefilter anchors on the
+ * rarest bytes of the needle. */
+inline constexpr uint8_t byte_frequency_rank[256] = {
+     38,   0,   1,   2,   3,   4,   5,  42,  // 0x00
+      6, 182, 246,  44,  47, 152,   7,   8,  // 0x08
+      9,  10,  11,  12,  13,  14,  15,  16,  // 0x10
+     17,  18,  19,  43,  20,  21,  22,  23,  // 0x18
+    255, 171, 214, 212, 155, 157, 174, 207,  // 0x20
+    236, 237, 216, 168, 238, 199, 220, 221,  // 0x28
+    217, 209, 208, 200, 190, 194, 189, 178,  // 0x30
+    184, 188, 233, 210, 180, 211, 191, 160,  // 0x38
+    166, 226, 196, 222, 205, 234, 204, 197,  // 0x40
+    181, 228, 163, 183, 219, 202, 225, 224,  // 0x48
+    215, 165, 223, 235, 230, 198, 185, 172,  // 0x50
+    195, 177, 164, 187, 179, 186, 130, 252,  // 0x58
+    176, 247, 229, 244, 241, 254, 239, 227,  // 0x60
+    231, 248, 167, 213, 243, 232, 250, 245,  // 0x68
+    240, 175, 249, 251, 253, 242, 203, 201,  // 0x70
+    206, 218, 173, 193, 169, 192, 142,  24,  // 0x78
+    150, 134, 138, 122, 161, 162, 159, 141,  // 0x80
+    132,  98,  97,  89,  94, 113,  90, 110,  // 0x88
+    140, 151,  99,  84,  96, 143, 153,  79,  // 0x90
+     81, 115, 112,  83,  86, 145, 120, 137,  // 0x98
+    103,  87,  85, 102, 101, 104,  93,  91,  // 0xa0
+    107, 114, 106, 105, 117, 116, 147, 118,  // 0xa8
+    135, 121, 125, 126, 131, 124,  88, 136,  // 0xb0
+    139, 127, 133,  95, 123, 109, 100, 108,  // 0xb8
+     25,  39,  70,  82,  66,  67,  56,  63,  // 0xc0
+     62,  57,  54,  50, 154,  71,  80,  73,  // 0xc8
+     92,  76,  60,  64,  58,  52, 146,  74,  // 0xd0
+     77,  78,  53,  59,  55,  49,  46,  51,  // 0xd8
+    144, 170, 156, 119,  61,  75,  72,  69,  // 0xe0
+     68,  65, 129, 148, 149, 128,  45, 111,  // 0xe8
+    158,  26,  27,  48,  28,  29,  40,  30,  // 0xf0
+     31,  32,  33,  34,  35,  36,  37,  41,  // 0xf8
+};
+
+}  // namespace search
@@ -0,0 +1,478 @@
+#include <optional>
+#include <sstream>
+#include <streambuf>
+
+#include <argparse.hpp>
+#include <cli.hpp>
+#include <corpus.hpp>
+#include <pipeline.hpp>
+#include <sorted_search.hpp>
+#include <searcher.hpp>
+#include <unistd.h>
+#include <watch.hpp>
+namespace fs = std::filesystem;
+
+namespace search
+{
+namespace
+{
+/* Line input straight from a file descriptor, which need not be stdin */
+class fd_streambuf : public std::streambuf
+{
+public:
+  explicit fd_streambuf(int fd)
+      : m_fd(fd)
+  {
+  }
+
+protected:
+  int_type underflow() override
+  {
+    if (gptr() < egptr()) {
+      return traits_type::to_int_type(*gptr());
+    }
+
+    ssize_t length;
+    do {
+      length = ::read(m_fd, m_buffer, sizeof(m_buffer));
+    } while (length < 0 && errno == EINTR);
+    if (length <= 0) {
+      return traits_type::eof();
+    }
+
+    setg(m_buffer, m_buffer, m_buffer + length);
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  int m_fd;
+  char m_buffer[64 * 1024];
+};
+
+/* A pool of num_threads threads, or with 0, one sized from the machine.
+ *
+ * That pool has threads_per_cpu threads per CPU, each pinned to a CPU; one
+ * per CPU is active at first, and the pool activates more while tasks
+ * block (on a cold disk or NFS, more reads in flight help) and retires
+ * them while tasks are preempted. A file is read and searched by the same
+ * thread, so with the threads pinned, its buffer is first touched, and so
+ * allocated, on the NUMA node of the CPU that searches it; no NUMA library
+ * is needed for that. */
+constexpr unsigned threads_per_cpu = 4;
+
+std::unique_ptr<thread_pool> make_pool(int num_threads)
+{
+  if (num_threads > 0) {
+    return std::make_unique<thread_pool>(num_threads);
+  }
+  const auto cpus = std::max(1u, std::thread::hardware_concurrency());
+  auto pool = std::make_unique<thread_pool>(cpus * threads_per_cpu);
+  pool->pin_threads();
+  pool->adapt_active_threads(cpus);
+  return pool;
+}
+
+void print_usage_error(std::FILE* err,
+                       std::string_view message,
+                       const argparse::ArgumentParser& program)
+{
+  std::ostringstream usage;
+  usage << program;
+  fmt::print(err, "{}\n{}", message, usage.str());
+}
+
+}  // namespace
+
+int run_cli(int argc,
+            char* argv[],
+            const cli_streams& streams,
+            const corpus* resident)
+{
+  const auto is_path_from_terminal = isatty(streams.in) == 1;
+  const auto is_stdout = isatty(fileno(streams.out)) == 1;
+  argparse::ArgumentParser program("search", "0.2.0\n");
+  program.add_argument("query").nargs(argparse::nargs_pattern::optional);
+  program.add_argument("path").remaining();
+
+  // Generic Program Information
+  program.add_argument("-h", "--help")
+      .help("Shows help message and exits")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-f", "--filter")
+      .help("Only evaluate files that match filter pattern")
+      .default_value(std::string {"*.*"});
+
+  program.add_argument("-g", "--glob")
+      .help("Include files matching GLOB, or exclude them with !GLOB; "
+            "repeatable, later globs take precedence")
+      .append();
+
+  program.add_argument("-t", "--type")
+      .help("Only search files of TYPE; repeatable. Types: "
+            + search::file_filter::type_names())
+      .append();
+
+  program.add_argument("--no-ignore")
+      .help("Search files that .gitignore and .ignore files exclude")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-e", "--regexp")
+      .help("Search for PATTERN; repeat to search for several at once")
+      .append();
+
+  program.add_argument("-E", "--regex")
+      .help("Treat patterns as regular expressions; \\b, backreferences, "
+            "lookaround and inline flags such as (?i) are not supported "
+            "(use -i)")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-i", "--ignore-case")
+      .help("Match ASCII letters regardless of case")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-n", "--line-number")
+      .help("Prefix each matching line with its line number")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-l", "--files-with-matches")
+      .help("Only print the names of files with a match")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-c", "--count")
+      .help("Only print the number of matching lines per file")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-q", "--quiet")
+      .help("Print nothing; exit with status 0 on the first match")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--mmap-threshold")
+      .help("Map files of at least this many bytes; -1 never maps")
+      .scan<'d', int>()
+      .default_value(1 << 20);
+
+  program.add_argument("--stream")
+      .help("Read files in fixed-size chunks to bound memory use")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--index")
+      .help("Search directories through the index written by `index build`")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--pipeline")
+      .help("Read files on threads of their own, ahead of the searches")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--sort")
+      .help("Write results in the order of KEY, the same on every run; the "
+            "only KEY is `path`");
+
+  program.add_argument("--watch")
+      .help("Keep following the paths, searching what is appended or changed")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--server")
+      .help("Send the search to the `serve` daemon listening on this socket");
+
+  program.add_argument("-j")
+      .help("Number of threads; 0 picks one per CPU, pinned, and adds more "
+            "while files are slow to read")
+      .scan<'d', int>()
+      .default_value(0);
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::runtime_error& err) {
+    print_usage_error(streams.err, err.what(), program);
+    return 1;
+  }
+
+  enum class file_option_t
+  {
+    none,
+    single_file,
+    single_directory,
+    multiple
+  };
+
+  file_option_t file_option;
+
+  std::vector<std::string> patterns;
+  std::optional<std::string> leading_path;
+  if (program.is_used("-e")) {
+    patterns = program.get<std::vector<std::string>>("-e");
+    // With -e, the first positional argument is a path, not the query
+    leading_path = program.present("query");
+  } else if (auto query = program.present("query")) {
+    patterns.push_back(*query);
+  } else {
+    print_usage_error(streams.err, "Error: no query given", program);
+    return 1;
+  }
+
+  std::vector<std::string> paths;
+  if (is_path_from_terminal) {
+    // Input arguments ARE paths to files or directories
+    // Parse the arguments
+    try {
+      paths = program.get<std::vector<std::string>>("path");
+      if (leading_path) {
+        paths.insert(paths.begin(), *leading_path);
+      }
+      auto size = paths.size();
+
+      if (size == 1) {
+        if (fs::is_regular_file(fs::path(paths[0]))) {
+          file_option = file_option_t::single_file;
+        } else if (fs::is_directory(fs::path(paths[0]))) {
+          file_option = file_option_t::single_directory;
+        } else {
+          // Reported as an invalid path below
+          file_option = file_option_t::multiple;
+        }
+      } else {
+        file_option = file_option_t::multiple;
+      }
+    } catch (std::logic_error& e) {
+      // No files provided
+      file_option = file_option_t::none;
+      if (leading_path) {
+        paths.push_back(*leading_path);
+        file_option = fs::is_regular_file(fs::path(paths[0]))
+            ? file_option_t::single_file
+            : file_option_t::single_directory;
+      }
+    }
+  }
+
+  auto filter = program.get<std::string>("-f");
+  auto ignore_case = program.get<bool>("-i");
+  auto use_regex = program.get<bool>("-E");
+
+  // Configure a searcher; a daemon runs many searches, so nothing may be
+  // left over from the last one
+  searcher searcher;
+  searcher.m_literals.reset();
+  searcher.m_regex.reset();
+  searcher.m_file_filter = file_filter();
+  searcher.m_mode = output_mode::lines;
+  searcher.m_matched = false;
+  searcher.m_out = streams.out;
+  searcher.m_err = streams.err;
+  if (use_regex) {
+    std::string pattern = patterns.front();
+    if (patterns.size() > 1) {
+      pattern.clear();
+      for (const auto& p : patterns) {
+        pattern += (pattern.empty() ? "(?:" : "|(?:") + p + ")";
+      }
+    }
+    try {
+      searcher.m_regex = std::make_unique<regex>(pattern, ignore_case);
+    } catch (const regex_error& err) {
+      fmt::print(streams.err, "{}\n", err.what());
+      return 1;
+    }
+
+    // Matches must contain one of these (lowercase with -i), so they take
+    // the place of the query as a prefilter
+    patterns = searcher.m_regex->literals();
+    if (patterns.empty()) {
+      patterns.emplace_back();
+    }
+  } else if (ignore_case) {
+    // The case-folding kernels compare against a lowercase needle
+    for (auto& pattern : patterns) {
+      std::transform(pattern.begin(),
+                     pattern.end(),
+                     pattern.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+    }
+  }
+  auto num_threads = program.get<int>("-j");
+  if (num_threads < 0) {
+    print_usage_error(streams.err, "Error: -j cannot be negative", program);
+    return 1;
+  }
+
+  searcher.m_query = patterns.front();
+  searcher.m_needle = compile_needle(searcher.m_query, ignore_case);
+  if (patterns.size() > 1) {
+    searcher.m_literals =
+        std::make_unique<multi_literal>(patterns, ignore_case);
+  }
+  if (program.get<bool>("-q")) {
+    searcher.m_mode = output_mode::quiet;
+  } else if (program.get<bool>("-l")) {
+    searcher.m_mode = output_mode::files_with_matches;
+  } else if (program.get<bool>("-c")) {
+    searcher.m_mode = output_mode::count;
+  }
+  searcher.m_line_number = program.get<bool>("-n");
+  searcher.m_mmap_threshold = program.get<int>("--mmap-threshold");
+  searcher.m_stream = program.get<bool>("--stream");
+  searcher.m_ignore_case = ignore_case;
+  try {
+    auto& file_filter = searcher.m_file_filter;
+    if (program.is_used("-g")) {
+      for (const auto& glob : program.get<std::vector<std::string>>("-g")) {
+        file_filter.add_glob(glob);
+      }
+    }
+    if (program.is_used("-t")) {
+      for (const auto& type : program.get<std::vector<std::string>>("-t")) {
+        file_filter.add_type(type);
+      }
+    }
+    if (filter != "*.*") {
+      file_filter.set_pattern(filter);
+    }
+    file_filter.compile();
+  } catch (const std::exception& err) {
+    fmt::print(streams.err, "Error: {}\n", err.what());
+    return 1;
+  }
+  searcher.m_no_ignore = program.get<bool>("--no-ignore");
+  searcher.m_is_stdout = is_stdout;
+  searcher.m_is_path_from_terminal = is_path_from_terminal;
+
+  const auto use_index = program.get<bool>("--index");
+  const auto use_pipeline = program.get<bool>("--pipeline");
+  const auto sort = program.present("--sort");
+  if (sort && *sort != "path") {
+    print_usage_error(
+        streams.err, "Error: --sort only takes `path`, not " + *sort, program);
+    return 1;
+  }
+  if (sort && (use_index || use_pipeline)) {
+    print_usage_error(streams.err,
+                      "Error: --sort cannot be combined with --index or "
+                      "--pipeline",
+                      program);
+    return 1;
+  }
+  const auto directory_search = [&](const char* path)
+  {
+    if (use_index) {
+      searcher.indexed_search(path);
+    } else if (sort) {
+      sorted_search(path);
+    } else if (resident == nullptr || searcher.m_no_ignore
+               || !resident->search(path))
+    {
+      use_pipeline ? pipelined_search(path) : searcher.directory_search(path);
+    }
+  };
+
+  if (program.get<bool>("--watch")) {
+    if (resident != nullptr || !is_path_from_terminal) {
+      fmt::print(streams.err,
+                 "Error: --watch follows paths, not {}\n",
+                 resident != nullptr ? "a server" : "standard input");
+      return 1;
+    }
+    searcher.m_ts = make_pool(num_threads);
+    try {
+      return watch(paths.empty() ? std::vector<std::string> {"."} : paths,
+                   streams.err);
+    } catch (const std::runtime_error& err) {
+      fmt::print(streams.err, "Error: {}\n", err.what());
+      return 1;
+    }
+  }
+
+  bool failed = false;
+  if (is_path_from_terminal) {
+    if (resident == nullptr) {
+      searcher.m_ts = make_pool(num_threads);
+    }
+    // Input arguments ARE paths to files or directories
+    try {
+      if (file_option == file_option_t::none) {
+        directory_search(".");
+      } else if (file_option == file_option_t::single_file) {
+        searcher.read_file_and_search_split((const char*)paths[0].c_str());
+      } else if (file_option == file_option_t::single_directory) {
+        directory_search((const char*)paths[0].c_str());
+      } else if (file_option == file_option_t::multiple) {
+        for (const auto& path : paths) {
+          if (searcher.m_mode == output_mode::quiet && searcher.m_matched) {
+            break;
+          }
+          if (fs::is_regular_file(fs::path(path))) {
+            searcher.read_file_and_search_split((const char*)path.c_str());
+          } else if (fs::is_directory(fs::path(path))) {
+            directory_search((const char*)path.c_str());
+          } else {
+            fmt::print(streams.out,
+                       fmt::fg(fmt::color::red) | fmt::emphasis::bold,
+                       "\nError: '{}' is not a valid file or directory\n",
+                       path);
+            failed = true;
+            break;
+          }
+        }
+      }
+    } catch (const std::runtime_error& err) {
+      fmt::print(streams.err, "Error: {}\n", err.what());
+      failed = true;
+    }
+
+    // -q pauses the pool on the first match; a daemon keeps using it, so
+    // let the tasks left behind run out, which they do right away
+    if (resident != nullptr && searcher.m_ts->paused) {
+      searcher.m_ts->paused = false;
+      searcher.m_ts->wait_for_tasks();
+    }
+  } else {
+    // Input is from pipe
+    fd_streambuf input_buffer(streams.in);
+    std::istream input(&input_buffer);
+    const auto min_size = searcher.m_literals
+        ? searcher.m_literals->min_length()
+        : searcher.m_query.size();
+    const auto stop_at_first = searcher.m_mode == output_mode::quiet
+        || searcher.m_mode == output_mode::files_with_matches;
+    std::size_t count = 0;
+    std::size_t line_number = 0;
+    for (std::string line; std::getline(input, line);) {
+      ++line_number;
+      if (!line.empty() && line.size() >= min_size) {
+        count += searcher.file_search("", line, line_number);
+        if (count > 0 && stop_at_first) {
+          break;
+        }
+      }
+    }
+
+    if (searcher.m_mode == output_mode::count) {
+      fmt::print(streams.out, "{}\n", count);
+    } else if (searcher.m_mode == output_mode::files_with_matches
+               && count > 0)
+    {
+      fmt::print(streams.out, "(standard input)\n");
+    }
+  }
+  std::fflush(streams.out);
+
+  if (failed) {
+    return 1;
+  }
+  // Like grep: 0 if anything matched, 1 otherwise
+  return searcher.m_matched ? 0 : 1;
+}
+
+}  // namespace search
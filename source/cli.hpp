@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdio>
+
+namespace search
+{
+class corpus;
+
+/* The standard streams of one run of the command line: the process's own,
+ * or the ones a client handed to the `serve` daemon */
+struct cli_streams
+{
+  int in = 0;
+  std::FILE* out = stdout;
+  std::FILE* err = stderr;
+};
+
+/* Parses the command line, runs the search it describes and returns the
+ * exit status: 0 if anything matched, 1 if nothing did or on error.
+ *
+ * With a resident corpus, directories below its root are searched from
+ * memory, and the existing searcher::m_ts is used as is instead of a new
+ * pool of -j threads. */
+int run_cli(int argc,
+            char* argv[],
+            const cli_streams& streams,
+            const corpus* resident = nullptr);
+
+}  // namespace search
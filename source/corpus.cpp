@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#include <unordered_map>
+
+#include <corpus.hpp>
+#include <fcntl.h>
+#include <searcher.hpp>
+#include <unistd.h>
+namespace fs = std::filesystem;
+
+namespace search
+{
+/* Files are copied rather than mapped: a file truncated while the daemon
+ * holds a mapping of it would fault on the next search */
+struct corpus::resident_file
+{
+  std::string relative;
+  file_stamp stamp;
+  std::string contents;
+};
+
+std::unique_ptr<corpus::resident_file> corpus::load_file(
+    const char* path,
+    std::string relative,
+    const file_stamp& stamp)
+{
+  const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  auto file = std::make_unique<resident_file>();
+  file->relative = std::move(relative);
+  file->stamp = stamp;
+  file->contents.reserve(stamp.size);
+
+  char buffer[64 * 1024];
+  while (true) {
+    const auto result = ::read(fd, buffer, sizeof(buffer));
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    file->contents.append(buffer, static_cast<std::size_t>(result));
+  }
+  ::close(fd);
+  return file;
+}
+
+corpus::corpus(const std::string& root)
+    : m_root(fs::canonical(root).string())
+{
+  refresh();
+}
+
+corpus::~corpus() = default;
+
+void corpus::refresh()
+{
+  std::unordered_map<std::string_view, resident_file*> previous;
+  for (const auto& file : m_files) {
+    previous.emplace(file->relative, file.get());
+  }
+
+  std::vector<std::unique_ptr<resident_file>> files;
+  std::vector<resident_file*> kept;
+  std::mutex mutex;
+
+  // Every file the ignore rules let through; queries filter on their own
+  file_filter everything;
+  everything.add_glob("*");
+  everything.compile();
+  std::swap(searcher::m_file_filter, everything);
+
+  // The walk also goes by what the last query set: --no-ignore would let
+  // ignored files in, and a -q that matched would stop it at once
+  const auto no_ignore = searcher::m_no_ignore;
+  const auto mode = searcher::m_mode;
+  const bool matched = searcher::m_matched;
+  searcher::m_no_ignore = false;
+  searcher::m_mode = output_mode::lines;
+  searcher::m_matched = false;
+
+  searcher::walk_files(
+      m_root.c_str(),
+      [&](std::string_view path, std::size_t root_length)
+      {
+        file_stamp stamp;
+        if (!read_file_stamp(path.data(), stamp)) {
+          return;
+        }
+
+        std::string relative(path.substr(root_length));
+        const auto found = previous.find(relative);
+        if (found != previous.end() && found->second->stamp == stamp) {
+          const std::lock_guard<std::mutex> lock(mutex);
+          kept.push_back(found->second);
+          return;
+        }
+
+        auto file = load_file(path.data(), std::move(relative), stamp);
+        if (file) {
+          const std::lock_guard<std::mutex> lock(mutex);
+          files.push_back(std::move(file));
+        }
+      });
+
+  std::swap(searcher::m_file_filter, everything);
+  searcher::m_no_ignore = no_ignore;
+  searcher::m_mode = mode;
+  searcher::m_matched = matched;
+
+  // Move the unchanged files over; the rest of m_files is released
+  std::sort(kept.begin(), kept.end());
+  for (auto& file : m_files) {
+    if (std::binary_search(kept.begin(), kept.end(), file.get())) {
+      files.push_back(std::move(file));
+    }
+  }
+  m_files = std::move(files);
+}
+
+bool corpus::search(const std::string& path) const
+{
+  std::error_code error;
+  const auto absolute =
+      fs::weakly_canonical(fs::absolute(path, error), error);
+  if (error) {
+    return false;
+  }
+
+  // Path of the directory below the root, empty or ending in '/'
+  auto below = absolute.string();
+  if (below == m_root) {
+    below.clear();
+  } else if (below.size() > m_root.size()
+             && below.compare(0, m_root.size(), m_root) == 0
+             && below[m_root.size()] == '/')
+  {
+    below.erase(0, m_root.size() + 1);
+    below += '/';
+  } else {
+    return false;
+  }
+
+  // Files are named as a walk of path names them
+  const auto prefix = path.back() == '/' ? path : path + '/';
+  const auto root_length = prefix.size();
+  const auto& filter = searcher::m_file_filter;
+
+  bool any = false;
+  for (const auto& file : m_files) {
+    if (file->relative.compare(0, below.size(), below) != 0) {
+      continue;
+    }
+    any = true;
+
+    auto name = prefix + file->relative.substr(below.size());
+    bool excluded = false;
+    for (auto slash = name.find('/', root_length);
+         slash != std::string::npos && !excluded;
+         slash = name.find('/', slash + 1))
+    {
+      excluded = filter.is_excluded_directory(
+          std::string_view(name).substr(0, slash), root_length);
+    }
+    if (excluded || !filter.is_selected(name, root_length)) {
+      continue;
+    }
+
+    searcher::m_ts->push_task(
+        [name = std::move(name), haystack = std::string_view(file->contents)]()
+        {
+          if (searcher::m_mode == output_mode::quiet && searcher::m_matched)
+          {
+            return;
+          }
+          try {
+            searcher::file_search(name, haystack);
+          } catch (const std::exception& e) {
+          }
+        });
+  }
+
+  searcher::m_ts->wait_for_tasks();
+  return any;
+}
+
+}  // namespace search
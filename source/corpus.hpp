@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <trigram_index.hpp>
+
+namespace search
+{
+/* The files below a directory, read once and kept in memory, so that the
+ * `serve` daemon answers queries without touching the disk.
+ *
+ * Files that a directory search would see are loaded whatever their name,
+ * since -g, --type and -f differ from one query to the next and are
+ * applied per query. Ignore files are honoured while loading. */
+class corpus
+{
+public:
+  /* Loads the files below root, on searcher::m_ts */
+  explicit corpus(const std::string& root);
+  ~corpus();
+
+  corpus(const corpus&) = delete;
+  corpus& operator=(const corpus&) = delete;
+
+  /* Walks root again; files whose stamp is unchanged keep their contents,
+   * the others are loaded anew */
+  void refresh();
+
+  /* Searches the resident files below the directory path, named as the
+   * query named it, as directory_search would search that directory. Does
+   * nothing and returns false when path is not below the root, or holds no
+   * resident files, so that the caller searches the disk instead. */
+  bool search(const std::string& path) const;
+
+  std::size_t size() const
+  {
+    return m_files.size();
+  }
+
+  const std::string& root() const
+  {
+    return m_root;
+  }
+
+private:
+  struct resident_file;
+
+  static std::unique_ptr<resident_file> load_file(const char* path,
+                                                  std::string relative,
+                                                  const file_stamp& stamp);
+
+  std::string m_root;
+  std::vector<std::unique_ptr<resident_file>> m_files;
+};
+
+}  // namespace search
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include <file_filter.hpp>
+
+namespace search
+{
+namespace
+{
+struct file_type
+{
+  std::string_view name;
+  std::vector<std::string_view> globs;
+};
+
+const std::vector<file_type>& file_types()
+{
+  static const std::vector<file_type> types = {
+      {"antlr", {"*.g4"}},
+      {"c", {"*.c", "*.h"}},
+      {"cmake", {"CMakeLists.txt", "*.cmake"}},
+      {"cpp",
+       {"*.cpp", "*.cc", "*.cxx", "*.c++", "*.h", "*.hh", "*.hxx", "*.hpp",
+        "*.inl"}},
+      {"csv", {"*.csv"}},
+      {"cuda", {"*.cu", "*.cuh"}},
+      {"go", {"*.go"}},
+      {"java", {"*.java"}},
+      {"js", {"*.js", "*.mjs", "*.cjs", "*.jsx"}},
+      {"json", {"*.json"}},
+      {"md", {"*.md", "*.markdown"}},
+      {"py", {"*.py", "*.pyi"}},
+      {"rust", {"*.rs", "*.rs.in"}},
+      {"sh", {"*.sh", "*.bash", "*.zsh"}},
+      {"ts", {"*.ts", "*.tsx"}},
+      {"txt", {"*.txt"}},
+      {"xml", {"*.xml"}},
+      {"yaml", {"*.yml", "*.yaml"}},
+  };
+  return types;
+}
+
+// Searched when no -g, --type or -f says otherwise
+constexpr std::string_view default_globs[] = {
+    // ANTLR
+    "*.g4",
+    // C
+    "*.c",
+    "*.h",
+    // C++
+    "*.cpp",
+    "*.cc",
+    "*.cxx",
+    "*.hh",
+    "*.hxx",
+    "*.hpp",
+    // CUDA
+    "*.cu",
+    "*.cuh",
+    // Go
+    "*.go",
+    // Java
+    "*.java",
+    // JavaScript
+    "*.js",
+    // Markdown
+    "*.md",
+    // Python
+    "*.py",
+    // Rust
+    "*.rs",
+    "*.rs.in",
+    // Shell
+    "*.sh",
+    "*.bash",
+    // Text
+    "*.txt",
+    "*.csv",
+    "*.json",
+    "*.xml",
+    "*.yml",
+    "*.yaml",
+};
+
+bool has_slash(std::string_view glob)
+{
+  return glob.find('/') != std::string_view::npos;
+}
+
+}  // namespace
+
+file_filter::file_filter()
+{
+  for (const auto glob : default_globs) {
+    m_defaults.add(glob, true);
+  }
+}
+
+void file_filter::add_glob(std::string_view glob)
+{
+  const bool negated = !glob.empty() && glob[0] == '!';
+  if (negated) {
+    glob.remove_prefix(1);
+  }
+  if (!glob.empty() && glob[0] == '/') {
+    glob.remove_prefix(1);
+  }
+  // As in ignore files, a trailing '/' only matches directories
+  const bool dir_only = !glob.empty() && glob.back() == '/';
+  if (dir_only) {
+    glob.remove_suffix(1);
+  }
+  if (glob.empty()) {
+    return;
+  }
+
+  m_globs.add(glob, !has_slash(glob), dir_only);
+  m_negated.push_back(negated);
+  m_has_includes = m_has_includes || (!negated && !dir_only);
+}
+
+void file_filter::add_type(std::string_view name)
+{
+  const auto& types = file_types();
+  const auto type = std::find_if(types.begin(),
+                                 types.end(),
+                                 [&](const file_type& candidate)
+                                 { return candidate.name == name; });
+  if (type == types.end()) {
+    throw std::invalid_argument("unknown file type '" + std::string(name)
+                                + "'; known types are " + type_names());
+  }
+
+  for (const auto glob : type->globs) {
+    m_types.add(glob, true);
+  }
+}
+
+void file_filter::set_pattern(std::string_view pattern)
+{
+  // fnmatch without FNM_PATHNAME, so '*' also matches '/'
+  m_pattern = std::make_unique<regex>(glob_to_regex(pattern, true));
+}
+
+void file_filter::compile()
+{
+  m_globs.compile();
+  m_types.compile();
+  m_defaults.compile();
+}
+
+bool file_filter::is_selected(std::string_view path,
+                              std::size_t root_length) const
+{
+  const auto index = m_globs.last_match(path.substr(root_length));
+  if (index >= 0) {
+    return !m_negated[index];
+  }
+  if (m_has_includes) {
+    return false;
+  }
+
+  if (!m_types.empty()) {
+    return m_types.last_match(path) >= 0;
+  }
+  if (m_pattern) {
+    return m_pattern->full_match(path);
+  }
+  // The default -f pattern "*.*", as fnmatch without FNM_PATHNAME matches
+  // it, takes any path with a '.' in it, so a walk of "./" takes every file
+  return m_defaults.last_match(path) >= 0
+      || path.find('.') != std::string_view::npos;
+}
+
+bool file_filter::is_excluded_directory(std::string_view path,
+                                        std::size_t root_length) const
+{
+  const auto index = m_globs.last_match(path.substr(root_length), true);
+  return index >= 0 && m_negated[index];
+}
+
+std::string file_filter::type_names()
+{
+  std::string names;
+  for (const auto& type : file_types()) {
+    names += (names.empty() ? "" : ", ") + std::string(type.name);
+  }
+  return names;
+}
+
+}  // namespace search
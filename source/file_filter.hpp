@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <glob_set.hpp>
+#include <regex.hpp>
+
+namespace search
+{
+/* Decides which files a directory walk searches.
+ *
+ * Every selector (-g globs, --type groups, the -f pattern and the default
+ * list of source extensions) is compiled into glob_sets up front, so a
+ * file costs a few hash lookups whatever the number of patterns.
+ *
+ * Precedence, highest first:
+ *  - -g globs: the last one that matches decides; a `!glob` excludes. When
+ *    any non-negated -g is given, files that match none are skipped.
+ *  - --type: the file must match one of the selected groups.
+ *  - -f: the file's path must match the pattern, as with fnmatch.
+ *  - otherwise the file must have one of the default extensions, or
+ *    match the default -f pattern "*.*", i.e. have a '.' anywhere in its
+ *    path. */
+class file_filter
+{
+public:
+  file_filter();
+
+  /* Adds a -g glob; a leading '!' makes it an exclude. Globs without a '/'
+   * match the file name, others the path relative to the searched
+   * directory. Throws regex_error for globs that cannot be compiled. */
+  void add_glob(std::string_view glob);
+
+  /* Selects a named group such as "cpp" or "py"; throws
+   * std::invalid_argument for names not in type_names() */
+  void add_type(std::string_view name);
+
+  /* The -f pattern, matched against the whole path */
+  void set_pattern(std::string_view pattern);
+
+  /* Builds the matchers; call once everything is added */
+  void compile();
+
+  /* Whether the file at path is searched. The first root_length bytes of
+   * path are the searched directory: globs see the path below it, while
+   * the -f pattern sees all of it. */
+  bool is_selected(std::string_view path, std::size_t root_length) const;
+
+  /* Whether a directory is excluded by a `!glob` and must not be walked */
+  bool is_excluded_directory(std::string_view path,
+                             std::size_t root_length) const;
+
+  /* The names accepted by add_type, comma-separated */
+  static std::string type_names();
+
+private:
+  glob_set m_globs;
+  std::vector<bool> m_negated;
+  bool m_has_includes = false;
+
+  glob_set m_types;
+  std::unique_ptr<regex> m_pattern;
+  glob_set m_defaults;
+};
+
+}  // namespace search
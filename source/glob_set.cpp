@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cstring>
+
+#include <glob_set.hpp>
+
+namespace search
+{
+namespace
+{
+void append_literal(std::string& out, char c)
+{
+  if (c != '\0' && std::strchr(".^$|()[]{}*+?\\", c) != nullptr) {
+    out += '\\';
+  }
+  out += c;
+}
+
+bool is_literal(std::string_view glob)
+{
+  return glob.find_first_of("*?[\\") == std::string_view::npos;
+}
+
+void add_length(std::vector<std::size_t>& lengths, std::size_t length)
+{
+  if (std::find(lengths.begin(), lengths.end(), length) == lengths.end()) {
+    lengths.push_back(length);
+  }
+}
+
+}  // namespace
+
+std::string glob_to_regex(std::string_view glob, bool star_matches_slash)
+{
+  std::string out;
+
+  for (std::size_t i = 0; i < glob.size(); ++i) {
+    const char c = glob[i];
+    switch (c) {
+      case '*': {
+        if (star_matches_slash) {
+          out += ".*";
+          break;
+        }
+        if (i + 1 >= glob.size() || glob[i + 1] != '*') {
+          out += "[^/]*";
+          break;
+        }
+        // "**/" matches any number of directories, other "**" anything
+        const bool at_component_start = i == 0 || glob[i - 1] == '/';
+        ++i;
+        if (at_component_start && i + 1 < glob.size() && glob[i + 1] == '/') {
+          out += "(?:.*/)?";
+          ++i;
+        } else {
+          out += ".*";
+        }
+        break;
+      }
+
+      case '?':
+        out += star_matches_slash ? "." : "[^/]";
+        break;
+
+      case '[': {
+        auto end = i + 1;
+        if (end < glob.size() && (glob[end] == '!' || glob[end] == '^')) {
+          ++end;
+        }
+        if (end < glob.size() && glob[end] == ']') {
+          ++end;
+        }
+        end = glob.find(']', end);
+        if (end == std::string_view::npos) {
+          // Unterminated, so a literal '['
+          out += "\\[";
+          break;
+        }
+
+        out += '[';
+        auto j = i + 1;
+        if (glob[j] == '!' || glob[j] == '^') {
+          out += "^/";
+          ++j;
+        }
+        for (; j < end; ++j) {
+          if (glob[j] == '\\' || glob[j] == '[') {
+            out += '\\';
+          }
+          out += glob[j];
+        }
+        out += ']';
+        i = end;
+        break;
+      }
+
+      case '\\':
+        if (i + 1 < glob.size()) {
+          ++i;
+        }
+        append_literal(out, glob[i]);
+        break;
+
+      default:
+        append_literal(out, c);
+        break;
+    }
+  }
+
+  return out;
+}
+
+void glob_set::add(std::string_view glob, bool match_basename, bool dir_only)
+{
+  const auto index = static_cast<uint32_t>(m_dir_only.size());
+
+  if (is_literal(glob)) {
+    auto& map = match_basename ? m_basenames : m_paths;
+    entry(map, glob).push_back(index);
+  } else if (match_basename && glob[0] == '*' && is_literal(glob.substr(1))) {
+    // A basename has no '/', so "*.o" is just a suffix test
+    const auto suffix = glob.substr(1);
+    entry(m_suffixes, suffix).push_back(index);
+    add_length(m_suffix_lengths, suffix.size());
+  } else if (match_basename && glob.back() == '*'
+             && is_literal(glob.substr(0, glob.size() - 1)))
+  {
+    // Likewise "Makefile*" is a prefix test
+    const auto prefix = glob.substr(0, glob.size() - 1);
+    entry(m_prefixes, prefix).push_back(index);
+    add_length(m_prefix_lengths, prefix.size());
+  } else {
+    auto source = glob_to_regex(glob);
+    auto pattern = std::make_unique<regex>(source);
+    m_regexes.push_back(
+        {index, match_basename, std::move(source), std::move(pattern)});
+  }
+
+  m_dir_only.push_back(dir_only);
+}
+
+void glob_set::compile()
+{
+  std::string basenames;
+  std::string paths;
+  for (const auto& glob : m_regexes) {
+    auto& combined = glob.match_basename ? basenames : paths;
+    combined += (combined.empty() ? "(?:" : "|(?:") + glob.source + ")";
+  }
+
+  m_any_basename =
+      basenames.empty() ? nullptr : std::make_unique<regex>(basenames);
+  m_any_path = paths.empty() ? nullptr : std::make_unique<regex>(paths);
+}
+
+std::vector<uint32_t>& glob_set::entry(index_map& map, std::string_view key)
+{
+  const auto found = map.find(key);
+  if (found != map.end()) {
+    return found->second;
+  }
+  return map[m_keys.emplace_back(key)];
+}
+
+long glob_set::last_in(const index_map& map,
+                       std::string_view key,
+                       bool is_dir,
+                       long best) const
+{
+  const auto found = map.find(key);
+  if (found == map.end()) {
+    return best;
+  }
+
+  const auto& indices = found->second;
+  for (auto it = indices.rbegin();
+       it != indices.rend() && static_cast<long>(*it) > best;
+       ++it)
+  {
+    if (is_dir || !m_dir_only[*it]) {
+      return *it;
+    }
+  }
+  return best;
+}
+
+long glob_set::last_match(std::string_view path, bool is_dir) const
+{
+  const auto slash = path.rfind('/');
+  const auto basename =
+      slash == std::string_view::npos ? path : path.substr(slash + 1);
+
+  long best = -1;
+  best = last_in(m_basenames, basename, is_dir, best);
+  best = last_in(m_paths, path, is_dir, best);
+  for (const auto length : m_suffix_lengths) {
+    if (length <= basename.size()) {
+      best = last_in(
+          m_suffixes, basename.substr(basename.size() - length), is_dir, best);
+    }
+  }
+  for (const auto length : m_prefix_lengths) {
+    if (length <= basename.size()) {
+      best = last_in(m_prefixes, basename.substr(0, length), is_dir, best);
+    }
+  }
+
+  const bool any_basename =
+      m_any_basename && m_any_basename->full_match(basename);
+  const bool any_path = m_any_path && m_any_path->full_match(path);
+  if (!any_basename && !any_path) {
+    return best;
+  }
+
+  for (auto it = m_regexes.rbegin();
+       it != m_regexes.rend() && static_cast<long>(it->index) > best;
+       ++it)
+  {
+    if (!(it->match_basename ? any_basename : any_path)
+        || (m_dir_only[it->index] && !is_dir))
+    {
+      continue;
+    }
+    if (it->pattern->full_match(it->match_basename ? basename : path)) {
+      return it->index;
+    }
+  }
+  return best;
+}
+
+}  // namespace search
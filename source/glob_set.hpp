@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <regex.hpp>
+
+namespace search
+{
+/* Translates a shell glob to the regex syntax of search::regex:
+ * `*` and `?` stop at '/', `**` spans directories, and `[...]` / `[!...]`
+ * are character classes. With star_matches_slash, `*` and `?` match '/'
+ * too, like fnmatch without FNM_PATHNAME. */
+std::string glob_to_regex(std::string_view glob,
+                          bool star_matches_slash = false);
+
+/* A set of globs matched against a path all at once.
+ *
+ * Most globs in ignore files and -g arguments are plain names (`build`),
+ * extensions (`*.o`), name prefixes (`Makefile*`) or fixed paths
+ * (`src/gen`). Those are looked up in hash tables; only the rest is
+ * compiled to regexes, which are tried behind one combined regex so that
+ * a path that matches none of them costs a single DFA pass. */
+class glob_set
+{
+public:
+  /* Adds a glob. With match_basename, it is matched against the last
+   * component of the path, otherwise against the whole path. A dir_only
+   * glob only matches directories. */
+  void add(std::string_view glob, bool match_basename, bool dir_only = false);
+
+  /* Builds the combined regexes; call once all globs are added */
+  void compile();
+
+  /* Index (in order of add) of the last glob that matches path, or -1 */
+  long last_match(std::string_view path, bool is_dir = false) const;
+
+  std::size_t size() const
+  {
+    return m_dir_only.size();
+  }
+
+  bool empty() const
+  {
+    return m_dir_only.empty();
+  }
+
+private:
+  // Keyed by views of m_keys, so that a lookup allocates nothing
+  using index_map =
+      std::unordered_map<std::string_view, std::vector<uint32_t>>;
+
+  struct regex_glob
+  {
+    uint32_t index;
+    bool match_basename;
+    std::string source;
+    std::unique_ptr<regex> pattern;
+  };
+
+  std::vector<uint32_t>& entry(index_map& map, std::string_view key);
+  long last_in(const index_map& map,
+               std::string_view key,
+               bool is_dir,
+               long best) const;
+
+  std::vector<bool> m_dir_only;
+
+  // A deque never moves its elements, so the views stay valid
+  std::deque<std::string> m_keys;
+
+  // Exact basenames, basename suffixes such as ".o" and prefixes, and
+  // exact paths; the lengths are those of the keys present
+  index_map m_basenames;
+  index_map m_suffixes;
+  index_map m_prefixes;
+  index_map m_paths;
+  std::vector<std::size_t> m_suffix_lengths;
+  std::vector<std::size_t> m_prefix_lengths;
+
+  std::vector<regex_glob> m_regexes;
+  // Alternations of every regex glob, over basenames and over paths
+  std::unique_ptr<regex> m_any_basename;
+  std::unique_ptr<regex> m_any_path;
+};
+
+}  // namespace search
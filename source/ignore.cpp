@@ -0,0 +1,150 @@
+#include <cerrno>
+
+#include <fcntl.h>
+#include <ignore.hpp>
+#include <unistd.h>
+
+namespace search
+{
+namespace
+{
+// Ignore files are small; anything past this is not worth reading
+constexpr std::size_t max_ignore_file_size = 1 << 20;
+
+std::string read_relative_file(int dir_fd, const char* name)
+{
+  std::string contents;
+
+  const int fd = ::openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return contents;
+  }
+
+  char buffer[4096];
+  while (contents.size() < max_ignore_file_size) {
+    const auto result = ::read(fd, buffer, sizeof(buffer));
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    contents.append(buffer, static_cast<std::size_t>(result));
+  }
+
+  ::close(fd);
+  return contents;
+}
+
+}  // namespace
+
+std::shared_ptr<const ignore_rules> ignore_rules::load(
+    int dir_fd,
+    std::string_view path,
+    const ignore_files& files,
+    std::shared_ptr<const ignore_rules> parent)
+{
+  if (!files.git_exclude && !files.gitignore && !files.ignore) {
+    return parent;
+  }
+
+  auto rules = std::make_shared<ignore_rules>();
+  rules->m_base = std::string(path);
+  if (rules->m_base.empty() || rules->m_base.back() != '/') {
+    rules->m_base += '/';
+  }
+
+  // Lowest precedence first, since the last matching rule wins
+  if (files.git_exclude) {
+    rules->add_rules(read_relative_file(dir_fd, ".git/info/exclude"));
+  }
+  if (files.gitignore) {
+    rules->add_rules(read_relative_file(dir_fd, ".gitignore"));
+  }
+  if (files.ignore) {
+    rules->add_rules(read_relative_file(dir_fd, ".ignore"));
+  }
+
+  if (rules->m_globs.empty()) {
+    return parent;
+  }
+  rules->m_globs.compile();
+  rules->m_parent = std::move(parent);
+  return rules;
+}
+
+void ignore_rules::add_rules(std::string_view contents)
+{
+  while (!contents.empty()) {
+    const auto newline = contents.find('\n');
+    auto line = contents.substr(0, newline);
+    contents.remove_prefix(
+        newline == std::string_view::npos ? contents.size() : newline + 1);
+
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+
+    // Trailing spaces are dropped unless escaped with a backslash
+    while (!line.empty() && line.back() == ' '
+           && !(line.size() > 1 && line[line.size() - 2] == '\\'))
+    {
+      line.remove_suffix(1);
+    }
+
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    bool negated = false;
+    if (line[0] == '!') {
+      negated = true;
+      line.remove_prefix(1);
+    } else if (line[0] == '\\' && line.size() > 1
+               && (line[1] == '!' || line[1] == '#'))
+    {
+      line.remove_prefix(1);
+    }
+
+    bool dir_only = false;
+    if (!line.empty() && line.back() == '/') {
+      dir_only = true;
+      line.remove_suffix(1);
+    }
+
+    // A slash anywhere but at the end ties the pattern to this directory;
+    // without one it matches a name at any depth
+    const bool match_basename = line.find('/') == std::string_view::npos;
+    if (!line.empty() && line[0] == '/') {
+      line.remove_prefix(1);
+    }
+    if (line.empty()) {
+      continue;
+    }
+
+    try {
+      m_globs.add(line, match_basename, dir_only);
+      m_negated.push_back(negated);
+    } catch (const regex_error&) {
+      // Skip patterns we cannot compile, like git does with invalid ones
+    }
+  }
+}
+
+bool ignore_rules::is_ignored(std::string_view path, bool is_dir) const
+{
+  for (auto rules = this; rules != nullptr; rules = rules->m_parent.get()) {
+    auto relative = path;
+    if (relative.substr(0, rules->m_base.size()) == rules->m_base) {
+      relative.remove_prefix(rules->m_base.size());
+    }
+
+    const auto index = rules->m_globs.last_match(relative, is_dir);
+    if (index >= 0) {
+      return !rules->m_negated[index];
+    }
+  }
+  return false;
+}
+
+}  // namespace search
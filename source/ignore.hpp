@@ -0,0 +1,50 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <glob_set.hpp>
+
+namespace search
+{
+/* Which ignore files a directory has, as seen while listing it */
+struct ignore_files
+{
+  bool git_exclude = false;  // .git/info/exclude, for a repository root
+  bool gitignore = false;
+  bool ignore = false;
+};
+
+/* The gitignore-style rules of one directory, chained to the rules of the
+ * directories above it. Rules of deeper directories take precedence, and
+ * within a directory .ignore overrides .gitignore, which overrides
+ * .git/info/exclude; the last matching rule decides, so `!pattern`
+ * re-includes what an earlier rule ignored. */
+class ignore_rules
+{
+public:
+  /* Rules for the directory open as dir_fd at path. When it has no ignore
+   * files, parent is returned as is, so that subdirectories share their
+   * parent's compiled rules instead of parsing anything again. */
+  static std::shared_ptr<const ignore_rules> load(
+      int dir_fd,
+      std::string_view path,
+      const ignore_files& files,
+      std::shared_ptr<const ignore_rules> parent);
+
+  /* Whether path, somewhere below the directory the rules were loaded for,
+   * is ignored */
+  bool is_ignored(std::string_view path, bool is_dir) const;
+
+private:
+  void add_rules(std::string_view contents);
+
+  // Directory of the ignore files, ending in '/'
+  std::string m_base;
+  glob_set m_globs;
+  std::vector<bool> m_negated;
+  std::shared_ptr<const ignore_rules> m_parent;
+};
+
+}  // namespace search
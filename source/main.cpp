@@ -1,114 +1,86 @@
-#include <argparse.hpp>
+#include <algorithm>
+
+#include <cli.hpp>
 #include <searcher.hpp>
-#include <unistd.h>
+#include <server.hpp>
 namespace fs = std::filesystem;
 
-int main(int argc, char* argv[])
+namespace
 {
-  const auto is_path_from_terminal = isatty(STDIN_FILENO) == 1;
-  const auto is_stdout = isatty(STDOUT_FILENO) == 1;
-  std::ios_base::sync_with_stdio(false);
-  std::cin.tie(NULL);
-  argparse::ArgumentParser program("search", "0.2.0\n");
-  program.add_argument("query");
-  program.add_argument("path").remaining();
-
-  // Generic Program Information
-  program.add_argument("-h", "--help")
-      .help("Shows help message and exits")
-      .default_value(false)
-      .implicit_value(true);
-
-  program.add_argument("-f", "--filter")
-      .help("Only evaluate files that match filter pattern")
-      .default_value(std::string {"*.*"});
-
-  program.add_argument("-j")
-      .help("Number of threads")
-      .scan<'d', int>()
-      .default_value(5);
+/* oy index build [DIR]: writes or refreshes the trigram index of DIR */
+int index_command(int argc, char* argv[])
+{
+  if (argc < 3 || argc > 4 || std::string_view(argv[2]) != "build") {
+    std::cerr << "Usage: " << argv[0] << " index build [DIR]" << std::endl;
+    return 1;
+  }
+  const std::string root = argc == 4 ? argv[3] : ".";
+  if (!fs::is_directory(fs::path(root))) {
+    std::cerr << "Error: '" << root << "' is not a directory" << std::endl;
+    return 1;
+  }
 
+  search::searcher searcher;
+  searcher.m_file_filter.compile();
+  searcher.m_ts = std::make_unique<thread_pool>(
+      std::max(1u, std::thread::hardware_concurrency()));
   try {
-    program.parse_args(argc, argv);
+    const auto stats = search::trigram_index::build(root);
+    fmt::print("Indexed {} files ({} read), {} trigrams\n",
+               stats.files,
+               stats.read,
+               stats.trigrams);
   } catch (const std::runtime_error& err) {
-    std::cerr << err.what() << std::endl;
-    std::cerr << program;
-    std::exit(1);
+    std::cerr << "Error: " << err.what() << std::endl;
+    return 1;
   }
+  return 0;
+}
 
-  enum class file_option_t
-  {
-    none,
-    single_file,
-    single_directory,
-    multiple
-  };
-
-  file_option_t file_option;
-
-  std::vector<std::string> paths;
-  if (is_path_from_terminal) {
-    // Input arguments ARE paths to files or directories
-    // Parse the arguments
-    try {
-      paths = program.get<std::vector<std::string>>("path");
-      auto size = paths.size();
+}  // namespace
 
-      if (size == 1) {
-        if (fs::is_regular_file(fs::path(paths[0]))) {
-          file_option = file_option_t::single_file;
-        } else if (fs::is_directory(fs::path(paths[0]))) {
-          file_option = file_option_t::single_directory;
-        }
-      } else {
-        file_option = file_option_t::multiple;
-      }
-    } catch (std::logic_error& e) {
-      // No files provided
-      file_option = file_option_t::none;
-    }
+/* oy serve SOCKET [DIR]: keeps DIR in memory and answers --server clients */
+int serve_command(int argc, char* argv[])
+{
+  if (argc < 3 || argc > 4) {
+    std::cerr << "Usage: " << argv[0] << " serve SOCKET [DIR]" << std::endl;
+    return 1;
   }
+  const std::string root = argc == 4 ? argv[3] : ".";
+  if (!fs::is_directory(fs::path(root))) {
+    std::cerr << "Error: '" << root << "' is not a directory" << std::endl;
+    return 1;
+  }
+  return search::serve(argv[2], root);
+}
 
-  auto query = program.get<std::string>("query");
-  auto filter = program.get<std::string>("-f");
-  auto num_threads = program.get<int>("-j");
-
-  // Configure a searcher
-  search::searcher searcher;
-  searcher.m_query = query;
-  searcher.m_filter = filter;
-  searcher.m_is_stdout = is_stdout;
-  searcher.m_is_path_from_terminal = is_path_from_terminal;
+int main(int argc, char* argv[])
+{
+  // Subcommands come before any option, so they are told apart by hand
+  if (argc >= 2 && std::string_view(argv[1]) == "index") {
+    return index_command(argc, argv);
+  }
+  if (argc >= 2 && std::string_view(argv[1]) == "serve") {
+    return serve_command(argc, argv);
+  }
 
-  if (is_path_from_terminal) {
-    searcher.m_ts = std::make_unique<thread_pool>(num_threads);
-    // Input arguments ARE paths to files or directories
-    if (file_option == file_option_t::none) {
-      searcher.directory_search(".");
-    } else if (file_option == file_option_t::single_file) {
-      searcher.read_file_and_search((const char*)paths[0].c_str());
-    } else if (file_option == file_option_t::single_directory) {
-      searcher.directory_search((const char*)paths[0].c_str());
-    } else if (file_option == file_option_t::multiple) {
-      for (const auto& path : paths) {
-        if (fs::is_regular_file(fs::path(path))) {
-          searcher.read_file_and_search((const char*)path.c_str());
-        } else if (fs::is_directory(fs::path(path))) {
-          searcher.directory_search((const char*)path.c_str());
-        } else {
-          fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold,
-                     "\nError: '{}' is not a valid file or directory\n",
-                     path);
-          std::exit(1);
-        }
-      }
-    }
-  } else {
-    // Input is from pipe
-    for (std::string line; std::getline(std::cin, line);) {
-      if (!line.empty() && line.size() >= query.size()) {
-        searcher.file_search("", line);
-      }
-    }
+  // With --server, the daemon does the work. Help and version output may
+  // end the process that prints them, so those stay here.
+  const auto find_arg = [&](std::string_view name)
+  {
+    return std::find_if(argv + 1,
+                        argv + argc,
+                        [&](const char* arg) { return arg == name; });
+  };
+  const auto server = find_arg("--server");
+  const auto end = argv + argc;
+  if (server != end && server + 1 != end && find_arg("-h") == end
+      && find_arg("--help") == end && find_arg("-v") == end
+      && find_arg("--version") == end)
+  {
+    return search::run_client(*(server + 1), argc, argv);
   }
+
+  std::ios_base::sync_with_stdio(false);
+  return search::run_cli(argc, argv, {});
 }
@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cstring>
+#include <queue>
+
+#include <multi_literal.hpp>
+
+namespace search
+{
+namespace
+{
+/* Teddy verification cost grows with the number of patterns per bucket;
+ * past this many needles the automaton is faster. */
+constexpr std::size_t teddy_max_patterns = 32;
+
+constexpr uint32_t no_state = UINT32_MAX;
+
+bool has_ssse3()
+{
+#if defined(OYSTR_RUNTIME_DISPATCH)
+  static const bool result = []
+  {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") != 0;
+  }();
+  return result;
+#else
+  return false;
+#endif
+}
+
+char to_lower(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c | 0x20) : c;
+}
+
+char to_upper(char c)
+{
+  return (c >= 'a' && c <= 'z') ? static_cast<char>(c & ~0x20) : c;
+}
+
+// b is lowercase
+bool equal_fold(const char* a, const char* b, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    if (to_lower(a[i]) != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct teddy_context
+{
+  const multi_literal* self;
+  const char* s;
+  std::size_t n;
+  std::size_t length;
+};
+
+}  // namespace
+
+multi_literal::multi_literal(std::vector<std::string> patterns,
+                             bool ignore_case)
+    : m_patterns(std::move(patterns))
+    , m_ignore_case(ignore_case)
+{
+  if (m_ignore_case) {
+    for (auto& pattern : m_patterns) {
+      std::transform(pattern.begin(), pattern.end(), pattern.begin(), to_lower);
+    }
+  }
+
+  // Sorting keeps needles with shared prefixes in the same Teddy bucket
+  std::sort(m_patterns.begin(), m_patterns.end());
+  m_patterns.erase(std::unique(m_patterns.begin(), m_patterns.end()),
+                   m_patterns.end());
+
+  if (m_patterns.empty()) {
+    return;
+  }
+
+  m_min_length = m_patterns.front().size();
+  for (const auto& pattern : m_patterns) {
+    m_min_length = std::min(m_min_length, pattern.size());
+    m_max_length = std::max(m_max_length, pattern.size());
+  }
+
+  if (m_min_length == 0) {
+    // An empty needle matches everywhere; no need for an engine
+    return;
+  }
+
+  m_use_teddy = m_patterns.size() <= teddy_max_patterns && has_ssse3();
+  if (m_use_teddy) {
+    build_teddy();
+  } else {
+    build_automaton();
+  }
+}
+
+void multi_literal::build_teddy()
+{
+#if defined(OYSTR_RUNTIME_DISPATCH)
+  m_masks.length = std::min<std::size_t>(3, m_min_length);
+
+  const auto num_patterns = m_patterns.size();
+  for (std::size_t i = 0; i < num_patterns; ++i) {
+    const auto bucket = i * m_buckets.size() / num_patterns;
+    const auto bit = static_cast<uint8_t>(1u << bucket);
+    const auto& pattern = m_patterns[i];
+
+    for (std::size_t j = 0; j < m_masks.length; ++j) {
+      const auto c = static_cast<uint8_t>(pattern[j]);
+      m_masks.lo[j][c & 0x0f] |= bit;
+      m_masks.hi[j][c >> 4] |= bit;
+
+      if (m_ignore_case) {
+        const auto upper = static_cast<uint8_t>(to_upper(pattern[j]));
+        m_masks.lo[j][upper & 0x0f] |= bit;
+        m_masks.hi[j][upper >> 4] |= bit;
+      }
+    }
+    m_buckets[bucket].push_back(static_cast<uint32_t>(i));
+  }
+
+  for (auto& bucket : m_buckets) {
+    std::stable_sort(bucket.begin(),
+                     bucket.end(),
+                     [this](uint32_t a, uint32_t b)
+                     { return m_patterns[a].size() > m_patterns[b].size(); });
+  }
+#endif
+}
+
+void multi_literal::build_automaton()
+{
+  // Bytes that occur in no pattern share class 0
+  m_classes.fill(0);
+  m_num_classes = 1;
+  for (const auto& pattern : m_patterns) {
+    for (const auto c : pattern) {
+      auto& cls = m_classes[static_cast<uint8_t>(c)];
+      if (cls == 0) {
+        cls = static_cast<uint8_t>(m_num_classes++);
+      }
+    }
+  }
+
+  // Patterns are lowercase; uppercase input bytes share their class
+  if (m_ignore_case) {
+    for (int c = 'A'; c <= 'Z'; ++c) {
+      m_classes[c] = m_classes[c | 0x20];
+    }
+  }
+
+  // Trie
+  m_delta.assign(m_num_classes, no_state);
+  m_out_length.assign(1, 0);
+  for (const auto& pattern : m_patterns) {
+    uint32_t state = 0;
+    for (const auto c : pattern) {
+      const auto slot =
+          state * m_num_classes + m_classes[static_cast<uint8_t>(c)];
+      if (m_delta[slot] == no_state) {
+        m_delta[slot] = static_cast<uint32_t>(m_out_length.size());
+        m_out_length.push_back(0);
+        m_delta.resize(m_delta.size() + m_num_classes, no_state);
+      }
+      state = m_delta[slot];
+    }
+    m_out_length[state] = static_cast<uint32_t>(pattern.size());
+  }
+
+  // Failure links, folded directly into a complete transition table
+  std::vector<uint32_t> fail(m_out_length.size(), 0);
+  std::queue<uint32_t> queue;
+  for (std::size_t cls = 0; cls < m_num_classes; ++cls) {
+    auto& next = m_delta[cls];
+    if (next == no_state) {
+      next = 0;
+    } else {
+      queue.push(next);
+    }
+  }
+
+  while (!queue.empty()) {
+    const auto state = queue.front();
+    queue.pop();
+
+    m_out_length[state] =
+        std::max(m_out_length[state], m_out_length[fail[state]]);
+
+    for (std::size_t cls = 0; cls < m_num_classes; ++cls) {
+      auto& next = m_delta[state * m_num_classes + cls];
+      const auto fallback = m_delta[fail[state] * m_num_classes + cls];
+      if (next == no_state) {
+        next = fallback;
+      } else {
+        fail[next] = fallback;
+        queue.push(next);
+      }
+    }
+  }
+}
+
+literal_match multi_literal::find(std::string_view haystack) const
+{
+  if (m_patterns.empty()) {
+    return {std::string_view::npos, 0};
+  }
+  if (m_min_length == 0) {
+    return {0, 0};
+  }
+  if (haystack.size() < m_min_length) {
+    return {std::string_view::npos, 0};
+  }
+
+  return m_use_teddy ? teddy_find(haystack) : automaton_find(haystack);
+}
+
+bool multi_literal::teddy_verify(void* context,
+                                 std::size_t pos,
+                                 unsigned buckets)
+{
+  auto& ctx = *static_cast<teddy_context*>(context);
+  const auto* self = ctx.self;
+  const auto remaining = ctx.n - pos;
+
+  std::size_t best = 0;
+  while (buckets != 0) {
+    const auto bucket = __builtin_ctz(buckets);
+
+    for (const auto index : self->m_buckets[bucket]) {
+      const auto& pattern = self->m_patterns[index];
+      if (pattern.size() <= best) {
+        // Buckets are sorted longest first
+        break;
+      }
+      if (pattern.size() <= remaining
+          && (self->m_ignore_case
+                  ? equal_fold(ctx.s + pos, pattern.data(), pattern.size())
+                  : std::memcmp(ctx.s + pos, pattern.data(), pattern.size())
+                      == 0))
+      {
+        best = pattern.size();
+        break;
+      }
+    }
+
+    buckets &= buckets - 1;
+  }
+
+  ctx.length = best;
+  return best != 0;
+}
+
+literal_match multi_literal::teddy_find(std::string_view haystack) const
+{
+#if defined(OYSTR_RUNTIME_DISPATCH)
+  teddy_context ctx {this, haystack.data(), haystack.size(), 0};
+  const auto pos = ssse3_teddy_find(
+      m_masks, haystack.data(), haystack.size(), teddy_verify, &ctx);
+  return {pos, ctx.length};
+#else
+  return automaton_find(haystack);
+#endif
+}
+
+literal_match multi_literal::automaton_find(std::string_view haystack) const
+{
+  const auto* delta = m_delta.data();
+  const auto* classes = m_classes.data();
+  const auto num_classes = m_num_classes;
+
+  literal_match best {std::string_view::npos, 0};
+  uint32_t state = 0;
+
+  for (std::size_t i = 0; i < haystack.size(); ++i) {
+    const auto cls = classes[static_cast<uint8_t>(haystack[i])];
+    state = delta[state * num_classes + cls];
+
+    const auto length = m_out_length[state];
+    if (length != 0) {
+      const auto start = i + 1 - length;
+      if (start < best.position
+          || (start == best.position && length > best.length))
+      {
+        best = {start, length};
+      }
+    }
+
+    // No match that is still open can start at or before best.position
+    if (best.position != std::string_view::npos
+        && i + 1 >= best.position + m_max_length)
+    {
+      break;
+    }
+  }
+
+  return best;
+}
+
+}  // namespace search
@@ -0,0 +1,73 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <teddy.hpp>
+
+namespace search
+{
+struct literal_match
+{
+  std::size_t position;
+  std::size_t length;
+};
+
+/* Finds any of N literal needles in a single pass over the haystack.
+ *
+ * Small pattern sets are scanned with the SSSE3 Teddy fingerprint
+ * prefilter and verified per bucket; large sets (or hosts without SSSE3)
+ * use an Aho-Corasick automaton over byte equivalence classes. */
+class multi_literal
+{
+public:
+  /* With ignore_case, ASCII letters match in either case */
+  explicit multi_literal(std::vector<std::string> patterns,
+                         bool ignore_case = false);
+
+  /* Leftmost match in haystack. Among patterns that start at the same
+   * position, the longest one wins. position is npos if nothing matched. */
+  literal_match find(std::string_view haystack) const;
+
+  const std::vector<std::string>& patterns() const
+  {
+    return m_patterns;
+  }
+
+  std::size_t min_length() const
+  {
+    return m_min_length;
+  }
+
+private:
+  void build_teddy();
+  void build_automaton();
+
+  literal_match teddy_find(std::string_view haystack) const;
+  literal_match automaton_find(std::string_view haystack) const;
+
+  static bool teddy_verify(void* context, std::size_t pos, unsigned buckets);
+
+  std::vector<std::string> m_patterns;
+  std::size_t m_min_length = 0;
+  std::size_t m_max_length = 0;
+  bool m_ignore_case = false;
+  bool m_use_teddy = false;
+
+  teddy_masks m_masks = {};
+
+  // Pattern indices per Teddy bucket, longest first
+  std::array<std::vector<uint32_t>, 8> m_buckets;
+
+  // Aho-Corasick automaton; transitions are indexed by
+  // state * m_num_classes + m_classes[byte]
+  std::array<uint8_t, 256> m_classes = {};
+  std::size_t m_num_classes = 0;
+  std::vector<uint32_t> m_delta;
+  std::vector<uint32_t> m_out_length;
+};
+
+}  // namespace search
@@ -0,0 +1,611 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <pipeline.hpp>
+#include <searcher.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uring.hpp>
+
+namespace search
+{
+output_queue::output_queue(std::FILE* out, std::size_t max_bytes)
+    : m_out(out)
+    , m_max_bytes(max_bytes)
+    , m_thread([this] { write_all(); })
+{
+}
+
+output_queue::~output_queue()
+{
+  {
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+  }
+  m_not_empty.notify_one();
+  m_thread.join();
+}
+
+void output_queue::push(std::string_view text)
+{
+  if (text.empty()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_not_full.wait(lock,
+                  [&]
+                  {
+                    return m_bytes == 0
+                        || m_bytes + text.size() <= m_max_bytes;
+                  });
+  m_queue.emplace_back(text);
+  m_bytes += text.size();
+  lock.unlock();
+  m_not_empty.notify_one();
+}
+
+void output_queue::write_all()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_not_empty.wait(lock, [this] { return m_closed || !m_queue.empty(); });
+    if (m_queue.empty()) {
+      break;
+    }
+    const auto text = std::move(m_queue.front());
+    m_queue.pop_front();
+
+    lock.unlock();
+    std::fwrite(text.data(), 1, text.size(), m_out);
+    lock.lock();
+
+    m_bytes -= text.size();
+    m_not_full.notify_all();
+  }
+}
+
+namespace
+{
+// Threads that only read files; more keep more reads in flight on a slow
+// disk or network file system
+constexpr std::size_t reader_threads = 4;
+
+// Files the io_uring reader has open or opening at once. Each has at most
+// two operations in flight, and a closed file one more for a short while,
+// so the ring has room for all of them
+constexpr unsigned uring_files = 64;
+constexpr unsigned uring_entries = 256;
+
+// A read asks for no more than this, so that its length fits the ring's
+constexpr std::size_t max_uring_read = 1 << 30;
+
+// Bytes of file contents read and not yet searched
+constexpr std::size_t max_bytes_in_flight = 64 << 20;
+
+// Bytes of output formatted and not yet written
+constexpr std::size_t max_output_bytes = 8 << 20;
+
+// How often a reader waiting for room looks whether -q has its match
+constexpr auto quiet_check_interval = std::chrono::milliseconds(10);
+
+bool is_done()
+{
+  return searcher::m_mode == output_mode::quiet && searcher::m_matched;
+}
+
+struct file_buffer
+{
+  std::unique_ptr<char[]> data;
+  std::size_t capacity = 0;
+};
+
+class pipeline
+{
+public:
+  pipeline()
+      : m_uring(uring::create(uring_entries))
+  {
+    if (m_uring) {
+      m_readers.emplace_back([this] { read_files_uring(); });
+      return;
+    }
+    for (std::size_t i = 0; i < reader_threads; ++i) {
+      m_readers.emplace_back([this] { read_files(); });
+    }
+  }
+
+  pipeline(const pipeline&) = delete;
+  pipeline& operator=(const pipeline&) = delete;
+
+  ~pipeline()
+  {
+    finish();
+  }
+
+  /* Queues the file at path to be read */
+  void add(std::string_view path)
+  {
+    {
+      const std::lock_guard<std::mutex> lock(m_path_mutex);
+      m_paths.emplace_back(path);
+    }
+    m_path_added.notify_one();
+  }
+
+  /* Waits until every file queued is read and searched */
+  void finish()
+  {
+    {
+      const std::lock_guard<std::mutex> lock(m_path_mutex);
+      m_closed = true;
+    }
+    m_path_added.notify_all();
+    for (auto& reader : m_readers) {
+      if (reader.joinable()) {
+        reader.join();
+      }
+    }
+
+    // Files still queued on a pool that -q paused are let go; they refer
+    // to this pipeline, so they have to run, if only to return at once
+    auto& pool = *searcher::m_ts;
+    const bool paused = pool.paused;
+    pool.paused = false;
+    pool.wait_for_tasks();
+    pool.paused = paused;
+  }
+
+private:
+  struct read_file
+  {
+    pool_task task;
+    pipeline* owner;
+    std::string path;
+    file_buffer buffer;
+    std::size_t size;
+    // Bytes counted in flight for this file
+    std::size_t reserved;
+  };
+
+  /* A file the io_uring reader is opening or reading */
+  struct uring_file
+  {
+    std::unique_ptr<read_file> file;
+    struct statx info;
+    int fd = -1;
+    int stat_result = -1;
+    // Of openat and statx, which are submitted together
+    int opening = 2;
+    // Bytes read, and asked for by the read in flight
+    std::size_t length = 0;
+    std::size_t requested = 0;
+  };
+
+  // The operation a completion is for, in the low bits of its user data
+  enum uring_operation : uint64_t
+  {
+    uring_open,
+    uring_statx,
+    uring_read,
+    uring_operation_mask = 3,
+  };
+
+  void read_files()
+  {
+    while (true) {
+      std::string path;
+      {
+        std::unique_lock<std::mutex> lock(m_path_mutex);
+        m_path_added.wait(lock,
+                          [this] { return m_closed || !m_paths.empty(); });
+        if (m_paths.empty()) {
+          return;
+        }
+        path = std::move(m_paths.front());
+        m_paths.pop_front();
+      }
+      if (!is_done()) {
+        read(std::move(path));
+      }
+    }
+  }
+
+  /* Reads the files queued like read_files does, with a single thread that
+   * keeps the openat, statx, read and close of up to uring_files files in
+   * flight on m_uring */
+  void read_files_uring()
+  {
+    uring::completion completions[uring_entries];
+    while (true) {
+      resume_parked();
+      if (m_operations == 0 && !m_parked.empty()) {
+        // Only searches that finish free the room the parked files need
+        wait_for_room(m_parked.front()->file->reserved);
+        continue;
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(m_path_mutex);
+        if (m_operations == 0) {
+          m_path_added.wait(lock,
+                            [this] { return m_closed || !m_paths.empty(); });
+          if (m_paths.empty()) {
+            return;
+          }
+        }
+        while (!m_paths.empty() && m_files < uring_files) {
+          auto path = std::move(m_paths.front());
+          m_paths.pop_front();
+          if (!is_done()) {
+            open(std::move(path));
+          }
+        }
+      }
+      if (m_operations == 0) {
+        continue;
+      }
+
+      m_uring->submit(1);
+      const auto count = m_uring->reap(completions, uring_entries);
+      m_operations -= static_cast<unsigned>(count);
+      for (std::size_t i = 0; i < count; ++i) {
+        complete(completions[i]);
+      }
+    }
+  }
+
+  void open(std::string path)
+  {
+    auto* entry = new uring_file;
+    entry->file = std::make_unique<read_file>();
+    entry->file->owner = this;
+    entry->file->path = std::move(path);
+    const auto data = reinterpret_cast<uint64_t>(entry);
+    m_uring->prepare_open(entry->file->path.c_str(), data | uring_open);
+    m_uring->prepare_statx(
+        entry->file->path.c_str(), &entry->info, data | uring_statx);
+    m_operations += 2;
+    ++m_files;
+  }
+
+  void complete(const uring::completion& completion)
+  {
+    // Closes are not waited for
+    if (completion.user_data == 0) {
+      return;
+    }
+    const auto mask = uint64_t(uring_operation_mask);
+    auto* entry = reinterpret_cast<uring_file*>(completion.user_data & ~mask);
+    switch (completion.user_data & mask) {
+      case uring_open:
+        entry->fd = completion.result;
+        break;
+      case uring_statx:
+        entry->stat_result = completion.result;
+        break;
+      default:
+        read_some(entry, completion.result);
+        return;
+    }
+    if (--entry->opening == 0) {
+      opened(entry);
+    }
+  }
+
+  /* Starts reading a file once both its openat and statx are done */
+  void opened(uring_file* entry)
+  {
+    if (entry->fd < 0) {
+      done(entry);
+      return;
+    }
+    std::size_t size = 0;
+    if (entry->stat_result == 0 && S_ISREG(entry->info.stx_mode)) {
+      size = static_cast<std::size_t>(entry->info.stx_size);
+    }
+
+    auto& file = *entry->file;
+    const auto threshold = searcher::m_mmap_threshold;
+    if (searcher::m_stream
+        || (threshold >= 0 && size > 0
+            && size >= static_cast<std::size_t>(threshold)))
+    {
+      searcher::m_ts->push_task(
+          [path = std::move(file.path)]()
+          { searcher::read_file_and_search(path.c_str()); });
+      done(entry);
+      return;
+    }
+
+    file.reserved = size + 1;
+    // Waiting here for room would hold up the completions that free it
+    if (!m_parked.empty() || !try_acquire(file.reserved, file.buffer)) {
+      m_parked.push_back(entry);
+      return;
+    }
+    read_some(entry, -1);
+  }
+
+  /* Starts reading the parked files, in the order they were parked, for
+   * as long as there is room for them */
+  void resume_parked()
+  {
+    while (!m_parked.empty()) {
+      auto* entry = m_parked.front();
+      if (is_done()) {
+        done(entry);
+      } else if (try_acquire(entry->file->reserved, entry->file->buffer)) {
+        read_some(entry, -1);
+      } else {
+        return;
+      }
+      m_parked.pop_front();
+    }
+  }
+
+  /* Takes the result of the read in flight, if any (a negative result
+   * otherwise), and reads on until the file ends */
+  void read_some(uring_file* entry, int result)
+  {
+    auto& file = *entry->file;
+    if (result > 0) {
+      entry->length += static_cast<std::size_t>(result);
+    }
+    // A read of a regular file that comes short has reached its end
+    if (entry->requested == 0
+        || static_cast<std::size_t>(result) == entry->requested)
+    {
+      if (entry->length == file.buffer.capacity) {
+        // The file grew since statx
+        file_buffer bigger;
+        bigger.capacity = file.buffer.capacity * 2;
+        bigger.data.reset(new char[bigger.capacity]);
+        std::copy_n(file.buffer.data.get(), entry->length, bigger.data.get());
+        file.buffer = std::move(bigger);
+      }
+      entry->requested =
+          std::min(file.buffer.capacity - entry->length, max_uring_read);
+      m_uring->prepare_read(entry->fd,
+                            file.buffer.data.get() + entry->length,
+                            static_cast<unsigned>(entry->requested),
+                            entry->length,
+                            reinterpret_cast<uint64_t>(entry) | uring_read);
+      ++m_operations;
+      return;
+    }
+
+    file.size = entry->length;
+    file.task.function = &search;
+    file.task.argument = &file;
+    file.task.discard = &discard;
+    searcher::m_ts->push_task(entry->file.release()->task);
+    done(entry);
+  }
+
+  /* Closes the file, if it is open, and forgets it */
+  void done(uring_file* entry)
+  {
+    if (entry->fd >= 0) {
+      m_uring->prepare_close(entry->fd, 0);
+      ++m_operations;
+    }
+    if (entry->file && entry->file->buffer.data) {
+      release(std::move(entry->file->buffer), entry->file->reserved);
+    }
+    delete entry;
+    --m_files;
+  }
+
+  void read(std::string path)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    std::size_t size = 0;
+    if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+      size = static_cast<std::size_t>(info.st_size);
+    }
+
+    const auto threshold = searcher::m_mmap_threshold;
+    if (searcher::m_stream
+        || (threshold >= 0 && size > 0
+            && size >= static_cast<std::size_t>(threshold)))
+    {
+      ::close(fd);
+      searcher::m_ts->push_task(
+          [path = std::move(path)]()
+          { searcher::read_file_and_search(path.c_str()); });
+      return;
+    }
+
+    auto file = std::make_unique<read_file>();
+    file->owner = this;
+    file->path = std::move(path);
+    // One byte more than the size tells that the file ended
+    file->reserved = size + 1;
+    if (!acquire(file->reserved, file->buffer)) {
+      ::close(fd);
+      return;
+    }
+
+    std::size_t length = 0;
+    while (true) {
+      if (length == file->buffer.capacity) {
+        // The file grew since fstat
+        file_buffer bigger;
+        bigger.capacity = file->buffer.capacity * 2;
+        bigger.data.reset(new char[bigger.capacity]);
+        std::copy_n(file->buffer.data.get(), length, bigger.data.get());
+        file->buffer = std::move(bigger);
+      }
+      const auto result = ::read(fd,
+                                 file->buffer.data.get() + length,
+                                 file->buffer.capacity - length);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        break;
+      }
+      length += static_cast<std::size_t>(result);
+    }
+    ::close(fd);
+    file->size = length;
+
+    file->task.function = &search;
+    file->task.argument = file.get();
+    file->task.discard = &discard;
+    searcher::m_ts->push_task(file.release()->task);
+  }
+
+  /* Takes a buffer of at least size bytes, waiting while that would put
+   * more than max_bytes_in_flight in flight; false once -q has its match */
+  bool acquire(std::size_t size, file_buffer& buffer)
+  {
+    std::unique_lock<std::mutex> lock(m_buffer_mutex);
+    while (!has_room(size)) {
+      if (is_done()) {
+        return false;
+      }
+      m_buffer_released.wait_for(lock, quiet_check_interval);
+    }
+    take(size, buffer, lock);
+    return true;
+  }
+
+  /* Like acquire, but false at once when there is no room */
+  bool try_acquire(std::size_t size, file_buffer& buffer)
+  {
+    std::unique_lock<std::mutex> lock(m_buffer_mutex);
+    if (!has_room(size)) {
+      return false;
+    }
+    take(size, buffer, lock);
+    return true;
+  }
+
+  /* Waits until size bytes more fit in flight, or a while for -q */
+  void wait_for_room(std::size_t size)
+  {
+    std::unique_lock<std::mutex> lock(m_buffer_mutex);
+    m_buffer_released.wait_for(
+        lock, quiet_check_interval, [&] { return has_room(size); });
+  }
+
+  bool has_room(std::size_t size) const
+  {
+    return m_in_flight == 0 || m_in_flight + size <= max_bytes_in_flight;
+  }
+
+  /* Counts size bytes in flight and gives buffer a free buffer that is
+   * large enough, or a new one; lock is on m_buffer_mutex */
+  void take(std::size_t size,
+            file_buffer& buffer,
+            std::unique_lock<std::mutex>& lock)
+  {
+    m_in_flight += size;
+
+    // The smallest free buffer that is large enough
+    auto best = m_free.end();
+    for (auto it = m_free.begin(); it != m_free.end(); ++it) {
+      if (it->capacity >= size
+          && (best == m_free.end() || it->capacity < best->capacity))
+      {
+        best = it;
+      }
+    }
+    if (best != m_free.end()) {
+      buffer = std::move(*best);
+      m_free_bytes -= buffer.capacity;
+      *best = std::move(m_free.back());
+      m_free.pop_back();
+      return;
+    }
+    lock.unlock();
+
+    // Rounded up, so that the buffer fits more of the files that follow
+    buffer.capacity = 4096;
+    while (buffer.capacity < size) {
+      buffer.capacity *= 2;
+    }
+    buffer.data.reset(new char[buffer.capacity]);
+  }
+
+  void release(file_buffer buffer, std::size_t reserved)
+  {
+    {
+      const std::lock_guard<std::mutex> lock(m_buffer_mutex);
+      m_in_flight -= reserved;
+      if (m_free_bytes + buffer.capacity <= max_bytes_in_flight) {
+        m_free_bytes += buffer.capacity;
+        m_free.push_back(std::move(buffer));
+      }
+    }
+    m_buffer_released.notify_all();
+  }
+
+  static void search(void* argument)
+  {
+    std::unique_ptr<read_file> file(static_cast<read_file*>(argument));
+    if (!is_done()) {
+      try {
+        searcher::file_search(
+            file->path, std::string_view(file->buffer.data.get(), file->size));
+      } catch (const std::exception& e) {
+      }
+    }
+    file->owner->release(std::move(file->buffer), file->reserved);
+  }
+
+  static void discard(void* argument)
+  {
+    delete static_cast<read_file*>(argument);
+  }
+
+  std::mutex m_path_mutex;
+  std::condition_variable m_path_added;
+  std::deque<std::string> m_paths;
+  bool m_closed = false;
+
+  std::mutex m_buffer_mutex;
+  std::condition_variable m_buffer_released;
+  std::size_t m_in_flight = 0;
+  std::vector<file_buffer> m_free;
+  std::size_t m_free_bytes = 0;
+
+  // Used by the io_uring reader only
+  std::unique_ptr<uring> m_uring;
+  unsigned m_operations = 0;
+  unsigned m_files = 0;
+  // Opened, and waiting for room in flight to be read
+  std::deque<uring_file*> m_parked;
+
+  std::vector<std::thread> m_readers;
+};
+
+}  // namespace
+
+void pipelined_search(const char* path)
+{
+  output_queue output(searcher::m_out, max_output_bytes);
+  searcher::m_output = &output;
+  try {
+    pipeline stages;
+    searcher::walk_files(path,
+                         [&](std::string_view file, std::size_t)
+                         { stages.add(file); });
+    stages.finish();
+  } catch (...) {
+    searcher::m_output = nullptr;
+    throw;
+  }
+  searcher::m_output = nullptr;
+}
+
+}  // namespace search
@@ -0,0 +1,65 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace search
+{
+/* Output written to a stream by a thread of its own, so that a slow
+ * reader of the output holds up no search until max_bytes are waiting */
+class output_queue
+{
+public:
+  output_queue(std::FILE* out, std::size_t max_bytes);
+  /* Writes out everything queued, then stops the thread */
+  ~output_queue();
+
+  output_queue(const output_queue&) = delete;
+  output_queue& operator=(const output_queue&) = delete;
+
+  /* Queues text, waiting while the queue is full; text larger than
+   * max_bytes is taken once the queue is empty */
+  void push(std::string_view text);
+
+private:
+  void write_all();
+
+  std::FILE* m_out;
+  std::size_t m_max_bytes;
+
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+  std::deque<std::string> m_queue;
+  std::size_t m_bytes = 0;
+  bool m_closed = false;
+
+  std::thread m_thread;
+};
+
+/* --pipeline: searches the directory path like directory_search, with
+ * reading, searching and printing in stages of their own.
+ *
+ * The walk queues the files it selects for a few reader threads, which
+ * read each file whole into a recycled buffer and hand it to searcher::m_ts
+ * to be searched. Output goes through an output_queue. The buffers in
+ * flight, read and not yet searched, are capped in bytes, so readers wait
+ * for the searches and searches wait for the output instead of memory
+ * growing. On a cold cache this keeps reads in flight while the pool
+ * searches, rather than each thread alternating between the two.
+ *
+ * Where the kernel has io_uring, a single reader thread keeps the openat,
+ * statx, read and close of many files in flight on a ring instead, for a
+ * deep queue on the storage without a thread per read; elsewhere, or when
+ * io_uring is disabled, the reader threads use read().
+ *
+ * Files that directory_search would map or stream are handed to the pool
+ * unread and searched as it would search them. */
+void pipelined_search(const char* path);
+
+}  // namespace search
@@ -0,0 +1,1106 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include <regex.hpp>
+
+namespace search
+{
+namespace
+{
+constexpr int max_repeat = 1000;
+constexpr std::size_t max_nfa_states = 100000;
+
+/* A full cache is dropped and rebuilt from the current state, so memory
+ * stays bounded at max_dfa_states rows of byte-class transitions */
+constexpr std::size_t max_dfa_states = 4096;
+
+/* Regexes used by one thread at the same time: the query, plus the glob
+ * sets of the ignore files above the directory being walked */
+constexpr std::size_t caches_per_thread = 64;
+
+// Literal extraction limits
+constexpr std::size_t max_class_literals = 4;
+constexpr std::size_t max_cross_product = 16;
+constexpr std::size_t max_alternatives = 64;
+
+constexpr int32_t unknown_state = -1;
+
+constexpr uint8_t accepting = 1;
+constexpr uint8_t accepting_at_end = 2;
+constexpr uint8_t dead = 4;
+
+std::atomic<uint64_t> next_regex_id {1};
+
+// ---- Syntax tree --------------------------------------------------------
+
+struct node
+{
+  enum class kind
+  {
+    empty,
+    chars,
+    concat,
+    alternate,
+    repeat,
+    line_begin,
+    line_end
+  };
+
+  kind type = kind::empty;
+  std::bitset<256> chars;
+  std::vector<node> children;
+  int min = 0;
+  int max = 0;  // -1 is unbounded
+};
+
+std::bitset<256> make_set(int (*predicate)(int))
+{
+  std::bitset<256> set;
+  for (int c = 0; c < 128; ++c) {
+    if (predicate(c)) {
+      set.set(c);
+    }
+  }
+  return set;
+}
+
+int is_word(int c)
+{
+  return std::isalnum(c) || c == '_';
+}
+
+class parser
+{
+public:
+  parser(std::string_view pattern, bool ignore_case)
+      : m_pattern(pattern)
+      , m_ignore_case(ignore_case)
+  {
+  }
+
+  node parse()
+  {
+    auto root = parse_alternation();
+    if (!done()) {
+      fail("unmatched ')'");
+    }
+    return root;
+  }
+
+private:
+  [[noreturn]] void fail(const std::string& what) const
+  {
+    throw regex_error("regex: " + what + " at offset "
+                      + std::to_string(m_pos));
+  }
+
+  bool done() const
+  {
+    return m_pos >= m_pattern.size();
+  }
+
+  char peek() const
+  {
+    return m_pattern[m_pos];
+  }
+
+  std::bitset<256> fold(std::bitset<256> set) const
+  {
+    if (m_ignore_case) {
+      for (int c = 'a'; c <= 'z'; ++c) {
+        if (set.test(c) || set.test(c & ~0x20)) {
+          set.set(c);
+          set.set(c & ~0x20);
+        }
+      }
+    }
+    return set;
+  }
+
+  static node make_chars(const std::bitset<256>& set)
+  {
+    node n;
+    n.type = node::kind::chars;
+    n.chars = set;
+    return n;
+  }
+
+  node parse_alternation()
+  {
+    node first = parse_concat();
+    if (done() || peek() != '|') {
+      return first;
+    }
+
+    node alt;
+    alt.type = node::kind::alternate;
+    alt.children.push_back(std::move(first));
+    while (!done() && peek() == '|') {
+      ++m_pos;
+      alt.children.push_back(parse_concat());
+    }
+    return alt;
+  }
+
+  node parse_concat()
+  {
+    node seq;
+    seq.type = node::kind::concat;
+    while (!done() && peek() != '|' && peek() != ')') {
+      seq.children.push_back(parse_repeat());
+    }
+
+    if (seq.children.empty()) {
+      return node {};
+    }
+    if (seq.children.size() == 1) {
+      return std::move(seq.children.front());
+    }
+    return seq;
+  }
+
+  node parse_repeat()
+  {
+    node atom = parse_atom();
+
+    while (!done()) {
+      int min = 0;
+      int max = -1;
+
+      const char c = peek();
+      if (c == '*') {
+        ++m_pos;
+      } else if (c == '+') {
+        min = 1;
+        ++m_pos;
+      } else if (c == '?') {
+        max = 1;
+        ++m_pos;
+      } else if (c != '{' || !parse_bounds(min, max)) {
+        break;
+      }
+
+      // Lazy quantifier: only match boundaries differ, which a DFA
+      // reporting leftmost-longest matches does not distinguish
+      if (!done() && peek() == '?') {
+        ++m_pos;
+      }
+
+      node rep;
+      rep.type = node::kind::repeat;
+      rep.min = min;
+      rep.max = max;
+      rep.children.push_back(std::move(atom));
+      atom = std::move(rep);
+    }
+
+    return atom;
+  }
+
+  // {m}, {m,} or {m,n}; anything else leaves '{' to be read as a literal
+  bool parse_bounds(int& min, int& max)
+  {
+    std::size_t pos = m_pos + 1;
+
+    const auto number = [&](int& out)
+    {
+      const auto start = pos;
+      long value = 0;
+      while (pos < m_pattern.size() && std::isdigit(m_pattern[pos])) {
+        value = value * 10 + (m_pattern[pos] - '0');
+        if (value > max_repeat) {
+          fail("repetition count too large");
+        }
+        ++pos;
+      }
+      out = static_cast<int>(value);
+      return pos != start;
+    };
+
+    if (!number(min)) {
+      return false;
+    }
+    if (pos < m_pattern.size() && m_pattern[pos] == ',') {
+      ++pos;
+      if (!number(max)) {
+        max = -1;
+      }
+    } else {
+      max = min;
+    }
+    if (pos >= m_pattern.size() || m_pattern[pos] != '}') {
+      return false;
+    }
+    if (max != -1 && max < min) {
+      fail("invalid repetition bounds");
+    }
+
+    m_pos = pos + 1;
+    return true;
+  }
+
+  node parse_atom()
+  {
+    const char c = peek();
+    ++m_pos;
+
+    switch (c) {
+      case '(': {
+        if (m_pattern.substr(m_pos, 2) == "?:") {
+          m_pos += 2;
+        } else if (!done() && peek() == '?') {
+          fail("unsupported group syntax");
+        }
+        node inner = parse_alternation();
+        if (done() || peek() != ')') {
+          fail("missing ')'");
+        }
+        ++m_pos;
+        return inner;
+      }
+
+      case '*':
+      case '+':
+      case '?':
+        fail("nothing to repeat");
+
+      case '.': {
+        std::bitset<256> set;
+        set.set();
+        set.reset('\n');
+        return make_chars(set);
+      }
+
+      case '^': {
+        node n;
+        n.type = node::kind::line_begin;
+        return n;
+      }
+
+      case '$': {
+        node n;
+        n.type = node::kind::line_end;
+        return n;
+      }
+
+      case '[':
+        return make_chars(parse_class());
+
+      case '\\':
+        return make_chars(fold(parse_escape()));
+
+      default: {
+        std::bitset<256> set;
+        set.set(static_cast<unsigned char>(c));
+        return make_chars(fold(set));
+      }
+    }
+  }
+
+  std::bitset<256> parse_escape()
+  {
+    if (done()) {
+      fail("trailing backslash");
+    }
+
+    const char c = m_pattern[m_pos++];
+    std::bitset<256> set;
+    switch (c) {
+      case 'd':
+        return make_set(isdigit);
+      case 'D':
+        return ~make_set(isdigit);
+      case 'w':
+        return make_set(is_word);
+      case 'W':
+        return ~make_set(is_word);
+      case 's':
+        return make_set(isspace);
+      case 'S':
+        return ~make_set(isspace);
+      case 'n':
+        set.set('\n');
+        return set;
+      case 't':
+        set.set('\t');
+        return set;
+      case 'r':
+        set.set('\r');
+        return set;
+      case 'f':
+        set.set('\f');
+        return set;
+      case 'v':
+        set.set('\v');
+        return set;
+      default:
+        if (std::isalnum(static_cast<unsigned char>(c))) {
+          fail(std::string("unsupported escape \\") + c);
+        }
+        set.set(static_cast<unsigned char>(c));
+        return set;
+    }
+  }
+
+  std::bitset<256> parse_named_class()
+  {
+    static const std::pair<const char*, int (*)(int)> names[] = {
+        {"alnum", isalnum},
+        {"alpha", isalpha},
+        {"digit", isdigit},
+        {"lower", islower},
+        {"punct", ispunct},
+        {"space", isspace},
+        {"upper", isupper},
+        {"word", is_word},
+        {"xdigit", isxdigit},
+    };
+
+    const auto end = m_pattern.find(":]", m_pos + 2);
+    if (end == std::string_view::npos) {
+      fail("missing ':]'");
+    }
+
+    const auto name = m_pattern.substr(m_pos + 2, end - m_pos - 2);
+    for (const auto& [candidate, predicate] : names) {
+      if (name == candidate) {
+        m_pos = end + 2;
+        return make_set(predicate);
+      }
+    }
+    fail("unknown character class");
+  }
+
+  std::bitset<256> parse_class()
+  {
+    std::bitset<256> set;
+    bool negate = false;
+    if (!done() && peek() == '^') {
+      negate = true;
+      ++m_pos;
+    }
+
+    for (bool first = true;; first = false) {
+      if (done()) {
+        fail("missing ']'");
+      }
+
+      const char c = peek();
+      if (c == ']' && !first) {
+        ++m_pos;
+        break;
+      }
+      if (m_pattern.substr(m_pos, 2) == "[:") {
+        set |= parse_named_class();
+        continue;
+      }
+
+      const auto single = [](const std::bitset<256>& item)
+      {
+        for (int b = 0; b < 256; ++b) {
+          if (item.test(b)) {
+            return b;
+          }
+        }
+        return -1;
+      };
+
+      std::bitset<256> item;
+      ++m_pos;
+      if (c == '\\') {
+        item = parse_escape();
+      } else {
+        item.set(static_cast<unsigned char>(c));
+      }
+
+      // Ranges such as a-z; a '-' before the closing ']' is a literal
+      if (item.count() == 1 && m_pos + 1 < m_pattern.size() && peek() == '-'
+          && m_pattern[m_pos + 1] != ']')
+      {
+        ++m_pos;
+        const int lo = single(item);
+        const char hc = m_pattern[m_pos++];
+        std::bitset<256> upper;
+        if (hc == '\\') {
+          upper = parse_escape();
+        } else {
+          upper.set(static_cast<unsigned char>(hc));
+        }
+        const int hi = single(upper);
+        if (upper.count() != 1 || hi < lo) {
+          fail("invalid range");
+        }
+        for (int b = lo; b <= hi; ++b) {
+          item.set(b);
+        }
+      }
+
+      set |= item;
+    }
+
+    // Fold before negating, so that -i '[^a]' rejects 'A' as well
+    set = fold(set);
+    if (negate) {
+      set.flip();
+      set.reset('\n');
+    }
+    return set;
+  }
+
+  std::string_view m_pattern;
+  bool m_ignore_case;
+  std::size_t m_pos = 0;
+};
+
+// ---- Required literals --------------------------------------------------
+
+/* Either the exact set of strings a node matches, or (inexact) a set of
+ * strings one of which every match contains. An inexact empty set carries
+ * no information. */
+struct literal_info
+{
+  bool exact = false;
+  std::vector<std::string> set;
+
+  static literal_info empty_string()
+  {
+    return {true, {std::string()}};
+  }
+
+  bool useful() const
+  {
+    return !set.empty()
+        && std::none_of(set.begin(),
+                        set.end(),
+                        [](const std::string& s) { return s.empty(); });
+  }
+
+  // Longer shortest strings make a more selective prefilter
+  std::size_t score() const
+  {
+    if (!useful()) {
+      return 0;
+    }
+    std::size_t shortest = set.front().size();
+    for (const auto& s : set) {
+      shortest = std::min(shortest, s.size());
+    }
+    return shortest * 64 / set.size() + shortest;
+  }
+};
+
+const literal_info& better(const literal_info& a, const literal_info& b)
+{
+  return b.score() > a.score() ? b : a;
+}
+
+void normalize(std::vector<std::string>& set)
+{
+  std::sort(set.begin(), set.end());
+  set.erase(std::unique(set.begin(), set.end()), set.end());
+}
+
+literal_info extract(const node& n, bool ignore_case)
+{
+  switch (n.type) {
+    case node::kind::empty:
+    case node::kind::line_begin:
+    case node::kind::line_end:
+      return literal_info::empty_string();
+
+    case node::kind::chars: {
+      literal_info info {true, {}};
+      for (int c = 0; c < 256; ++c) {
+        if (n.chars.test(c)) {
+          const int lower = ignore_case ? std::tolower(c) : c;
+          info.set.emplace_back(1, static_cast<char>(lower));
+        }
+      }
+      normalize(info.set);
+      if (info.set.size() > max_class_literals) {
+        return {};
+      }
+      return info;
+    }
+
+    case node::kind::concat: {
+      // Extend the current run of exact children as long as the cross
+      // product stays small, and remember the best run seen
+      literal_info best;
+      literal_info run = literal_info::empty_string();
+      bool all_exact = true;
+
+      for (const auto& child : n.children) {
+        auto info = extract(child, ignore_case);
+        if (info.exact
+            && run.set.size() * info.set.size() <= max_cross_product)
+        {
+          std::vector<std::string> product;
+          for (const auto& prefix : run.set) {
+            for (const auto& suffix : info.set) {
+              product.push_back(prefix + suffix);
+            }
+          }
+          normalize(product);
+          run.set = std::move(product);
+          continue;
+        }
+
+        all_exact = false;
+        best = better(best, run);
+        if (info.exact) {
+          run = std::move(info);
+        } else {
+          best = better(best, info);
+          run = literal_info::empty_string();
+        }
+      }
+
+      if (all_exact) {
+        return run;
+      }
+      literal_info result = better(best, run);
+      result.exact = false;
+      return result;
+    }
+
+    case node::kind::alternate: {
+      literal_info result {true, {}};
+      for (const auto& child : n.children) {
+        auto info = extract(child, ignore_case);
+        if (!info.useful()) {
+          return {};
+        }
+        result.exact = result.exact && info.exact;
+        result.set.insert(result.set.end(), info.set.begin(), info.set.end());
+      }
+      normalize(result.set);
+      if (result.set.size() > max_alternatives) {
+        return {};
+      }
+      return result;
+    }
+
+    case node::kind::repeat: {
+      if (n.min == 0) {
+        return {};
+      }
+      auto info = extract(n.children.front(), ignore_case);
+      if (!(n.min == 1 && n.max == 1)) {
+        info.exact = false;
+      }
+      return info;
+    }
+  }
+
+  return {};
+}
+
+/* Turns n into the pattern that matches the reverse of what n matched.
+ * Anchors swap, since a line read backwards starts at its end. */
+void reverse_node(node& n)
+{
+  switch (n.type) {
+    case node::kind::line_begin:
+      n.type = node::kind::line_end;
+      break;
+    case node::kind::line_end:
+      n.type = node::kind::line_begin;
+      break;
+    case node::kind::concat:
+      std::reverse(n.children.begin(), n.children.end());
+      break;
+    default:
+      break;
+  }
+
+  for (auto& child : n.children) {
+    reverse_node(child);
+  }
+}
+
+}  // namespace
+
+// ---- NFA construction ---------------------------------------------------
+
+struct regex_compiler
+{
+  regex& re;
+  std::unordered_map<std::bitset<256>, uint32_t> set_ids;
+
+  uint32_t add(regex::state_kind kind,
+               uint32_t set = 0,
+               uint32_t out = 0,
+               uint32_t out1 = 0)
+  {
+    if (re.m_states.size() >= max_nfa_states) {
+      throw regex_error("regex: pattern too large");
+    }
+    re.m_states.push_back({kind, set, out, out1});
+    return static_cast<uint32_t>(re.m_states.size() - 1);
+  }
+
+  uint32_t add_set(const std::bitset<256>& set)
+  {
+    const auto [it, inserted] =
+        set_ids.emplace(set, static_cast<uint32_t>(re.m_sets.size()));
+    if (inserted) {
+      re.m_sets.push_back(set);
+    }
+    return it->second;
+  }
+
+  // Compiles n so that it continues with next, and returns its start state
+  uint32_t compile(const node& n, uint32_t next)
+  {
+    switch (n.type) {
+      case node::kind::empty:
+        return next;
+
+      case node::kind::chars:
+        return add(regex::state_kind::chars, add_set(n.chars), next);
+
+      case node::kind::line_begin:
+        return add(regex::state_kind::line_begin, 0, next);
+
+      case node::kind::line_end:
+        return add(regex::state_kind::line_end, 0, next);
+
+      case node::kind::concat:
+        for (auto it = n.children.rbegin(); it != n.children.rend(); ++it) {
+          next = compile(*it, next);
+        }
+        return next;
+
+      case node::kind::alternate: {
+        auto start = compile(n.children.back(), next);
+        for (auto i = n.children.size() - 1; i-- > 0;) {
+          const auto branch = compile(n.children[i], next);
+          start = add(regex::state_kind::split, 0, branch, start);
+        }
+        return start;
+      }
+
+      case node::kind::repeat: {
+        const auto& child = n.children.front();
+        auto start = next;
+        auto copies = n.min;
+
+        if (n.max == -1) {
+          // child{min,}: the last mandatory copy loops back on itself
+          const auto loop = add(regex::state_kind::split, 0, 0, next);
+          const auto body = compile(child, loop);
+          re.m_states[loop].out = body;
+          start = n.min > 0 ? body : loop;
+          copies = std::max(n.min - 1, 0);
+        } else {
+          // child{min,max}: max - min nested optional copies
+          for (int i = n.min; i < n.max; ++i) {
+            const auto body = compile(child, start);
+            start = add(regex::state_kind::split, 0, body, next);
+          }
+        }
+
+        for (int i = 0; i < copies; ++i) {
+          start = compile(child, start);
+        }
+        return start;
+      }
+    }
+
+    return next;
+  }
+
+  void build(const node& root)
+  {
+    // State 0 is the match state
+    add(regex::state_kind::match);
+    re.m_anchored_start = compile(root, 0);
+
+    // Unanchored search restarts the pattern at every byte
+    std::bitset<256> any;
+    any.set();
+    const auto loop =
+        add(regex::state_kind::split, 0, re.m_anchored_start, 0);
+    re.m_states[loop].out1 = add(regex::state_kind::chars, add_set(any), loop);
+    re.m_unanchored_start = loop;
+
+    compute_end_accepts();
+    compute_byte_classes();
+  }
+
+  void compute_end_accepts()
+  {
+    re.m_end_accepts.assign(re.m_states.size(), false);
+    for (uint32_t s = 0; s < re.m_states.size(); ++s) {
+      if (re.m_states[s].kind != regex::state_kind::line_end) {
+        continue;
+      }
+
+      std::vector<uint32_t> stack {re.m_states[s].out};
+      std::vector<bool> seen(re.m_states.size(), false);
+      while (!stack.empty()) {
+        const auto t = stack.back();
+        stack.pop_back();
+        if (seen[t]) {
+          continue;
+        }
+        seen[t] = true;
+
+        const auto& state = re.m_states[t];
+        if (state.kind == regex::state_kind::match) {
+          re.m_end_accepts[s] = true;
+          break;
+        }
+        if (state.kind == regex::state_kind::split) {
+          stack.push_back(state.out);
+          stack.push_back(state.out1);
+        } else if (state.kind == regex::state_kind::line_end) {
+          stack.push_back(state.out);
+        }
+      }
+    }
+  }
+
+  void compute_byte_classes()
+  {
+    std::map<std::vector<bool>, uint8_t> classes;
+    for (int b = 0; b < 256; ++b) {
+      std::vector<bool> signature(re.m_sets.size());
+      for (std::size_t i = 0; i < re.m_sets.size(); ++i) {
+        signature[i] = re.m_sets[i].test(b);
+      }
+      const auto [it, inserted] = classes.emplace(
+          std::move(signature), static_cast<uint8_t>(classes.size()));
+      re.m_byte_class[b] = it->second;
+    }
+    re.m_num_byte_classes = classes.size();
+  }
+};
+
+// ---- Lazy DFA -----------------------------------------------------------
+
+struct dfa_cache
+{
+  uint64_t owner = 0;
+  bool anchored = false;
+  std::size_t num_classes = 0;
+
+  // next[state * num_classes + byte_class], or unknown_state
+  std::vector<int32_t> next;
+  std::vector<std::vector<uint32_t>> sets;
+  std::vector<uint8_t> flags;
+  std::map<std::vector<uint32_t>, int32_t> index;
+  int32_t start[2] = {unknown_state, unknown_state};
+
+  // Scratch space for epsilon closures
+  std::vector<uint32_t> stack;
+  std::vector<uint32_t> mark;
+  uint32_t generation = 0;
+
+  void reset()
+  {
+    next.clear();
+    sets.clear();
+    flags.clear();
+    index.clear();
+    start[0] = start[1] = unknown_state;
+  }
+
+  void begin_closure(const regex& re)
+  {
+    if (mark.size() != re.m_states.size() || ++generation == 0) {
+      mark.assign(re.m_states.size(), 0);
+      generation = 1;
+    }
+  }
+
+  void closure(const regex& re,
+               uint32_t seed,
+               bool at_begin,
+               std::vector<uint32_t>& out)
+  {
+    stack.push_back(seed);
+    while (!stack.empty()) {
+      const auto s = stack.back();
+      stack.pop_back();
+      if (mark[s] == generation) {
+        continue;
+      }
+      mark[s] = generation;
+
+      const auto& state = re.m_states[s];
+      switch (state.kind) {
+        case regex::state_kind::split:
+          stack.push_back(state.out1);
+          stack.push_back(state.out);
+          break;
+        case regex::state_kind::line_begin:
+          if (at_begin) {
+            stack.push_back(state.out);
+          }
+          break;
+        default:
+          out.push_back(s);
+          break;
+      }
+    }
+  }
+
+  int32_t add_state(const regex& re, std::vector<uint32_t> set)
+  {
+    std::sort(set.begin(), set.end());
+
+    const auto found = index.find(set);
+    if (found != index.end()) {
+      return found->second;
+    }
+
+    uint8_t state_flags = set.empty() ? dead : 0;
+    for (const auto s : set) {
+      if (re.m_states[s].kind == regex::state_kind::match) {
+        state_flags |= accepting | accepting_at_end;
+      } else if (re.m_end_accepts[s]) {
+        state_flags |= accepting_at_end;
+      }
+    }
+
+    const auto id = static_cast<int32_t>(sets.size());
+    index.emplace(set, id);
+    sets.push_back(std::move(set));
+    flags.push_back(state_flags);
+    next.resize(next.size() + num_classes, unknown_state);
+    return id;
+  }
+
+  int32_t start_state(const regex& re, bool at_begin)
+  {
+    auto& cached = start[at_begin ? 1 : 0];
+    if (cached == unknown_state) {
+      std::vector<uint32_t> set;
+      begin_closure(re);
+      closure(re,
+              anchored ? re.m_anchored_start : re.m_unanchored_start,
+              at_begin,
+              set);
+      cached = add_state(re, std::move(set));
+    }
+    return cached;
+  }
+
+  int32_t step(const regex& re, int32_t from, unsigned char byte)
+  {
+    const auto slot = static_cast<std::size_t>(from) * num_classes
+        + re.m_byte_class[byte];
+    if (next[slot] != unknown_state) {
+      return next[slot];
+    }
+
+    std::vector<uint32_t> set;
+    begin_closure(re);
+    for (const auto s : sets[from]) {
+      const auto& state = re.m_states[s];
+      if (state.kind == regex::state_kind::chars
+          && re.m_sets[state.set].test(byte))
+      {
+        closure(re, state.out, false, set);
+      }
+    }
+
+    if (sets.size() >= max_dfa_states) {
+      // Start over; the caller only holds on to the state we return
+      reset();
+      return add_state(re, std::move(set));
+    }
+
+    const auto to = add_state(re, std::move(set));
+    next[slot] = to;
+    return to;
+  }
+};
+
+// ---- regex --------------------------------------------------------------
+
+regex::regex(std::string_view pattern, bool ignore_case)
+    : m_id(next_regex_id++)
+    , m_ignore_case(ignore_case)
+    , m_pattern(pattern)
+{
+  const node root = parser(pattern, ignore_case).parse();
+
+  const auto info = extract(root, ignore_case);
+  if (info.useful()) {
+    m_literals = info.set;
+  }
+
+  regex_compiler {*this, {}}.build(root);
+}
+
+regex::regex()
+    : m_id(next_regex_id++)
+    , m_ignore_case(false)
+{
+}
+
+const regex& regex::reverse() const
+{
+  std::call_once(m_reverse_built,
+                 [this]
+                 {
+                   auto root = parser(m_pattern, m_ignore_case).parse();
+                   reverse_node(root);
+                   m_reverse.reset(new regex());
+                   m_reverse->m_ignore_case = m_ignore_case;
+                   regex_compiler {*m_reverse, {}}.build(root);
+                 });
+  return *m_reverse;
+}
+
+dfa_cache& regex::cache(bool anchored) const
+{
+  thread_local std::vector<std::unique_ptr<dfa_cache>> caches;
+
+  for (std::size_t i = 0; i < caches.size(); ++i) {
+    if (caches[i]->owner == m_id && caches[i]->anchored == anchored) {
+      // Keep the busiest caches at the front
+      if (i != 0) {
+        std::swap(caches[i], caches[i - 1]);
+        return *caches[i - 1];
+      }
+      return *caches[i];
+    }
+  }
+
+  if (caches.size() >= caches_per_thread) {
+    caches.pop_back();
+  }
+  auto fresh = std::make_unique<dfa_cache>();
+  fresh->owner = m_id;
+  fresh->anchored = anchored;
+  fresh->num_classes = m_num_byte_classes;
+  caches.push_back(std::move(fresh));
+  return *caches.back();
+}
+
+bool regex::search(std::string_view line, bool at_line_start) const
+{
+  auto& dfa = cache(false);
+  auto state = dfa.start_state(*this, at_line_start);
+
+  for (const char c : line) {
+    if (dfa.flags[state] & accepting) {
+      return true;
+    }
+    state = dfa.step(*this, state, static_cast<unsigned char>(c));
+  }
+
+  return (dfa.flags[state] & accepting_at_end) != 0;
+}
+
+std::size_t regex::leftmost_start(std::string_view line,
+                                  bool at_line_start,
+                                  std::vector<bool>* starts) const
+{
+  // Read backwards, an unanchored search finds where matches start; `$`
+  // holds where it begins, at the end of line
+  const auto& backwards = reverse();
+  auto& dfa = backwards.cache(false);
+  auto state = dfa.start_state(backwards, true);
+  auto leftmost = std::string_view::npos;
+
+  for (auto i = line.size();; --i) {
+    // Here state has read line[i, size), and `^` holds only at 0
+    const auto accept =
+        i == 0 && at_line_start ? accepting_at_end : accepting;
+    if (dfa.flags[state] & accept) {
+      leftmost = i;
+      if (starts != nullptr) {
+        (*starts)[i] = true;
+      }
+    }
+    if (i == 0) {
+      break;
+    }
+    state = dfa.step(backwards, state, static_cast<unsigned char>(line[i - 1]));
+  }
+
+  return leftmost;
+}
+
+std::size_t regex::match_end(std::string_view line,
+                             std::size_t start,
+                             bool at_line_start) const
+{
+  auto& dfa = cache(true);
+  auto state = dfa.start_state(*this, at_line_start && start == 0);
+  auto end = std::string_view::npos;
+
+  for (std::size_t i = start; !(dfa.flags[state] & dead); ++i) {
+    if (dfa.flags[state] & accepting) {
+      end = i;
+    }
+    if (i == line.size()) {
+      if (dfa.flags[state] & accepting_at_end) {
+        end = i;
+      }
+      break;
+    }
+    state = dfa.step(*this, state, static_cast<unsigned char>(line[i]));
+  }
+
+  return end;
+}
+
+literal_match regex::find(std::string_view line, bool at_line_start) const
+{
+  const auto start = leftmost_start(line, at_line_start, nullptr);
+  if (start == std::string_view::npos) {
+    return {std::string_view::npos, 0};
+  }
+  return {start, match_end(line, start, at_line_start) - start};
+}
+
+void regex::find_all(std::string_view line,
+                     bool at_line_start,
+                     std::vector<literal_match>& matches) const
+{
+  // Kept from line to line, so that it stops allocating once warm
+  thread_local std::vector<bool> starts;
+  starts.assign(line.size() + 1, false);
+  auto start = leftmost_start(line, at_line_start, &starts);
+
+  while (start <= line.size()) {
+    const auto end = match_end(line, start, at_line_start);
+    if (end == start) {
+      return;
+    }
+    matches.push_back({start, end - start});
+
+    // A match that starts in the previous one is not looked for again
+    start = end;
+    while (start <= line.size() && !starts[start]) {
+      ++start;
+    }
+  }
+}
+
+bool regex::full_match(std::string_view text) const
+{
+  auto& dfa = cache(true);
+  auto state = dfa.start_state(*this, true);
+
+  for (const char c : text) {
+    if (dfa.flags[state] & dead) {
+      return false;
+    }
+    state = dfa.step(*this, state, static_cast<unsigned char>(c));
+  }
+
+  return (dfa.flags[state] & accepting_at_end) != 0;
+}
+
+}  // namespace search
@@ -0,0 +1,131 @@
+#pragma once
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <multi_literal.hpp>
+
+namespace search
+{
+struct dfa_cache;
+struct regex_compiler;
+
+class regex_error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/* Line-oriented regular expressions matched without backtracking.
+ *
+ * The pattern is compiled to a Thompson NFA, and matching runs on a DFA
+ * that is built lazily, one state at a time, as input is seen. DFA states
+ * are cached per thread, so a regex can be shared by the whole pool.
+ *
+ * Supported syntax: literals, `.`, `[...]` classes (ranges, negation,
+ * [:alpha:] style names), \d \D \w \W \s \S, `(...)`, `(?:...)`, `|`,
+ * `*`, `+`, `?`, `{m}`, `{m,}`, `{m,n}` and the `^` / `$` line anchors.
+ * Lazy quantifiers are accepted and behave like greedy ones. Word
+ * boundaries (\b, \B), backreferences, lookaround and inline flags such
+ * as `(?i)` are rejected with a regex_error; ignore_case replaces `(?i)`. */
+class regex
+{
+public:
+  /* Throws regex_error on syntax errors. With ignore_case, ASCII letters
+   * match in either case and literals() are lowercase. */
+  explicit regex(std::string_view pattern, bool ignore_case = false);
+
+  /* Every match contains at least one of these strings. Empty when no
+   * useful literal could be extracted (e.g. `\w+`). */
+  const std::vector<std::string>& literals() const
+  {
+    return m_literals;
+  }
+
+  /* Whether some substring of line matches. at_line_start says if `^` may
+   * match at the beginning of line. */
+  bool search(std::string_view line, bool at_line_start = true) const;
+
+  /* Leftmost-longest match in line, position npos if there is none. Takes
+   * one pass backwards over line to find where the match starts, and one
+   * forwards from there to find where it ends. */
+  literal_match find(std::string_view line, bool at_line_start = true) const;
+
+  /* Appends the matches that find() returns on line and then on what
+   * follows each match, up to the first empty one. All of their starts
+   * are found in the same backward pass. */
+  void find_all(std::string_view line,
+                bool at_line_start,
+                std::vector<literal_match>& matches) const;
+
+  /* Whether all of text matches */
+  bool full_match(std::string_view text) const;
+
+private:
+  friend struct regex_compiler;
+  friend struct dfa_cache;
+
+  enum class state_kind : uint8_t
+  {
+    chars,
+    split,
+    match,
+    line_begin,
+    line_end
+  };
+
+  struct nfa_state
+  {
+    state_kind kind;
+    uint32_t set;
+    uint32_t out;
+    uint32_t out1;
+  };
+
+  // For the reverse of a pattern, which regex_compiler fills in
+  regex();
+
+  dfa_cache& cache(bool anchored) const;
+
+  /* The pattern reversed, with `^` and `$` swapped, built on first use */
+  const regex& reverse() const;
+
+  /* The leftmost position in line where a match starts, npos if none;
+   * with starts, every position where one does is set in it */
+  std::size_t leftmost_start(std::string_view line,
+                             bool at_line_start,
+                             std::vector<bool>* starts) const;
+
+  // Where the longest match that starts at start ends, npos if none does
+  std::size_t match_end(std::string_view line,
+                        std::size_t start,
+                        bool at_line_start) const;
+
+  uint64_t m_id;
+  bool m_ignore_case;
+  std::string m_pattern;
+  std::vector<std::string> m_literals;
+
+  std::vector<nfa_state> m_states;
+  std::vector<std::bitset<256>> m_sets;
+  uint32_t m_anchored_start = 0;
+  uint32_t m_unanchored_start = 0;
+
+  // Whether a line_end state reaches the match state at the end of input
+  std::vector<bool> m_end_accepts;
+
+  // Bytes that no character set tells apart share a DFA column
+  uint8_t m_byte_class[256] = {};
+  std::size_t m_num_byte_classes = 0;
+
+  mutable std::once_flag m_reverse_built;
+  mutable std::unique_ptr<regex> m_reverse;
+};
+
+}  // namespace search
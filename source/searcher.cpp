@@ -1,4 +1,4 @@
-#include <fnmatch.h>
+#include <pipeline.hpp>
 #include <searcher.hpp>
 namespace fs = std::filesystem;
 
@@ -24,28 +24,18 @@ namespace fs = std::filesystem;
 #  define _GNU_SOURCE
 #endif
 
-#include <ftw.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#  include <sys/syscall.h>
+#endif
 #include <time.h>
 #include <unistd.h>
 
-/* POSIX.1 says each process has at least 20 file descriptors.
- * Three of those belong to the standard streams.
- * Here, we use a conservative estimate of 15 available;
- * assuming we use at most two for other uses in this program,
- * we should never run into any problems.
- * Most trees are shallower than that, so it is efficient.
- * Deeper trees are traversed fine, just a bit slower.
- * (Linux allows typically hundreds to thousands of open files,
- *  so you'll probably never see any issues even if you used
- *  a much higher value, say a couple of hundred, but
- *  15 is a safe, reasonable value.)
- */
-#ifndef USE_FDS
-#  define USE_FDS 15
-#endif
-
 namespace search
 {
 std::string_view::const_iterator needle_search(
@@ -61,92 +51,418 @@ std::string_view::const_iterator needle_search(
   }
 }
 
+std::string_view::const_iterator needle_search_ignore_case(
+    std::string_view needle,
+    std::string_view::const_iterator haystack_begin,
+    std::string_view::const_iterator haystack_end)
+{
+  return std::search(
+      haystack_begin,
+      haystack_end,
+      needle.begin(),
+      needle.end(),
+      [](char a, char b)
+      { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
 auto find_needle_position(std::string_view str, std::string_view query)
 {
-  auto it = needle_search(query, str.begin(), str.end());
+  auto it = searcher::m_ignore_case
+      ? needle_search_ignore_case(query, str.begin(), str.end())
+      : needle_search(query, str.begin(), str.end());
 
   return it != str.end() ? std::size_t(it - str.begin())
                          : std::string_view::npos;
 }
 
-void print_colored(std::string_view str,
-                   std::string_view query,
+literal_match find_literal(std::string_view haystack)
+{
+  if (searcher::m_literals) {
+    return searcher::m_literals->find(haystack);
+  }
+
+#if defined(__SSE2__)
+  if (searcher::m_ignore_case) {
+    return {sse2_strcasestr_v2(haystack, searcher::m_needle),
+            searcher::m_query.size()};
+  }
+  return {sse2_strstr_v2(haystack, searcher::m_needle),
+          searcher::m_query.size()};
+#else
+  return {find_needle_position(haystack, searcher::m_query),
+          searcher::m_query.size()};
+#endif
+}
+
+/* Lines are located with the literal prefilter when the regex has one, and
+ * only those lines are handed to the DFA. Unless exact, a matching line is
+ * returned whole, which saves finding where in it the match is. */
+literal_match find_regex_match(std::string_view haystack,
+                               bool at_line_start,
+                               bool exact)
+{
+  const auto& re = *searcher::m_regex;
+  const bool prefilter = searcher::m_literals || !searcher::m_query.empty();
+
+  std::size_t from = 0;
+  while (true) {
+    auto line_begin = from;
+    if (prefilter) {
+      const auto candidate = find_literal(haystack.substr(from));
+      if (candidate.position == std::string_view::npos) {
+        break;
+      }
+      const auto newline_before =
+          haystack.rfind('\n', from + candidate.position);
+      if (newline_before != std::string_view::npos && newline_before >= from)
+      {
+        line_begin = newline_before + 1;
+      }
+    }
+
+    auto line_end = haystack.find('\n', line_begin);
+    if (line_end == std::string_view::npos) {
+      line_end = haystack.size();
+    }
+
+    const auto line = haystack.substr(line_begin, line_end - line_begin);
+    const auto begin = line_begin == 0 ? at_line_start : true;
+    if (re.search(line, begin)) {
+      if (!exact) {
+        return {line_begin, line.size()};
+      }
+      const auto match = re.find(line, begin);
+      return {line_begin + match.position, match.length};
+    }
+
+    if (line_end == haystack.size()) {
+      break;
+    }
+    from = line_end + 1;
+  }
+
+  return {std::string_view::npos, 0};
+}
+
+/* at_line_start is false when haystack continues a line after an earlier
+ * match, so that `^` does not match there again. Callers that only need
+ * the line a match is in pass exact as false. */
+literal_match find_match(std::string_view haystack,
+                         bool at_line_start = true,
+                         bool exact = true)
+{
+  if (searcher::m_regex) {
+    return find_regex_match(haystack, at_line_start, exact);
+  }
+  return find_literal(haystack);
+}
+
+/* Appends to matches the matches in line from offset from on, each one
+ * searched for from the end of the one before, as find_match finds them.
+ * A plain literal has them all found in one pass of the kernel. */
+void find_matches(std::string_view line,
+                  std::size_t from,
+                  std::vector<literal_match>& matches)
+{
+#if defined(__SSE2__)
+  const auto length = searcher::m_query.size();
+  if (!searcher::m_regex && !searcher::m_literals && length != 0) {
+    // Positions taken from the kernel per call
+    constexpr std::size_t batch = 64;
+    std::size_t positions[batch];
+    while (true) {
+      const auto rest = line.substr(from);
+      const auto count = searcher::m_ignore_case
+          ? sse2_strcasestr_all_v2(rest, searcher::m_needle, positions, batch)
+          : sse2_strstr_all_v2(rest, searcher::m_needle, positions, batch);
+      for (std::size_t i = 0; i < count; ++i) {
+        matches.push_back({from + positions[i], length});
+      }
+      if (count < batch) {
+        return;
+      }
+      from += positions[count - 1] + length;
+    }
+  }
+#endif
+
+  if (searcher::m_regex) {
+    const auto first = matches.size();
+    searcher::m_regex->find_all(line.substr(from), false, matches);
+    for (auto i = first; i < matches.size(); ++i) {
+      matches[i].position += from;
+    }
+    return;
+  }
+
+  while (from <= line.size()) {
+    auto match = find_match(line.substr(from), false);
+    if (match.position == std::string_view::npos || match.length == 0) {
+      return;
+    }
+    match.position += from;
+    match.length = std::min(match.length, line.size() - match.position);
+    matches.push_back(match);
+    from = match.position + match.length;
+  }
+}
+
+/* Copies text to out once, with the escape codes spliced in at matches,
+ * which are in order and do not overlap */
+void append_highlighted(std::string_view text,
+                        const std::vector<literal_match>& matches,
+                        fmt::memory_buffer& out)
+{
+  constexpr std::string_view highlight = "\033[1;31m";
+  constexpr std::string_view reset = "\033[0m";
+
+  const auto start = out.size();
+  out.resize(start + text.size()
+             + matches.size() * (highlight.size() + reset.size()));
+  auto* to = out.data() + start;
+  const auto copy = [&](std::string_view piece)
+  {
+    std::memcpy(to, piece.data(), piece.size());
+    to += piece.size();
+  };
+
+  std::size_t copied = 0;
+  for (const auto& match : matches) {
+    copy(text.substr(copied, match.position - copied));
+    copy(highlight);
+    copy(text.substr(match.position, match.length));
+    copy(reset);
+    copied = match.position + match.length;
+  }
+  copy(text.substr(copied));
+}
+
+/* Copies line to out with every match highlighted. first is the match the
+ * search found in the line, and the others are found after it in one pass
+ * over the rest of the line. */
+void print_colored(std::string_view line,
+                   literal_match first,
                    fmt::memory_buffer& out)
 {
-  auto pos = find_needle_position(str, query);
-  if (pos == std::string_view::npos) {
-    fmt::format_to(std::back_inserter(out), "{}\n", str);
+  // Kept from line to line, so that it stops allocating once warm
+  thread_local std::vector<literal_match> matches;
+  matches.clear();
+  if (first.position != std::string_view::npos && first.length != 0) {
+    first.length = std::min(first.length, line.size() - first.position);
+    matches.push_back(first);
+    find_matches(line, first.position + first.length, matches);
+  }
+
+  append_highlighted(line, matches, out);
+  out.push_back('\n');
+}
+
+std::size_t count_newlines(std::string_view str)
+{
+#if defined(__SSE2__)
+  return sse2_count_byte_v2(str, '\n');
+#else
+  return std::count(str.begin(), str.end(), '\n');
+#endif
+}
+
+// Bytes of read or output buffer that a thread keeps for the next file;
+// one grown past this for a large file is freed again
+constexpr std::size_t max_kept_buffer = 4 << 20;
+
+/* The calling thread's output buffer, emptied. It is reused from file to
+ * file, so that formatting matches allocates only while it grows. */
+fmt::memory_buffer& thread_output_buffer()
+{
+  thread_local fmt::memory_buffer out;
+  if (out.capacity() > max_kept_buffer) {
+    out = fmt::memory_buffer();
+  }
+  out.clear();
+  return out;
+}
+
+void write_output(std::string_view text)
+{
+  if (text.empty()) {
+    return;
+  }
+  if (searcher::m_file_output != nullptr) {
+    searcher::m_file_output->append(text);
+    return;
+  }
+  if (searcher::m_output != nullptr) {
+    searcher::m_output->push(text);
     return;
   }
-  fmt::format_to(std::back_inserter(out), "{}", str.substr(0, pos));
-  fmt::format_to(std::back_inserter(out),
-                 "\033[1;31m{}\033[0m",
-                 str.substr(pos, query.size()));
-  print_colored(str.substr(pos + query.size()), query, out);
+  std::fwrite(text.data(), 1, text.size(), searcher::m_out);
 }
 
-std::size_t searcher::file_search(std::string_view filename,
-                                  std::string_view haystack)
+/* Counts lines with a match, stopping once limit is reached. Only the
+ * newline after each match is looked up, to resume on the next line. */
+std::size_t count_matching_lines(std::string_view haystack, std::size_t limit)
+{
+  std::size_t count = 0;
+  std::size_t from = 0;
+
+  while (count < limit && from < haystack.size()) {
+    const auto match = find_match(haystack.substr(from), true, false);
+    if (match.position == std::string_view::npos) {
+      break;
+    }
+    ++count;
+
+    if (!searcher::m_is_path_from_terminal) {
+      // Input from a pipe is searched one line at a time
+      break;
+    }
+
+    const auto match_begin = haystack.data() + from + match.position;
+    const auto newline = static_cast<const char*>(std::memchr(
+        match_begin, '\n', haystack.data() + haystack.size() - match_begin));
+    if (newline == nullptr) {
+      break;
+    }
+    from = newline + 1 - haystack.data();
+  }
+
+  return count;
+}
+
+void report_matching_lines(std::string_view filename, std::size_t count)
+{
+  searcher::m_matched.store(true, std::memory_order_relaxed);
 
+  switch (searcher::m_mode) {
+    case output_mode::quiet:
+      // Nothing left to find out; let the queued files go
+      if (searcher::m_ts) {
+        searcher::m_ts->paused = true;
+      }
+      break;
+    case output_mode::files_with_matches:
+      if (!filename.empty()) {
+        fmt::memory_buffer out;
+        fmt::format_to(std::back_inserter(out), "{}\n", filename);
+        write_output(std::string_view(out.data(), out.size()));
+      }
+      break;
+    case output_mode::count:
+      if (!filename.empty()) {
+        fmt::memory_buffer out;
+        fmt::format_to(std::back_inserter(out), "{}:{}\n", filename, count);
+        write_output(std::string_view(out.data(), out.size()));
+      }
+      break;
+    case output_mode::lines:
+      break;
+  }
+}
+
+void format_file_header(fmt::memory_buffer& out, std::string_view filename)
 {
-  auto out = fmt::memory_buffer();
+  fmt::format_to(std::back_inserter(out), "\n\033[1;36m{}\033[0m\n", filename);
+}
+
+/* Per-file search state, so that a file can also be searched one chunk of
+ * whole lines at a time */
+struct search_context
+{
+  explicit search_context(fmt::memory_buffer& buffer)
+      : out(buffer)
+  {
+  }
+
+  std::string_view filename;
+  // Written out by flush_output, and cleared for more
+  fmt::memory_buffer& out;
+  // Matching lines so far
+  std::size_t count = 0;
+  // Line number of the start of the next haystack passed to search_lines
+  std::size_t line_number = 1;
+  bool printed_file_name = false;
+  // More chunks follow, so line_number has to take in every newline
+  bool streaming = false;
+};
+
+// Matching lines after which there is nothing more to learn about a file
+std::size_t match_limit()
+{
+  return searcher::m_mode == output_mode::lines
+          || searcher::m_mode == output_mode::count
+      ? std::numeric_limits<std::size_t>::max()
+      : 1;
+}
+
+/* Formats what goes before a matching line: the file name, which on a
+ * terminal is a header printed once instead, and with -n the line number */
+void format_line_prefix(search_context& context, std::size_t line_number)
+{
+  auto& out = context.out;
+  if (!context.filename.empty()) {
+    if (!context.printed_file_name) {
+      if (searcher::m_is_stdout) {
+        // Print filename once, bold cyan color
+        format_file_header(out, context.filename);
+      } else {
+        // Print filename without newline, without any color
+        fmt::format_to(std::back_inserter(out), "{}:", context.filename);
+      }
+      context.printed_file_name = true;
+    } else if (!searcher::m_is_stdout) {
+      // Print filename for every match without any color
+      fmt::format_to(std::back_inserter(out), "{}:", context.filename);
+    }
+  }
+
+  if (searcher::m_line_number) {
+    if (searcher::m_is_stdout) {
+      fmt::format_to(
+          std::back_inserter(out), "\033[1;32m{}\033[0m:", line_number);
+    } else {
+      fmt::format_to(std::back_inserter(out), "{}:", line_number);
+    }
+  }
+}
+
+void search_lines(search_context& context, std::string_view haystack)
+{
+  if (searcher::m_mode != output_mode::lines) {
+    // No lines are extracted or formatted in these modes
+    context.count +=
+        count_matching_lines(haystack, match_limit() - context.count);
+    return;
+  }
 
   // Start from the beginning
   const auto haystack_begin = haystack.cbegin();
   const auto haystack_end = haystack.cend();
 
   auto it = haystack_begin;
-  bool first_search = true;
-  bool printed_file_name = false;
-  std::size_t current_line_number = 1;
-  auto no_file_name = filename.empty();
+  auto& out = context.out;
+  auto& current_line_number = context.line_number;
+
+  // Newlines before lines_counted_up_to are included in current_line_number
+  std::size_t lines_counted_up_to = 0;
 
   while (it != haystack_end) {
-#if defined(__SSE2__)
-    std::string_view view(it, haystack_end - it);
-    if (view.empty()) {
+    // Only colored output highlights the match itself
+    auto match = find_match(
+        std::string_view(it, haystack_end - it), true, searcher::m_is_stdout);
+    if (match.position != std::string_view::npos) {
+      it += match.position;
+      // From here on, match.position is where the match is in haystack
+      match.position = std::size_t(it - haystack_begin);
+    } else {
       it = haystack_end;
       break;
-    } else {
-      auto pos =
-          sse2_strstr_v2(std::string_view(it, haystack_end - it), m_query);
-      if (pos != std::string::npos) {
-        it += pos;
-      } else {
-        it = haystack_end;
-        break;
-      }
     }
-#else
-    it = needle_search(m_query, it, haystack_end);
-#endif
 
     if (it != haystack_end) {
       // needle found in haystack
-
-      if (!no_file_name) {
-        if (!printed_file_name) {
-          if (m_is_stdout) {
-            // Print filename once, bold cyan color
-            fmt::format_to(
-                std::back_inserter(out), "\n\033[1;36m{}\033[0m\n", filename);
-          } else {
-            // Print filename without newline, without any color
-            fmt::format_to(std::back_inserter(out), "{}:", filename);
-          }
-          printed_file_name = true;
-        } else {
-          if (!m_is_stdout) {
-            // Print filename for every match
-            // without any color
-            fmt::format_to(std::back_inserter(out), "{}:", filename);
-          }
-        }
-      }
-
       std::string_view line;
 
-      if (m_is_path_from_terminal) {
+      if (searcher::m_is_path_from_terminal) {
         // Only find lines and count line number if
         // this is actually a file
         //
@@ -170,8 +486,16 @@ std::size_t searcher::file_search(std::string_view filename,
             std::size_t(newline_after - (haystack_begin + newline_before) - 1);
         line = haystack.substr(newline_before + 1, line_size);
 
+        if (searcher::m_line_number) {
+          // Only the newlines since the previous matching line are counted
+          const auto line_begin = newline_before + 1;
+          current_line_number += count_newlines(haystack.substr(
+              lines_counted_up_to, line_begin - lines_counted_up_to));
+          lines_counted_up_to = line_begin;
+        }
+
         // Move to next line and continue search
-        it = newline_after + 1;
+        it = newline_after == haystack_end ? haystack_end : newline_after + 1;
       } else {
         // Input is from pipe or stdin
         // Haystack is one line
@@ -182,175 +506,902 @@ std::size_t searcher::file_search(std::string_view filename,
         it = haystack_end;
       }
 
-      if (m_is_stdout) {
+      format_line_prefix(context, current_line_number);
+
+      if (searcher::m_is_stdout) {
         // Print colored, highlight needle in line
-        print_colored(line, m_query, out);
+        const auto line_begin = std::size_t(line.data() - haystack.data());
+        print_colored(
+            line, {match.position - line_begin, match.length}, out);
       } else {
         fmt::format_to(std::back_inserter(out), "{}\n", line);
       }
 
-      first_search = false;
+      ++context.count;
     } else {
       // no results at all in this file
       break;
     }
   }
 
-  if (!first_search) {
-    fmt::print("{}", fmt::to_string(out));
+  if (context.streaming && searcher::m_line_number) {
+    current_line_number +=
+        count_newlines(haystack.substr(lines_counted_up_to));
+  }
+}
+
+void flush_output(search_context& context)
+{
+  write_output(std::string_view(context.out.data(), context.out.size()));
+  context.out.clear();
+}
+
+void finish_search(search_context& context)
+{
+  if (context.count == 0) {
+    return;
+  }
+
+  if (searcher::m_mode != output_mode::lines) {
+    report_matching_lines(context.filename, context.count);
+  } else {
+    searcher::m_matched.store(true, std::memory_order_relaxed);
+    flush_output(context);
+  }
+}
+
+bool searcher::has_match(std::string_view text)
+{
+  return find_match(text, true, false).position != std::string_view::npos;
+}
+
+std::size_t searcher::file_search(std::string_view filename,
+                                  std::string_view haystack,
+                                  std::size_t first_line_number)
+{
+  search_context context(thread_output_buffer());
+  context.filename = filename;
+  context.line_number = first_line_number;
+
+  search_lines(context, haystack);
+  finish_search(context);
+  return context.count;
+}
+
+struct scoped_fd
+{
+  int fd;
+
+  ~scoped_fd()
+  {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+};
+
+/* Memory that files are read into, page-aligned so that the kernel copies
+ * whole pages into it. It only grows, doubling, so one kept per thread
+ * stops allocating once it fits the largest file read. */
+class read_buffer
+{
+public:
+  static constexpr std::size_t alignment = 4096;
+
+  read_buffer() = default;
+  read_buffer(const read_buffer&) = delete;
+  read_buffer& operator=(const read_buffer&) = delete;
+
+  ~read_buffer()
+  {
+    reset();
+  }
+
+  char* data() const
+  {
+    return m_data;
+  }
+
+  std::size_t capacity() const
+  {
+    return m_capacity;
+  }
+
+  /* Grows to at least size bytes, keeping the first length */
+  void reserve(std::size_t size, std::size_t length)
+  {
+    if (size <= m_capacity) {
+      return;
+    }
+    auto capacity = std::max(m_capacity, alignment);
+    while (capacity < size) {
+      capacity *= 2;
+    }
+    auto* data = static_cast<char*>(
+        ::operator new(capacity, std::align_val_t(alignment)));
+    std::memcpy(data, m_data, length);
+    reset();
+    m_data = data;
+    m_capacity = capacity;
+  }
+
+  void reset()
+  {
+    if (m_data != nullptr) {
+      ::operator delete(m_data, std::align_val_t(alignment));
+    }
+    m_data = nullptr;
+    m_capacity = 0;
+  }
+
+private:
+  char* m_data = nullptr;
+  std::size_t m_capacity = 0;
+};
+
+/* Reads the rest of fd into the calling thread's read buffer; size is only
+ * a hint, the file may have changed. The contents stay valid until the
+ * thread reads the next file. */
+std::string_view read_file_contents(int fd, std::size_t size)
+{
+  thread_local read_buffer buffer;
+  if (buffer.capacity() > max_kept_buffer && size < max_kept_buffer) {
+    buffer.reset();
+  }
+  // One byte more than the size tells that the file ended
+  buffer.reserve(size + 1, 0);
+
+  std::size_t length = 0;
+  while (true) {
+    if (length == buffer.capacity()) {
+      buffer.reserve(length + 1, length);
+    }
+    const auto result =
+        ::read(fd, buffer.data() + length, buffer.capacity() - length);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    length += static_cast<std::size_t>(result);
+  }
+
+  return std::string_view(buffer.data(), length);
+}
+
+/* Searches one file on the whole pool. The haystack is cut into
+ * line-aligned ranges, each searched into its own output buffer, and the
+ * buffers are written out in file order once every range is done. With
+ * -n, a first parallel pass counts the newlines in each range to get the
+ * line number each one starts at. */
+void split_file_search(std::string_view filename, std::string_view haystack)
+{
+  // Smaller ranges would cost more in task overhead than they gain
+  constexpr std::size_t min_range_size = 8 << 20;
+  constexpr std::size_t ranges_per_thread = 4;
+
+  auto& pool = *searcher::m_ts;
+  const auto num_ranges = std::clamp<std::size_t>(
+      haystack.size() / min_range_size,
+      1,
+      pool.get_active_threads() * ranges_per_thread);
+  if (num_ranges == 1) {
+    searcher::file_search(filename, haystack);
+    return;
+  }
+
+  std::vector<std::size_t> bounds(num_ranges + 1, haystack.size());
+  bounds[0] = 0;
+  for (std::size_t i = 1; i < num_ranges; ++i) {
+    const auto target =
+        std::max(haystack.size() / num_ranges * i, bounds[i - 1]);
+    const auto newline = haystack.find('\n', target);
+    bounds[i] =
+        newline == std::string_view::npos ? haystack.size() : newline + 1;
+  }
+
+  const auto range = [&](std::size_t i)
+  { return haystack.substr(bounds[i], bounds[i + 1] - bounds[i]); };
+
+  // Ranges are searched on other threads, into buffers of their own
+  std::vector<fmt::memory_buffer> buffers(num_ranges);
+  std::vector<search_context> contexts;
+  contexts.reserve(num_ranges);
+  for (auto& buffer : buffers) {
+    auto& context = contexts.emplace_back(buffer);
+    context.filename = filename;
+    // The header is written once, below
+    context.printed_file_name = true;
+  }
+
+  if (searcher::m_line_number && searcher::m_mode == output_mode::lines) {
+    pool.parallelize_loop(
+        std::size_t(0),
+        num_ranges,
+        [&](std::size_t start, std::size_t end)
+        {
+          for (auto i = start; i < end; ++i) {
+            contexts[i].line_number = count_newlines(range(i));
+          }
+        },
+        num_ranges);
+
+    std::size_t line_number = 1;
+    for (auto& context : contexts) {
+      const auto newlines = context.line_number;
+      context.line_number = line_number;
+      line_number += newlines;
+    }
+  }
+
+  pool.parallelize_loop(
+      std::size_t(0),
+      num_ranges,
+      [&](std::size_t start, std::size_t end)
+      {
+        for (auto i = start; i < end; ++i) {
+          search_lines(contexts[i], range(i));
+        }
+      },
+      num_ranges);
+
+  search_context result(thread_output_buffer());
+  result.filename = filename;
+  for (const auto& context : contexts) {
+    result.count += context.count;
+  }
+  if (result.count == 0) {
+    return;
+  }
+
+  if (searcher::m_mode != output_mode::lines) {
+    finish_search(result);
+    return;
+  }
+
+  searcher::m_matched.store(true, std::memory_order_relaxed);
+  if (searcher::m_is_stdout) {
+    format_file_header(result.out, filename);
+    flush_output(result);
+  }
+  for (auto& context : contexts) {
+    flush_output(context);
+  }
+}
+
+/* Searches a file in place through a read-only mapping. The kernels never
+ * load past the end of the haystack (see verify_slack), so no padding is
+ * needed after the last mapped byte. Returns false if mmap fails. */
+bool search_mapped_file(const char* path, int fd, std::size_t size, bool split)
+{
+  void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  ::madvise(data, size, MADV_SEQUENTIAL);
+
+  try {
+    const std::string_view haystack(static_cast<const char*>(data), size);
+    if (split) {
+      split_file_search(path, haystack);
+    } else {
+      searcher::file_search(path, haystack);
+    }
+  } catch (const std::exception& e) {
+  }
+
+  ::munmap(data, size);
+  return true;
+}
+
+// Reads until size bytes are in or the file ends
+std::size_t read_fully(int fd, char* data, std::size_t size)
+{
+  std::size_t length = 0;
+  while (length < size) {
+    const auto result = ::read(fd, data + length, size - length);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    length += static_cast<std::size_t>(result);
+  }
+  return length;
+}
+
+// Length of the longest string the literal search can match
+std::size_t longest_literal()
+{
+  if (searcher::m_literals) {
+    std::size_t longest = 0;
+    for (const auto& pattern : searcher::m_literals->patterns()) {
+      longest = std::max(longest, pattern.size());
+    }
+    return longest;
   }
+  return searcher::m_query.size();
+}
 
-  return 0;
+/* Prints a line too long for the stream buffer that is known to match,
+ * as search_lines would. Only its last window is still in the buffer, and
+ * all of it may not fit in memory, so it is read back from the file a
+ * piece at a time and written out as it goes. Its earlier pieces are kept
+ * no longer than it takes to find the matches in them: overlap bytes,
+ * where a match may still start that the next piece completes. */
+void print_long_line(search_context& context,
+                     int fd,
+                     off_t start,
+                     std::size_t overlap)
+{
+  ++context.count;
+  if (searcher::m_mode != output_mode::lines) {
+    ++context.line_number;
+    return;
+  }
+
+  // The line goes out in one piece, between the lines of other files
+  const bool is_direct =
+      searcher::m_file_output == nullptr && searcher::m_output == nullptr;
+  if (is_direct) {
+    ::flockfile(searcher::m_out);
+  }
+  format_line_prefix(context, context.line_number);
+
+  thread_local std::vector<literal_match> matches;
+  std::string window;
+  char piece[1 << 16];
+  for (auto offset = start;;) {
+    const auto result = ::pread(fd, piece, sizeof(piece), offset);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    auto length = result > 0 ? static_cast<std::size_t>(result) : 0;
+    const auto* newline =
+        static_cast<const char*>(std::memchr(piece, '\n', length));
+    const bool is_end = length == 0 || newline != nullptr;
+    if (newline != nullptr) {
+      length = static_cast<std::size_t>(newline - piece);
+    }
+    offset += static_cast<off_t>(length);
+
+    if (!searcher::m_is_stdout) {
+      context.out.append(piece, piece + length);
+    } else {
+      window.append(piece, length);
+      // Matches that start before the last overlap bytes are complete
+      const auto complete = is_end
+          ? window.size()
+          : window.size() - std::min(overlap, window.size());
+      matches.clear();
+      find_matches(window, 0, matches);
+      while (!matches.empty() && matches.back().position >= complete) {
+        matches.pop_back();
+      }
+      const auto printed = matches.empty()
+          ? complete
+          : std::max(complete,
+                     matches.back().position + matches.back().length);
+      append_highlighted(
+          std::string_view(window).substr(0, printed), matches, context.out);
+      window.erase(0, printed);
+    }
+    if (is_end) {
+      break;
+    }
+    flush_output(context);
+  }
+  context.out.push_back('\n');
+  flush_output(context);
+  if (is_direct) {
+    ::funlockfile(searcher::m_out);
+  }
+
+  ++context.line_number;
+  // What follows of the file may come after other files' output, so it
+  // gets a header of its own
+  context.printed_file_name = false;
 }
 
-std::string get_file_contents(const char* filename)
+// Chunks the stream buffer may grow to, to hold a line for a regex
+constexpr std::size_t max_regex_line_chunks = 16;
+
+/* Searches a file in chunks read into a per-thread buffer of
+ * m_stream_chunk_size bytes, so memory stays bounded whatever the file
+ * size. Only whole lines are searched; the incomplete last line of a chunk
+ * is carried over to the next one.
+ *
+ * A line that does not fit in the buffer at all is scanned in windows that
+ * overlap by the longest literal minus one byte, so no match is lost at a
+ * window boundary, and printed by print_long_line if it matched. A regex
+ * has no such bound, so for one the buffer grows to hold the line instead,
+ * up to max_regex_line_chunks; a longer line is skipped with a warning. */
+void stream_file_search(const char* path, int fd)
 {
-  std::FILE* fp = std::fopen(filename, "rb");
-  if (fp) {
-    std::string contents;
-    std::fseek(fp, 0, SEEK_END);
-    contents.resize(std::ftell(fp));
-    std::rewind(fp);
-    const auto size = std::fread(&contents[0], 1, contents.size(), fp);
-    std::fclose(fp);
-    return (contents);
+  const auto overlap = std::max<std::size_t>(longest_literal(), 1) - 1;
+  const auto chunk_size =
+      std::max(searcher::m_stream_chunk_size, 2 * overlap + 2);
+
+  thread_local std::string buffer;
+  if (buffer.size() != chunk_size) {
+    buffer.assign(chunk_size, '\0');
+    buffer.shrink_to_fit();
+  }
+
+  search_context context(thread_output_buffer());
+  context.filename = path;
+  context.streaming = true;
+
+  // File offset of buffer[0], and the bytes kept from the previous chunk
+  off_t buffer_offset = 0;
+  std::size_t carry = 0;
+
+  bool in_long_line = false;
+  bool long_line_matched = false;
+  // Too long for a regex; read past without being searched
+  bool long_line_skipped = false;
+  off_t long_line_start = 0;
+
+  while (context.count < match_limit()
+         && !(searcher::m_mode == output_mode::quiet && searcher::m_matched))
+  {
+    const auto length =
+        carry + read_fully(fd, &buffer[carry], buffer.size() - carry);
+    const bool eof = length < buffer.size();
+    const std::string_view chunk(buffer.data(), length);
+    std::size_t consumed = 0;
+
+    if (in_long_line) {
+      const auto newline = chunk.find('\n');
+      if (!long_line_matched && !long_line_skipped) {
+        long_line_matched = searcher::has_match(chunk.substr(0, newline));
+      }
+
+      if (newline == std::string_view::npos && !eof) {
+        // Still inside the line; once it matched, nothing needs keeping
+        consumed = long_line_matched || long_line_skipped ? length
+                                                          : length - overlap;
+      } else {
+        if (long_line_matched) {
+          print_long_line(context, fd, long_line_start, overlap);
+        } else {
+          ++context.line_number;
+        }
+        in_long_line = false;
+        long_line_skipped = false;
+        consumed = newline == std::string_view::npos ? length : newline + 1;
+      }
+    }
+
+    if (!in_long_line) {
+      const auto rest = chunk.substr(consumed);
+      if (eof) {
+        search_lines(context, rest);
+        break;
+      }
+
+      const auto last_newline = rest.rfind('\n');
+      if (last_newline != std::string_view::npos) {
+        search_lines(context, rest.substr(0, last_newline + 1));
+        consumed += last_newline + 1;
+      } else if (consumed == 0) {
+        // The whole buffer is part of a single line
+        if (searcher::m_regex
+            && 2 * buffer.size() <= max_regex_line_chunks * chunk_size)
+        {
+          carry = length;
+          buffer.resize(2 * buffer.size());
+          continue;
+        }
+        in_long_line = true;
+        long_line_start = buffer_offset;
+        long_line_skipped = searcher::m_regex != nullptr;
+        if (long_line_skipped) {
+          fmt::print(searcher::m_err,
+                     "Warning: {}: skipped a line at byte {} that is too "
+                     "long to search with a regex\n",
+                     path,
+                     buffer_offset);
+          long_line_matched = false;
+          consumed = length;
+        } else {
+          long_line_matched = searcher::has_match(rest);
+          consumed = long_line_matched ? length : length - overlap;
+        }
+      }
+    }
+
+    carry = length - consumed;
+    std::memmove(&buffer[0], &buffer[consumed], carry);
+    buffer_offset += static_cast<off_t>(consumed);
+
+    if (!searcher::m_is_stdout) {
+      // Every output line names its file, so it can go out right away
+      flush_output(context);
+    }
   }
-  throw(errno);
+
+  finish_search(context);
 }
 
 void searcher::read_file_and_search(const char* path)
 {
+  search_file(path, false);
+}
+
+void searcher::read_file_and_search_split(const char* path)
+{
+  search_file(path, m_ts && m_ts->get_thread_count() > 1);
+}
+
+void searcher::search_file(const char* path, bool split)
+{
+  if (m_mode == output_mode::quiet && m_matched) {
+    return;
+  }
+
+  const scoped_fd file {::open(path, O_RDONLY | O_CLOEXEC)};
+  if (file.fd < 0) {
+    return;
+  }
+
+  struct stat info;
+  std::size_t size = 0;
+  if (::fstat(file.fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    size = static_cast<std::size_t>(info.st_size);
+  }
+
+  if (m_stream) {
+    stream_file_search(path, file.fd);
+    return;
+  }
+
+  // Small files are cheaper to read than to map and unmap
+  if (m_mmap_threshold >= 0 && size > 0
+      && size >= static_cast<std::size_t>(m_mmap_threshold)
+      && search_mapped_file(path, file.fd, size, split))
+  {
+    return;
+  }
+
   try {
-    const std::string haystack = get_file_contents(path);
-    file_search(path, haystack);
+    file_search(path, read_file_contents(file.fd, size));
   } catch (const std::exception& e) {
   }
 }
 
-bool is_whitelisted(const std::string_view& str)
-{
-  static const std::unordered_set<std::string_view> allowed_suffixes = {
-      // ANTLR
-      ".g4",
-      // C
-      ".c",
-      ".h"
-      // C++
-      ".cpp",
-      ".cc",
-      ".cxx",
-      ".hh",
-      ".hxx",
-      ".hpp",
-      // CUDA
-      ".cu",
-      ".cuh",
-      // Go
-      ".go",
-      // Java
-      ".java",
-      // JavaScript
-      ".js",
-      // Markdown
-      ".md"
-      // Python
-      ".py",
-      // Rust
-      ".rs",
-      ".rs.in",
-      // Shell
-      ".sh",
-      ".bash",
-      // Text
-      ".txt",
-      ".csv",
-      ".json",
-      ".xml"
-      ".yml",
-      ".yaml",
+/* Directories that are never searched, matched on their exact name: the
+ * metadata of version control systems. Anything else, such as build
+ * output, is left to the ignore files, so that --no-ignore and negated
+ * rules can bring it back. */
+bool exclude_directory(std::string_view name)
+{
+  return name == ".git" || name == ".hg" || name == ".svn";
+}
+
+/* Calls visit(name, d_type) for every entry of the open directory fd but
+ * "." and "..". d_type may be DT_UNKNOWN on file systems that do not fill
+ * it in. */
+template<typename F>
+void for_each_directory_entry(int fd, F&& visit)
+{
+  const auto is_dot_or_dot_dot = [](const char* name)
+  {
+    return name[0] == '.'
+        && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+  };
+
+#if defined(__linux__)
+  // Raw getdents64 fills a large buffer per call, with no DIR* allocation
+  struct linux_dirent64
+  {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
   };
 
-  bool result = false;
-  for (const auto& suffix : allowed_suffixes) {
-    if (str.size() >= suffix.size()
-        && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0)
-    {
-      result = true;
+  alignas(linux_dirent64) char buffer[32 * 1024];
+  while (true) {
+    const auto length = ::syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+    if (length <= 0) {
       break;
     }
+
+    for (long offset = 0; offset < length;) {
+      const auto* entry =
+          reinterpret_cast<const linux_dirent64*>(buffer + offset);
+      offset += entry->d_reclen;
+      if (!is_dot_or_dot_dot(entry->d_name)) {
+        visit(entry->d_name, entry->d_type);
+      }
+    }
+  }
+#else
+  DIR* dir = ::fdopendir(::dup(fd));
+  if (dir == nullptr) {
+    return;
+  }
+  while (const auto* entry = ::readdir(dir)) {
+    if (!is_dot_or_dot_dot(entry->d_name)) {
+      visit(entry->d_name, entry->d_type);
+    }
   }
-  return result;
+  ::closedir(dir);
+#endif
 }
 
-bool exclude_directory(const char* path)
+/* Up to max_files paths selected from one directory, handed to the pool
+ * as a single task. The paths are stored one after the other, each
+ * NUL-terminated, in an arena inside the batch, so a file costs no
+ * allocation of its own. */
+struct file_batch
 {
-  static const std::unordered_set<const char*> ignored_dirs = {
-      ".git/",         ".github/",       "build/",
-      "node_modules/", ".vscode/",       ".DS_Store/",
-      "debugPublic/",  "DebugPublic/",   "debug/",
-      "Debug/",        "Release/",       "release/",
-      "Releases/",     "releases/",      "cmake-build-debug/",
-      "__pycache__/",  "Binaries/",      "Doc/",
-      "doc/",          "Documentation/", "docs/",
-      "Docs/",         "bin/",           "Bin/",
-      "patches/",      "tar-install/",   "CMakeFiles/",
-      "install/",      "snap/",          "LICENSES/",
-      "img/",          "images/",        "imgs/"};
+  static constexpr std::size_t max_files = 128;
+  static constexpr std::size_t arena_size = 16 * 1024;
+
+  file_batch(std::size_t prefix_length, const searcher::file_visitor* visitor)
+      : root_length(prefix_length)
+      , visit(visitor)
+  {
+    task.function = &run;
+    task.argument = this;
+    task.discard = &discard;
+  }
 
-  for (const auto& ignored_dir : ignored_dirs) {
-    // if path contains ignored dir, ignore it
-    if (strstr(path, ignored_dir) != nullptr) {
-      return true;
+  /* False when the batch is full */
+  bool add(std::string_view path)
+  {
+    if (count == max_files || used + path.size() + 1 > arena_size) {
+      return false;
     }
+    std::memcpy(arena + used, path.data(), path.size());
+    used += path.size();
+    arena[used++] = '\0';
+    ends[count++] = static_cast<uint16_t>(used - 1);
+    return true;
   }
 
-  return false;
-}
+  static void run(void* argument)
+  {
+    const std::unique_ptr<file_batch> batch(static_cast<file_batch*>(argument));
+    std::size_t start = 0;
+    for (std::size_t i = 0; i < batch->count; ++i) {
+      if (searcher::m_mode == output_mode::quiet && searcher::m_matched) {
+        break;
+      }
+      (*batch->visit)(
+          std::string_view(batch->arena + start, batch->ends[i] - start),
+          batch->root_length);
+      start = batch->ends[i] + 1;
+    }
+  }
+
+  static void discard(void* argument)
+  {
+    delete static_cast<file_batch*>(argument);
+  }
 
-int handle_posix_directory_entry(const char* filepath,
-                                 const struct stat* info,
-                                 const int typeflag,
-                                 struct FTW* pathinfo)
+  pool_task task;
+  std::size_t root_length;
+  const searcher::file_visitor* visit;
+  std::size_t count = 0;
+  std::size_t used = 0;
+  uint16_t ends[max_files];
+  char arena[arena_size];
+};
+
+/* Lists one directory. Subdirectories are pushed to the pool as tasks of
+ * their own, so idle workers pick up the walk, and the selected files are
+ * pushed in batches as soon as they are found. Symbolic links are not
+ * followed.
+ *
+ * rules are the ignore rules in effect for path; the directory's own
+ * ignore files are chained onto them for its entries and subdirectories.
+ * The first root_length bytes of path are the directory the walk started
+ * from, which -g globs are relative to. Selected files go to visit, and
+ * the directory itself to enter, if given, once its rules are known. */
+void walk_directory(const std::string& path,
+                    std::size_t root_length,
+                    std::shared_ptr<const ignore_rules> rules,
+                    const searcher::file_visitor* visit,
+                    const searcher::directory_visitor* enter)
 {
-  static const bool skip_fnmatch =
-      searcher::m_filter == std::string_view {"*.*"};
+  if (searcher::m_mode == output_mode::quiet && searcher::m_matched) {
+    return;
+  }
 
-  if (typeflag == FTW_DNR) {
+  const scoped_fd directory {
+      ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (directory.fd < 0) {
     // directory not readable
-    return FTW_SKIP_SUBTREE;
+    return;
   }
 
-  if (typeflag == FTW_D || typeflag == FTW_DP) {
-    // directory
-    if (exclude_directory(filepath)) {
-      return FTW_SKIP_SUBTREE;
-    } else {
-      return FTW_CONTINUE;
-    }
+  const auto prefix = path.back() == '/' ? path : path + '/';
+
+  // The ignore files have to be read before any entry is looked at. The
+  // names are kept one after the other in a single buffer.
+  struct entry
+  {
+    std::size_t offset;
+    std::size_t size;
+    unsigned char type;
+  };
+  std::vector<entry> entries;
+  std::string names;
+  ignore_files files;
+
+  for_each_directory_entry(
+      directory.fd,
+      [&](const char* name, unsigned char type)
+      {
+        if (type == DT_UNKNOWN) {
+          struct stat info;
+          if (::fstatat(directory.fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+          {
+            return;
+          }
+          type = S_ISDIR(info.st_mode) ? DT_DIR
+              : S_ISREG(info.st_mode)  ? DT_REG
+                                       : DT_UNKNOWN;
+        }
+
+        const std::string_view view(name);
+        if (type == DT_DIR) {
+          files.git_exclude = files.git_exclude || view == ".git";
+        } else if (type == DT_REG) {
+          files.gitignore = files.gitignore || view == ".gitignore";
+          files.ignore = files.ignore || view == ".ignore";
+        } else {
+          return;
+        }
+        entries.push_back({names.size(), view.size(), type});
+        names.append(view);
+      });
+
+  if (!searcher::m_no_ignore) {
+    rules = ignore_rules::load(directory.fd, prefix, files, std::move(rules));
   }
+  if (enter != nullptr) {
+    (*enter)(path, rules);
+  }
+
+  std::string child = prefix;
+  std::unique_ptr<file_batch> batch;
+  for (const auto& [offset, size, type] : entries) {
+    const bool is_dir = type == DT_DIR;
+    child.resize(prefix.size());
+    child.append(names, offset, size);
+    if (!searcher::is_walked(child, is_dir, root_length, rules.get())) {
+      continue;
+    }
 
-  if (typeflag == FTW_F) {
-    if ((skip_fnmatch && is_whitelisted(filepath))
-        || fnmatch(searcher::m_filter.data(), filepath, 0) == 0)
-    {
+    if (is_dir) {
       searcher::m_ts->push_task(
-          [pathstring = std::string {filepath}]()
-          { searcher::read_file_and_search(pathstring.data()); });
+          [child, root_length, rules, visit, enter]()
+          { walk_directory(child, root_length, rules, visit, enter); });
+      continue;
+    }
+
+    if (batch && batch->add(child)) {
+      continue;
+    }
+    if (batch) {
+      searcher::m_ts->push_task(batch.release()->task);
     }
+    batch = std::make_unique<file_batch>(root_length, visit);
+    // A path too long for an empty batch is too long to open
+    if (!batch->add(child)) {
+      batch.reset();
+    }
+  }
+  if (batch) {
+    searcher::m_ts->push_task(batch.release()->task);
   }
+}
 
-  return FTW_CONTINUE;
+bool searcher::is_walked(const std::string& path,
+                         bool is_dir,
+                         std::size_t root_length,
+                         const ignore_rules* rules)
+{
+  const auto slash = path.rfind('/');
+  const auto name = std::string_view(path).substr(
+      slash == std::string::npos ? 0 : slash + 1);
+  if (is_dir && exclude_directory(name)) {
+    return false;
+  }
+  if (rules && rules->is_ignored(path, is_dir)) {
+    return false;
+  }
+  return is_dir ? !m_file_filter.is_excluded_directory(path, root_length)
+                : m_file_filter.is_selected(path, root_length);
 }
 
 void searcher::directory_search(const char* path)
+{
+  walk_files(path,
+             [](std::string_view file, std::size_t)
+             { read_file_and_search(file.data()); });
+}
+
+void searcher::walk_files(const char* path,
+                          const file_visitor& visit,
+                          const directory_visitor* enter)
 {
   /* Invalid directory path? */
   if (path == NULL || *path == '\0')
     return;
 
-  nftw(
-      path, handle_posix_directory_entry, USE_FDS, FTW_PHYS | FTW_ACTIONRETVAL);
+  std::string root {path};
+  const auto root_length = root.back() == '/' ? root.size() : root.size() + 1;
+  walk_subdirectory(root, root_length, nullptr, visit, enter);
+}
+
+void searcher::walk_subdirectory(const std::string& path,
+                                 std::size_t root_length,
+                                 std::shared_ptr<const ignore_rules> rules,
+                                 const file_visitor& visit,
+                                 const directory_visitor* enter)
+{
+  searcher::m_ts->push_task(
+      [path, root_length, rules = std::move(rules), visit = &visit, enter]()
+      { walk_directory(path, root_length, rules, visit, enter); });
   searcher::m_ts->wait_for_tasks();
 }
 
+void searcher::indexed_search(const char* path)
+{
+  std::string index_path {path};
+  if (index_path.back() != '/') {
+    index_path += '/';
+  }
+  const trigram_index index(index_path.append(trigram_index::file_name));
+
+  // A match contains one of the literals, so it can only be in a file that
+  // is a candidate for one of them; nullopt when some literal is too short
+  // to rule out any file
+  const auto& literals = m_literals
+      ? m_literals->patterns()
+      : std::vector<std::string> {std::string(m_query)};
+  std::optional<std::vector<bool>> candidates {std::in_place, index.size()};
+  for (const auto& literal : literals) {
+    const auto ids = index.candidates(literal);
+    if (!ids) {
+      candidates.reset();
+      break;
+    }
+    for (const auto id : *ids) {
+      if (id < candidates->size()) {
+        (*candidates)[id] = true;
+      }
+    }
+  }
+
+  walk_files(path,
+             [&](std::string_view file, std::size_t root_length)
+             {
+               const auto relative = file.substr(root_length);
+               if (relative == trigram_index::file_name) {
+                 return;
+               }
+
+               // Files added or changed since the index was built are
+               // always searched
+               file_stamp stamp;
+               const auto id = index.find(relative);
+               if (candidates && id >= 0 && !(*candidates)[id]
+                   && read_file_stamp(file.data(), stamp)
+                   && index.is_current(id, stamp))
+               {
+                 return;
+               }
+               read_file_and_search(file.data());
+             });
+}
+
 }  // namespace search
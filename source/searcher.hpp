@@ -1,13 +1,18 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <chrono>
+#include <cstdio>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <limits>
 #include <iostream>
+#include <new>
+#include <optional>
 #include <streambuf>
 #include <string>
 #include <string_view>
@@ -16,24 +21,119 @@
 
 #include <fmt/color.h>
 #include <fmt/core.h>
+#include <file_filter.hpp>
+#include <ignore.hpp>
 #include <immintrin.h>
+#include <multi_literal.hpp>
+#include <regex.hpp>
 #include <sse2_strstr.hpp>
 #include <thread_pool.hpp>
+#include <trigram_index.hpp>
 
 namespace search
 {
+class output_queue;
+
+enum class output_mode
+{
+  lines,
+  // -l: names of files with a match
+  files_with_matches,
+  // -c: number of matching lines per file
+  count,
+  // -q: nothing; the exit status tells if there was a match
+  quiet
+};
+
 struct searcher
 {
   static inline std::unique_ptr<thread_pool> m_ts;
   static inline std::string_view m_query;
-  static inline std::string_view m_filter;
+  // m_query with its prefilter anchors, see compile_needle
+  static inline strstr_needle m_needle;
+  // Set when more than one pattern is given; takes precedence over m_query
+  static inline std::unique_ptr<multi_literal> m_literals;
+  // Set in regex mode; m_query and m_literals then hold the literals
+  // every match must contain, used as a prefilter
+  static inline std::unique_ptr<regex> m_regex;
+  // Which files a directory walk searches: -g, --type, -f
+  static inline file_filter m_file_filter;
+  // --no-ignore: do not read .gitignore, .ignore and .git/info/exclude
+  static inline bool m_no_ignore = false;
+  // ASCII case-insensitive; m_query is stored lowercased
+  static inline bool m_ignore_case;
+  static inline output_mode m_mode = output_mode::lines;
+  // Set on the first match anywhere, for the exit status and for -q
+  static inline std::atomic<bool> m_matched = false;
+  // -n: prefix lines with their line number
+  static inline bool m_line_number = false;
+  // Files of at least this many bytes are mapped instead of read; a
+  // negative value never maps
+  static inline long long m_mmap_threshold = 1 << 20;
+  // --stream: search files in chunks of bounded size instead of whole
+  static inline bool m_stream = false;
+  static inline std::size_t m_stream_chunk_size = 1 << 20;
+  // Where results go; stdout, or a client's stdout under `serve`
+  static inline std::FILE* m_out = stdout;
+  // Where warnings go; stderr, or a client's stderr under `serve`
+  static inline std::FILE* m_err = stderr;
+  // --pipeline: results go through this queue to m_out instead
+  static inline output_queue* m_output = nullptr;
+  // --sort path: what the file this thread searches writes goes here
+  // instead, to be written out in path order
+  static inline thread_local std::string* m_file_output = nullptr;
   static inline bool m_is_stdout;
   static inline bool m_is_path_from_terminal;
 
+  /* Returns the number of matching lines. first_line_number is the line
+   * number of the start of haystack, for input read line by line. */
   static std::size_t file_search(std::string_view filename,
-                                 std::string_view haystack);
+                                 std::string_view haystack,
+                                 std::size_t first_line_number = 1);
+  /* Whether text holds a match, as a search of it would find one */
+  static bool has_match(std::string_view text);
   static void read_file_and_search(const char* path);
+  /* Like read_file_and_search, but a large file is split into ranges that
+   * are searched in parallel on m_ts. Must not be called from a task
+   * running on m_ts itself. */
+  static void read_file_and_search_split(const char* path);
   static void directory_search(const char* path);
+
+  /* Called for each file a directory walk selects; the first root_length
+   * bytes of path are the directory the walk started from. path is
+   * NUL-terminated, and only valid during the call. */
+  using file_visitor =
+      std::function<void(std::string_view path, std::size_t root_length)>;
+  /* Called for each directory a walk lists, with the ignore rules in
+   * effect for its entries */
+  using directory_visitor =
+      std::function<void(const std::string& path,
+                          const std::shared_ptr<const ignore_rules>& rules)>;
+  /* Walks path like directory_search, honouring ignore files and the file
+   * filter, but hands each file to visit on m_ts instead of searching it */
+  static void walk_files(const char* path,
+                         const file_visitor& visit,
+                         const directory_visitor* enter = nullptr);
+  /* Walks path as a subdirectory of a walk that started root_length bytes
+   * into it, where rules are the ignore rules of its parent */
+  static void walk_subdirectory(const std::string& path,
+                                std::size_t root_length,
+                                std::shared_ptr<const ignore_rules> rules,
+                                const file_visitor& visit,
+                                const directory_visitor* enter = nullptr);
+  /* Whether a walk takes the entry at path, given the ignore rules of the
+   * directory it is in */
+  static bool is_walked(const std::string& path,
+                        bool is_dir,
+                        std::size_t root_length,
+                        const ignore_rules* rules);
+  /* Like directory_search, but only reads the files that the trigram index
+   * of path lists as candidates, plus those changed since it was built.
+   * Throws std::runtime_error when path has no valid index. */
+  static void indexed_search(const char* path);
+
+private:
+  static void search_file(const char* path, bool split);
 };
 
 }  // namespace search
@@ -0,0 +1,388 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include <cli.hpp>
+#include <corpus.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <searcher.hpp>
+#include <server.hpp>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace search
+{
+/* A request is the client's standard input, output and error, passed as
+ * SCM_RIGHTS with the first byte, then
+ *
+ *   uint32_t length of the rest
+ *   (uint32_t size, bytes) for the working directory, then for each
+ *   argument of the command line
+ *
+ * The reply is the exit status as an int32_t, sent once the search is done
+ * and everything is written to the client's streams. */
+namespace
+{
+constexpr uint32_t max_request_size = 1 << 20;
+
+// How long the daemon may sit idle before it looks for changed files
+constexpr int refresh_interval_ms = 5000;
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int)
+{
+  stop_requested = 1;
+}
+
+bool write_all(int fd, const void* data, std::size_t size)
+{
+  const auto* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    const auto result = ::send(fd, bytes, size, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    bytes += result;
+    size -= static_cast<std::size_t>(result);
+  }
+  return true;
+}
+
+bool read_all(int fd, void* data, std::size_t size)
+{
+  auto* bytes = static_cast<char*>(data);
+  while (size > 0) {
+    const auto result = ::read(fd, bytes, size);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    bytes += result;
+    size -= static_cast<std::size_t>(result);
+  }
+  return true;
+}
+
+bool make_address(const std::string& path, sockaddr_un& address)
+{
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  std::memcpy(address.sun_path, path.data(), path.size());
+  return true;
+}
+
+/* Closes every descriptor that came with message */
+void close_received(msghdr& message)
+{
+  for (auto* header = CMSG_FIRSTHDR(&message); header != nullptr;
+       header = CMSG_NXTHDR(&message, header))
+  {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    const auto count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (std::size_t i = 0; i < count; ++i) {
+      int received;
+      std::memcpy(&received, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+      ::close(received);
+    }
+  }
+}
+
+/* Receives the length prefix along with the client's three descriptors */
+bool receive_header(int fd, uint32_t& length, int (&fds)[3])
+{
+  iovec data = {&length, sizeof(length)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t result;
+  do {
+    result = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0) {
+    return false;
+  }
+
+  // Anything but the three descriptors alone is refused, and whatever
+  // did arrive is closed, so that a bad request leaks nothing
+  auto* header = CMSG_FIRSTHDR(&message);
+  if (result != sizeof(length) || length > max_request_size
+      || header == nullptr || header->cmsg_level != SOL_SOCKET
+      || header->cmsg_type != SCM_RIGHTS
+      || header->cmsg_len != CMSG_LEN(sizeof(fds))
+      || CMSG_NXTHDR(&message, header) != nullptr)
+  {
+    close_received(message);
+    return false;
+  }
+  std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+  return true;
+}
+
+/* Splits the rest of a request into the working directory and arguments */
+bool parse_request(std::string_view request, std::vector<std::string>& out)
+{
+  while (!request.empty()) {
+    uint32_t size;
+    if (request.size() < sizeof(size)) {
+      return false;
+    }
+    std::memcpy(&size, request.data(), sizeof(size));
+    request.remove_prefix(sizeof(size));
+    if (size > request.size()) {
+      return false;
+    }
+    out.emplace_back(request.substr(0, size));
+    request.remove_prefix(size);
+  }
+  return out.size() >= 2;
+}
+
+/* Whether the peer runs as the daemon's user. Anyone else could have
+ * the daemon search any directory with its privileges. */
+bool is_own_user(int client)
+{
+  ucred peer = {};
+  socklen_t size = sizeof(peer);
+  return ::getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0
+      && peer.uid == ::geteuid();
+}
+
+void handle_client(int client, const corpus& resident)
+{
+  if (!is_own_user(client)) {
+    return;
+  }
+
+  // A client that stalls must not hold the daemon up for long
+  const timeval timeout = {5, 0};
+  ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  uint32_t length = 0;
+  int fds[3];
+  if (!receive_header(client, length, fds)) {
+    return;
+  }
+
+  std::string request(length, '\0');
+  std::vector<std::string> fields;
+  std::FILE* out = ::fdopen(fds[1], "w");
+  std::FILE* err = ::fdopen(fds[2], "w");
+
+  int32_t status = 1;
+  if (out == nullptr || err == nullptr) {
+    // Nowhere to report anything
+  } else if (!read_all(client, request.data(), request.size())
+             || !parse_request(request, fields))
+  {
+    fmt::print(err, "Error: malformed request\n");
+  } else if (::chdir(fields[0].c_str()) != 0) {
+    fmt::print(err,
+               "Error: cannot change to '{}': {}\n",
+               fields[0],
+               std::strerror(errno));
+  } else {
+    std::vector<char*> argv;
+    for (auto it = fields.begin() + 1; it != fields.end(); ++it) {
+      argv.push_back(it->data());
+    }
+    argv.push_back(nullptr);
+
+    status = run_cli(static_cast<int>(argv.size() - 1),
+                     argv.data(),
+                     {fds[0], out, err},
+                     &resident);
+  }
+
+  out != nullptr ? std::fclose(out) : ::close(fds[1]);
+  err != nullptr ? std::fclose(err) : ::close(fds[2]);
+  ::close(fds[0]);
+
+  write_all(client, &status, sizeof(status));
+}
+
+}  // namespace
+
+int serve(const std::string& socket_path, const std::string& root)
+{
+  sockaddr_un address;
+  if (!make_address(socket_path, address)) {
+    fmt::print(stderr, "Error: invalid socket path '{}'\n", socket_path);
+    return 1;
+  }
+
+  // A client that goes away mid-search must not take the daemon with it
+  std::signal(SIGPIPE, SIG_IGN);
+  struct sigaction action = {};
+  action.sa_handler = request_stop;
+  ::sigaction(SIGINT, &action, nullptr);
+  ::sigaction(SIGTERM, &action, nullptr);
+
+  searcher::m_ts = std::make_unique<thread_pool>();
+  std::unique_ptr<corpus> resident;
+  try {
+    resident = std::make_unique<corpus>(root);
+  } catch (const std::exception& err) {
+    fmt::print(stderr, "Error: {}\n", err.what());
+    return 1;
+  }
+
+  const int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    fmt::print(stderr, "Error: socket: {}\n", std::strerror(errno));
+    return 1;
+  }
+
+  // Replace the socket of a daemon that did not shut down cleanly
+  struct stat info;
+  if (::lstat(socket_path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+    ::unlink(socket_path.c_str());
+  }
+  // Only the owner may connect; nobody can before listen()
+  if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+          != 0
+      || ::chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) != 0
+      || ::listen(listener, 16) != 0)
+  {
+    fmt::print(stderr,
+               "Error: cannot listen on '{}': {}\n",
+               socket_path,
+               std::strerror(errno));
+    ::close(listener);
+    return 1;
+  }
+
+  fmt::print(stderr,
+             "Serving {} files below {} on {}\n",
+             resident->size(),
+             resident->root(),
+             socket_path);
+
+  while (!stop_requested) {
+    pollfd listening = {listener, POLLIN, 0};
+    const int ready = ::poll(&listening, 1, refresh_interval_ms);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (ready == 0) {
+      resident->refresh();
+      continue;
+    }
+
+    const int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client >= 0) {
+      handle_client(client, *resident);
+      ::close(client);
+    }
+  }
+
+  ::close(listener);
+  ::unlink(socket_path.c_str());
+  return 0;
+}
+
+int run_client(const std::string& socket_path, int argc, char* argv[])
+{
+  // The request carries everything but the --server option itself
+  std::vector<std::string_view> fields;
+  char cwd[4096];
+  if (::getcwd(cwd, sizeof(cwd)) == nullptr) {
+    fmt::print(stderr, "Error: getcwd: {}\n", std::strerror(errno));
+    return 1;
+  }
+  fields.push_back(cwd);
+  for (int i = 0; i < argc; ++i) {
+    if (std::string_view(argv[i]) == "--server" && i + 1 < argc) {
+      ++i;
+      continue;
+    }
+    fields.push_back(argv[i]);
+  }
+
+  std::string request(sizeof(uint32_t), '\0');
+  for (const auto field : fields) {
+    const auto size = static_cast<uint32_t>(field.size());
+    request.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    request.append(field);
+  }
+  const auto length =
+      static_cast<uint32_t>(request.size() - sizeof(uint32_t));
+  std::memcpy(request.data(), &length, sizeof(length));
+
+  sockaddr_un address;
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (!make_address(socket_path, address) || fd < 0
+      || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+          != 0)
+  {
+    fmt::print(stderr,
+               "Error: cannot reach server at '{}': {}\n",
+               socket_path,
+               std::strerror(errno));
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return 1;
+  }
+
+  // The descriptors go with the length prefix, the rest follows plainly
+  const int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  iovec data = {request.data(), sizeof(length)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  auto* header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+  // Whatever was buffered must come out before the daemon's output
+  std::fflush(stdout);
+
+  int32_t status = 1;
+  ssize_t sent;
+  do {
+    sent = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent != sizeof(length)
+      || !write_all(fd,
+                    request.data() + sizeof(length),
+                    request.size() - sizeof(length))
+      || !read_all(fd, &status, sizeof(status)))
+  {
+    fmt::print(
+        stderr, "Error: the server at '{}' did not answer\n", socket_path);
+    status = 1;
+  }
+
+  ::close(fd);
+  return status;
+}
+
+}  // namespace search
@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+
+namespace search
+{
+/* `serve SOCKET [DIR]`: loads the files below root into a corpus and runs
+ * the searches that clients send over the Unix domain socket at
+ * socket_path, one at a time on searcher::m_ts, until SIGINT or SIGTERM.
+ * Returns the exit status. */
+int serve(const std::string& socket_path, const std::string& root);
+
+/* `--server SOCKET`: hands the command line, the working directory and the
+ * standard streams to the daemon at socket_path, which runs the search as
+ * run_cli would here and writes straight to those streams. Returns the
+ * search's exit status. */
+int run_client(const std::string& socket_path, int argc, char* argv[]);
+
+}  // namespace search
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <searcher.hpp>
+#include <sorted_search.hpp>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace search
+{
+namespace
+{
+// Files one task searches, one after the other in path order
+constexpr std::size_t files_per_task = 64;
+
+// Results one writev takes at most
+constexpr std::size_t max_iovecs = IOV_MAX;
+
+/* Path order, comparing one component at a time: "a/b" comes before
+ * "a.c", since "a" comes before "a.c" */
+bool path_less(std::string_view a, std::string_view b)
+{
+  const auto rank = [](char c)
+  { return c == '/' ? 0 : static_cast<unsigned char>(c) + 1; };
+
+  const auto length = std::min(a.size(), b.size());
+  for (std::size_t i = 0; i < length; ++i) {
+    if (a[i] != b[i]) {
+      return rank(a[i]) < rank(b[i]);
+    }
+  }
+  return a.size() < b.size();
+}
+
+/* Writes out every buffer of iovecs, however many calls it takes */
+bool write_all(int fd, iovec* iovecs, std::size_t count)
+{
+  while (count > 0) {
+    const auto result =
+        ::writev(fd, iovecs, static_cast<int>(std::min(count, max_iovecs)));
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0) {
+      return false;
+    }
+
+    auto written = static_cast<std::size_t>(result);
+    while (count > 0 && written >= iovecs->iov_len) {
+      written -= iovecs->iov_len;
+      ++iovecs;
+      --count;
+    }
+    if (count > 0) {
+      iovecs->iov_base = static_cast<char*>(iovecs->iov_base) + written;
+      iovecs->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+class sorted_files
+{
+public:
+  /* Adds a file the walk selected; called on the pool */
+  void add(std::string_view path)
+  {
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    m_starts.push_back(m_paths.size());
+    m_paths.append(path);
+    m_paths.push_back('\0');
+  }
+
+  /* Numbers the files in path order, and searches them on the pool while
+   * writing out the results in that order */
+  void search()
+  {
+    std::sort(m_starts.begin(),
+              m_starts.end(),
+              [this](std::size_t a, std::size_t b)
+              { return path_less(path(a), path(b)); });
+    m_slots = std::make_unique<slot[]>(m_starts.size());
+
+    for (std::size_t begin = 0; begin < m_starts.size();
+         begin += files_per_task)
+    {
+      const auto end = std::min(begin + files_per_task, m_starts.size());
+      searcher::m_ts->push_task([this, begin, end] { search(begin, end); });
+    }
+    write_results();
+    // The last tasks may still be about to signal
+    searcher::m_ts->wait_for_tasks();
+  }
+
+private:
+  /* What a file wrote while it was searched */
+  struct slot
+  {
+    std::string output;
+    std::atomic<bool> done = false;
+  };
+
+  std::string_view path(std::size_t start) const
+  {
+    return std::string_view(m_paths.data() + start);
+  }
+
+  /* Searches the files numbered begin to end, each into its own slot */
+  void search(std::size_t begin, std::size_t end)
+  {
+    for (auto i = begin; i < end; ++i) {
+      searcher::m_file_output = &m_slots[i].output;
+      searcher::read_file_and_search(m_paths.data() + m_starts[i]);
+      searcher::m_file_output = nullptr;
+      m_slots[i].done.store(true, std::memory_order_release);
+    }
+    {
+      // Taken, so that the writer is either waiting or sees the slots done
+      const std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_searched.notify_one();
+  }
+
+  /* Writes the results in order, as soon as every file before them is
+   * searched, until all are written */
+  void write_results()
+  {
+    std::fflush(searcher::m_out);
+    const int fd = ::fileno(searcher::m_out);
+    bool failed = false;
+
+    std::vector<iovec> iovecs;
+    const auto count = m_starts.size();
+    for (std::size_t next = 0; next < count;) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        const auto& done = m_slots[next].done;
+        m_searched.wait(
+            lock, [&] { return done.load(std::memory_order_acquire); });
+      }
+
+      // Every result from next on that is done goes out in one writev
+      auto end = next;
+      iovecs.clear();
+      while (end < count && iovecs.size() < max_iovecs
+             && m_slots[end].done.load(std::memory_order_acquire))
+      {
+        auto& output = m_slots[end].output;
+        if (!output.empty()) {
+          iovecs.push_back({output.data(), output.size()});
+        }
+        ++end;
+      }
+      // Once the output is gone, the files left are still waited for
+      failed = failed || !write_all(fd, iovecs.data(), iovecs.size());
+
+      for (; next < end; ++next) {
+        std::string().swap(m_slots[next].output);
+      }
+    }
+  }
+
+  // Guards the walk's additions, then signals searched files to the writer
+  std::mutex m_mutex;
+  std::condition_variable m_searched;
+  // Every path, NUL-terminated, and where each starts
+  std::string m_paths;
+  std::vector<std::size_t> m_starts;
+  std::unique_ptr<slot[]> m_slots;
+};
+
+}  // namespace
+
+void sorted_search(const char* path)
+{
+  // -q writes nothing, so there is nothing to put in order
+  if (searcher::m_mode == output_mode::quiet) {
+    searcher::directory_search(path);
+    return;
+  }
+
+  sorted_files files;
+  searcher::walk_files(path,
+                       [&](std::string_view file, std::size_t)
+                       { files.add(file); });
+  files.search();
+}
+
+}  // namespace search
@@ -0,0 +1,15 @@
+#pragma once
+
+namespace search
+{
+/* --sort path: searches the directory path like directory_search, but
+ * writes the results in path order, the same on every run.
+ *
+ * The walk collects the files it selects; they are sorted by path,
+ * comparing one component at a time, and numbered in that order. The pool
+ * searches them in order of their numbers, each into a result slot of its
+ * own, while the calling thread writes out the results of every file up to
+ * the first one still being searched, with writev. */
+void sorted_search(const char* path);
+
+}  // namespace search
@@ -1,297 +1,241 @@
-#include <cassert>
-#include <cstring>
+#include <algorithm>
 
-#include <ctype.h>
+#include <byte_frequency.hpp>
 #include <immintrin.h>
 #include <sse2_strstr.hpp>
 
-#define FORCE_INLINE inline __attribute__((always_inline))
-
-#if defined(__AVX2__)
-
 namespace search
 {
-namespace
-{
-bool always_true(const char*, const char*)
+strstr_needle compile_needle(std::string_view needle, bool ignore_case)
 {
-  return true;
-}
-
-bool memcmp1(const char* a, const char* b)
-{
-  return a[0] == b[0];
-}
-
-bool memcmp2(const char* a, const char* b)
-{
-  const uint16_t A = *reinterpret_cast<const uint16_t*>(a);
-  const uint16_t B = *reinterpret_cast<const uint16_t*>(b);
-  return A == B;
-}
-
-bool memcmp3(const char* a, const char* b)
-{
-  const uint32_t A = *reinterpret_cast<const uint32_t*>(a);
-  const uint32_t B = *reinterpret_cast<const uint32_t*>(b);
-  return (A & 0x00ffffff) == (B & 0x00ffffff);
-}
-
-bool memcmp4(const char* a, const char* b)
-{
-  const uint32_t A = *reinterpret_cast<const uint32_t*>(a);
-  const uint32_t B = *reinterpret_cast<const uint32_t*>(b);
-  return A == B;
-}
-
-bool memcmp5(const char* a, const char* b)
-{
-  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
-  return ((A ^ B) & 0x000000fffffffffflu) == 0;
-}
-
-bool memcmp6(const char* a, const char* b)
-{
-  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
-  return ((A ^ B) & 0x0000fffffffffffflu) == 0;
-}
-
-bool memcmp7(const char* a, const char* b)
-{
-  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
-  return ((A ^ B) & 0x00fffffffffffffflu) == 0;
-}
-
-bool memcmp8(const char* a, const char* b)
-{
-  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
-  return A == B;
-}
-
-bool memcmp9(const char* a, const char* b)
-{
-  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
-  return (A == B) & (a[8] == b[8]);
-}
+  const size_t k = needle.size();
+  if (k < 2) {
+    return {needle, 0, 0};
+  }
 
-bool memcmp10(const char* a, const char* b)
-{
-  const uint64_t Aq = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t Bq = *reinterpret_cast<const uint64_t*>(b);
-  const uint16_t Aw = *reinterpret_cast<const uint16_t*>(a + 8);
-  const uint16_t Bw = *reinterpret_cast<const uint16_t*>(b + 8);
-  return (Aq == Bq) & (Aw == Bw);
-}
+  /* Byte ranks ignore correlation between neighbouring bytes ("_t" is far
+   * more common than '_' and 't' on their own suggest), so the classic
+   * first and last offsets are kept unless an inner byte is clearly rarer */
+  constexpr unsigned end_bonus = 8;
+
+  const auto cost = [&](size_t i)
+  {
+    const char c = needle[i];
+    unsigned rank = byte_frequency_rank[static_cast<unsigned char>(c)];
+    if (ignore_case && c >= 'a' && c <= 'z') {
+      // Either case matches, so take the commoner of the two
+      const auto upper = static_cast<unsigned char>(c & ~0x20);
+      rank = std::max<unsigned>(rank, byte_frequency_rank[upper]);
+    }
+    return (i == 0 || i == k - 1) ? rank : rank + end_bonus;
+  };
+
+  // Rarest byte first, then the rarest byte at any other offset
+  size_t rarest = 0;
+  for (size_t i = 1; i < k; ++i) {
+    if (cost(i) < cost(rarest)) {
+      rarest = i;
+    }
+  }
 
-bool memcmp11(const char* a, const char* b)
-{
-  const uint64_t Aq = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t Bq = *reinterpret_cast<const uint64_t*>(b);
-  const uint32_t Ad = *reinterpret_cast<const uint32_t*>(a + 8);
-  const uint32_t Bd = *reinterpret_cast<const uint32_t*>(b + 8);
-  return (Aq == Bq) & ((Ad & 0x00ffffff) == (Bd & 0x00ffffff));
-}
+  size_t other = rarest == 0 ? k - 1 : 0;
+  for (size_t i = 0; i < k; ++i) {
+    if (i != rarest && cost(i) < cost(other)) {
+      other = i;
+    }
+  }
 
-bool memcmp12(const char* a, const char* b)
-{
-  const uint64_t Aq = *reinterpret_cast<const uint64_t*>(a);
-  const uint64_t Bq = *reinterpret_cast<const uint64_t*>(b);
-  const uint32_t Ad = *reinterpret_cast<const uint32_t*>(a + 8);
-  const uint32_t Bd = *reinterpret_cast<const uint32_t*>(b + 8);
-  return (Aq == Bq) & (Ad == Bd);
+  return {needle, std::min(rarest, other), std::max(rarest, other)};
 }
 
-}  // namespace
+}  // namespace search
 
-namespace bits
-{
-template<typename T>
-T clear_leftmost_set(const T value)
-{
-  assert(value != 0);
+#if defined(__SSE2__)
 
-  return value & (value - 1);
-}
+#  include <strstr_kernel.hpp>
 
-template<typename T>
-unsigned get_first_bit_set(const T value)
+namespace search
 {
-  assert(value != 0);
-
-  return __builtin_ctz(value);
-}
-
-template<>
-unsigned get_first_bit_set<uint64_t>(const uint64_t value)
+namespace
 {
-  assert(value != 0);
-
-  return __builtin_ctzl(value);
-}
-
-}  // namespace bits
-
-size_t FORCE_INLINE sse2_strstr_anysize(const char* s,
-                                        size_t n,
-                                        const char* needle,
-                                        size_t k)
+struct sse2_block
 {
-  assert(k > 0);
-  assert(n > 0);
+  using vector = __m128i;
+  using mask = uint32_t;
+  static constexpr size_t size = 16;
 
-  const __m128i first = _mm_set1_epi8(needle[0]);
-  const __m128i last = _mm_set1_epi8(needle[k - 1]);
+  static FORCE_INLINE vector broadcast(char c)
+  {
+    return _mm_set1_epi8(c);
+  }
 
-  for (size_t i = 0; i < n; i += 16) {
+  static FORCE_INLINE mask match(vector first,
+                                 vector last,
+                                 const char* a,
+                                 const char* b)
+  {
     const __m128i block_first =
-        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
     const __m128i block_last =
-        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + k - 1));
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
 
     const __m128i eq_first = _mm_cmpeq_epi8(first, block_first);
     const __m128i eq_last = _mm_cmpeq_epi8(last, block_last);
 
-    uint16_t mask = _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
-
-    while (mask != 0) {
-      const auto bitpos = bits::get_first_bit_set(mask);
-
-      if (memcmp(s + i + bitpos + 1, needle + 1, k - 2) == 0) {
-        return i + bitpos;
-      }
-
-      mask = bits::clear_leftmost_set(mask);
-    }
+    return _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
   }
 
-  return std::string_view::npos;
-}
-
-// ------------------------------------------------------------------------
-
-template<size_t k, typename MEMCMP>
-size_t FORCE_INLINE sse2_strstr_memcmp(const char* s,
-                                       size_t n,
-                                       const char* needle,
-                                       MEMCMP memcmp_fun)
-{
-  assert(k > 0);
-  assert(n > 0);
-
-  const __m128i first = _mm_set1_epi8(needle[0]);
-  const __m128i last = _mm_set1_epi8(needle[k - 1]);
-
-  for (size_t i = 0; i < n; i += 16) {
-    const __m128i block_first =
-        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
-    const __m128i block_last =
-        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + k - 1));
+  static FORCE_INLINE mask match_fold(vector first,
+                                      vector last,
+                                      vector first_fold,
+                                      vector last_fold,
+                                      const char* a,
+                                      const char* b)
+  {
+    const __m128i block_first = _mm_or_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)), first_fold);
+    const __m128i block_last = _mm_or_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)), last_fold);
 
     const __m128i eq_first = _mm_cmpeq_epi8(first, block_first);
     const __m128i eq_last = _mm_cmpeq_epi8(last, block_last);
 
-    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
-
-    while (mask != 0) {
-      const auto bitpos = bits::get_first_bit_set(mask);
-
-      if (memcmp_fun(s + i + bitpos + 1, needle + 1)) {
-        return i + bitpos;
-      }
-
-      mask = bits::clear_leftmost_set(mask);
-    }
+    return _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
   }
 
-  return std::string_view::npos;
-}
+  static FORCE_INLINE mask equal(vector c, const char* a)
+  {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(
+        c, _mm_loadu_si128(reinterpret_cast<const __m128i*>(a))));
+  }
+};
 
 // ------------------------------------------------------------------------
 
-size_t sse2_strstr_v2(const char* s, size_t n, const char* needle, size_t k)
-{
-  size_t result = std::string_view::npos;
-
-  if (n < k) {
-    return result;
+using strstr_fn = size_t (*)(const char*, size_t, const strstr_needle&);
+using strstr_all_fn = size_t (*)(
+    const char*, size_t, const strstr_needle&, size_t*, size_t);
+using count_fn = size_t (*)(const char*, size_t, char);
+
+struct strstr_kernel
+{
+  strstr_fn fn;
+  strstr_fn fold_fn;
+  strstr_all_fn all_fn;
+  strstr_all_fn fold_all_fn;
+  count_fn count;
+  const char* name;
+};
+
+strstr_kernel select_kernel()
+{
+#  if defined(OYSTR_RUNTIME_DISPATCH)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) {
+    return {avx512bw_strstr,
+            avx512bw_strcasestr,
+            avx512bw_strstr_all,
+            avx512bw_strcasestr_all,
+            avx512bw_count_byte,
+            "avx512bw"};
   }
+  if (__builtin_cpu_supports("avx2")) {
+    return {avx2_strstr,
+            avx2_strcasestr,
+            avx2_strstr_all,
+            avx2_strcasestr_all,
+            avx2_count_byte,
+            "avx2"};
+  }
+#  endif
+  return {sse2_strstr,
+          sse2_strcasestr,
+          sse2_strstr_all,
+          sse2_strcasestr_all,
+          sse2_count_byte,
+          "sse2"};
+}
 
-  switch (k) {
-    case 0:
-      return 0;
-
-    case 1: {
-      const char* res = reinterpret_cast<const char*>(strchr(s, needle[0]));
-
-      return (res != nullptr) ? res - s : std::string_view::npos;
-    }
-
-    case 2:
-      result = sse2_strstr_memcmp<2>(s, n, needle, always_true);
-      break;
+// Resolved once during static initialization, before main runs
+const strstr_kernel kernel = select_kernel();
 
-    case 3:
-      result = sse2_strstr_memcmp<3>(s, n, needle, memcmp1);
-      break;
+}  // namespace
 
-    case 4:
-      result = sse2_strstr_memcmp<4>(s, n, needle, memcmp2);
-      break;
+size_t sse2_strstr(const char* s, size_t n, const strstr_needle& needle)
+{
+  return strstr_v2<sse2_block, false>(s, n, needle);
+}
 
-    case 5:
-      result = sse2_strstr_memcmp<5>(s, n, needle, memcmp4);
-      break;
+size_t sse2_strcasestr(const char* s, size_t n, const strstr_needle& needle)
+{
+  return strstr_v2<sse2_block, true>(s, n, needle);
+}
 
-    case 6:
-      result = sse2_strstr_memcmp<6>(s, n, needle, memcmp4);
-      break;
+size_t sse2_strstr_all(const char* s,
+                       size_t n,
+                       const strstr_needle& needle,
+                       size_t* positions,
+                       size_t max)
+{
+  return strstr_all<sse2_block, false>(s, n, needle, positions, max);
+}
 
-    case 7:
-      result = sse2_strstr_memcmp<7>(s, n, needle, memcmp5);
-      break;
+size_t sse2_strcasestr_all(const char* s,
+                           size_t n,
+                           const strstr_needle& needle,
+                           size_t* positions,
+                           size_t max)
+{
+  return strstr_all<sse2_block, true>(s, n, needle, positions, max);
+}
 
-    case 8:
-      result = sse2_strstr_memcmp<8>(s, n, needle, memcmp6);
-      break;
+size_t sse2_count_byte(const char* s, size_t n, char c)
+{
+  return count_byte<sse2_block>(s, n, c);
+}
 
-    case 9:
-      result = sse2_strstr_memcmp<9>(s, n, needle, memcmp8);
-      break;
+// ------------------------------------------------------------------------
 
-    case 10:
-      result = sse2_strstr_memcmp<10>(s, n, needle, memcmp8);
-      break;
+size_t sse2_strstr_v2(const std::string_view& s, const strstr_needle& needle)
+{
+  return kernel.fn(s.data(), s.size(), needle);
+}
 
-    case 11:
-      result = sse2_strstr_memcmp<11>(s, n, needle, memcmp9);
-      break;
+size_t sse2_strstr_v2(const std::string_view& s, const std::string_view& needle)
+{
+  return kernel.fn(s.data(), s.size(), compile_needle(needle));
+}
 
-    case 12:
-      result = sse2_strstr_memcmp<12>(s, n, needle, memcmp10);
-      break;
+size_t sse2_strcasestr_v2(const std::string_view& s,
+                          const strstr_needle& needle)
+{
+  return kernel.fold_fn(s.data(), s.size(), needle);
+}
 
-    default:
-      result = sse2_strstr_anysize(s, n, needle, k);
-      break;
-  }
+size_t sse2_strstr_all_v2(const std::string_view& s,
+                          const strstr_needle& needle,
+                          size_t* positions,
+                          size_t max)
+{
+  return kernel.all_fn(s.data(), s.size(), needle, positions, max);
+}
 
-  if (result <= n - k) {
-    return result;
-  } else {
-    return std::string_view::npos;
-  }
+size_t sse2_strcasestr_all_v2(const std::string_view& s,
+                              const strstr_needle& needle,
+                              size_t* positions,
+                              size_t max)
+{
+  return kernel.fold_all_fn(s.data(), s.size(), needle, positions, max);
 }
 
-// ------------------------------------------------------------------------
+size_t sse2_count_byte_v2(const std::string_view& s, char c)
+{
+  return kernel.count(s.data(), s.size(), c);
+}
 
-size_t sse2_strstr_v2(const std::string_view& s, const std::string_view& needle)
+const char* strstr_kernel_name()
 {
-  return sse2_strstr_v2(s.data(), s.size(), needle.data(), needle.size());
+  return kernel.name;
 }
 
 }  // namespace search
@@ -2,13 +2,110 @@
 #include <cstddef>
 #include <string_view>
 
+namespace search
+{
+/* A needle together with the two offsets the vector prefilter compares
+ * against. Anchoring on needle[0] and needle[k - 1] fires constantly when
+ * those are common bytes such as ' ', '_' or 'e', so compile_needle picks
+ * the two rarest bytes according to byte_frequency_rank instead. */
+struct strstr_needle
+{
+  std::string_view text;
+  size_t first;
+  size_t second;
+};
+
+/* With ignore_case, text must already be lowercase and the frequencies of
+ * both cases of a letter are combined. */
+strstr_needle compile_needle(std::string_view needle,
+                             bool ignore_case = false);
+
+}  // namespace search
+
 #if defined(__SSE2__)
 
 namespace search
 {
+/* Returns the position of the first occurrence of needle in s, or npos.
+ * Uses the widest kernel the host CPU supports, picked once at startup. */
+size_t sse2_strstr_v2(const std::string_view& s, const strstr_needle& needle);
 size_t sse2_strstr_v2(const std::string_view& s,
                       const std::string_view& needle);
 
+/* ASCII case-insensitive variant of sse2_strstr_v2. needle must already
+ * be lowercase; letters in s match in either case. */
+size_t sse2_strcasestr_v2(const std::string_view& s,
+                          const strstr_needle& needle);
+
+/* Fixed-width kernels behind sse2_strstr_v2 and sse2_strcasestr_v2. Only
+ * call the avx2 and avx512bw variants on hosts that support them. */
+size_t sse2_strstr(const char* s, size_t n, const strstr_needle& needle);
+size_t avx2_strstr(const char* s, size_t n, const strstr_needle& needle);
+size_t avx512bw_strstr(const char* s, size_t n, const strstr_needle& needle);
+
+size_t sse2_strcasestr(const char* s, size_t n, const strstr_needle& needle);
+size_t avx2_strcasestr(const char* s, size_t n, const strstr_needle& needle);
+size_t avx512bw_strcasestr(const char* s,
+                           size_t n,
+                           const strstr_needle& needle);
+
+/* Records in positions where up to max matches of needle in s start,
+ * the way repeated calls to sse2_strstr_v2 would find them, each one
+ * searched for from the end of the match before, in a single pass over s.
+ * Returns how many it recorded; with fewer than max, there are no more. */
+size_t sse2_strstr_all_v2(const std::string_view& s,
+                          const strstr_needle& needle,
+                          size_t* positions,
+                          size_t max);
+size_t sse2_strcasestr_all_v2(const std::string_view& s,
+                              const strstr_needle& needle,
+                              size_t* positions,
+                              size_t max);
+
+/* Fixed-width kernels behind sse2_strstr_all_v2 and
+ * sse2_strcasestr_all_v2 */
+size_t sse2_strstr_all(const char* s,
+                       size_t n,
+                       const strstr_needle& needle,
+                       size_t* positions,
+                       size_t max);
+size_t avx2_strstr_all(const char* s,
+                       size_t n,
+                       const strstr_needle& needle,
+                       size_t* positions,
+                       size_t max);
+size_t avx512bw_strstr_all(const char* s,
+                           size_t n,
+                           const strstr_needle& needle,
+                           size_t* positions,
+                           size_t max);
+
+size_t sse2_strcasestr_all(const char* s,
+                           size_t n,
+                           const strstr_needle& needle,
+                           size_t* positions,
+                           size_t max);
+size_t avx2_strcasestr_all(const char* s,
+                           size_t n,
+                           const strstr_needle& needle,
+                           size_t* positions,
+                           size_t max);
+size_t avx512bw_strcasestr_all(const char* s,
+                               size_t n,
+                               const strstr_needle& needle,
+                               size_t* positions,
+                               size_t max);
+
+/* Number of occurrences of c in s, e.g. newlines for line numbers */
+size_t sse2_count_byte_v2(const std::string_view& s, char c);
+
+size_t sse2_count_byte(const char* s, size_t n, char c);
+size_t avx2_count_byte(const char* s, size_t n, char c);
+size_t avx512bw_count_byte(const char* s, size_t n, char c);
+
+/* Name of the kernel selected for this host: "sse2", "avx2" or "avx512bw" */
+const char* strstr_kernel_name();
+
 }  // namespace search
 
 #endif
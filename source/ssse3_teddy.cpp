@@ -0,0 +1,100 @@
+#include <string_view>
+
+#include <immintrin.h>
+#include <teddy.hpp>
+
+#if defined(__SSSE3__)
+
+#  define FORCE_INLINE inline __attribute__((always_inline))
+
+namespace search
+{
+namespace
+{
+template<size_t m>
+size_t FORCE_INLINE teddy_find(const teddy_masks& masks,
+                               const char* s,
+                               size_t n,
+                               teddy_verify verify,
+                               void* context)
+{
+  const __m128i low4 = _mm_set1_epi8(0x0f);
+  const __m128i zero = _mm_setzero_si128();
+
+  __m128i lo[m];
+  __m128i hi[m];
+  for (size_t j = 0; j < m; ++j) {
+    lo[j] = _mm_load_si128(reinterpret_cast<const __m128i*>(masks.lo[j]));
+    hi[j] = _mm_load_si128(reinterpret_cast<const __m128i*>(masks.hi[j]));
+  }
+
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i res = _mm_set1_epi8(static_cast<char>(0xff));
+
+    for (size_t j = 0; j < m; ++j) {
+      const __m128i chunk =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + j));
+      const __m128i lo_nibbles = _mm_and_si128(chunk, low4);
+      const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi16(chunk, 4), low4);
+
+      res = _mm_and_si128(res,
+                          _mm_and_si128(_mm_shuffle_epi8(lo[j], lo_nibbles),
+                                        _mm_shuffle_epi8(hi[j], hi_nibbles)));
+    }
+
+    uint32_t mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(res, zero)) & 0xffff;
+    if (mask == 0) {
+      continue;
+    }
+
+    alignas(16) uint8_t buckets[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(buckets), res);
+
+    while (mask != 0) {
+      const auto bitpos = __builtin_ctz(mask);
+
+      if (verify(context, i + bitpos, buckets[bitpos])) {
+        return i + bitpos;
+      }
+
+      mask &= mask - 1;
+    }
+  }
+
+  // Scalar tail: same tables, one position at a time
+  for (; i + m <= n; ++i) {
+    unsigned buckets = 0xff;
+    for (size_t j = 0; j < m; ++j) {
+      const auto c = static_cast<uint8_t>(s[i + j]);
+      buckets &= masks.lo[j][c & 0x0f] & masks.hi[j][c >> 4];
+    }
+
+    if (buckets != 0 && verify(context, i, buckets)) {
+      return i;
+    }
+  }
+
+  return std::string_view::npos;
+}
+
+}  // namespace
+
+size_t ssse3_teddy_find(const teddy_masks& masks,
+                        const char* s,
+                        size_t n,
+                        teddy_verify verify,
+                        void* context)
+{
+  switch (masks.length) {
+    case 1:
+      return teddy_find<1>(masks, s, n, verify, context);
+    case 2:
+      return teddy_find<2>(masks, s, n, verify, context);
+    default:
+      return teddy_find<3>(masks, s, n, verify, context);
+  }
+}
+
+}  // namespace search
+#endif
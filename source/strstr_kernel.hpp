@@ -0,0 +1,576 @@
+#pragma once
+/* Width-generic substring kernels shared by the sse2, avx2 and avx512bw
+ * translation units. Each of those is compiled with its own -m flags and
+ * includes this header once, so everything here has internal linkage: the
+ * linker must never fold an AVX-512 instantiation into the SSE2 build.
+ *
+ * A block type provides:
+ *   vector, mask       - register and comparison mask types
+ *   size               - bytes compared per iteration
+ *   broadcast(c)       - c in every lane
+ *   match(f, l, a, b)  - bit i set iff a[i] == f and b[i] == l
+ *   match_fold(f, l, ff, fl, a, b)
+ *                      - bit i set iff (a[i] | ff) == f and (b[i] | fl) == l
+ *   equal(c, a)        - bit i set iff a[i] == c
+ *
+ * The case-insensitive (fold) kernels expect an already lowercased needle.
+ */
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include <sse2_strstr.hpp>
+
+#define FORCE_INLINE inline __attribute__((always_inline))
+
+namespace search
+{
+namespace
+{
+bool memcmp1(const char* a, const char* b)
+{
+  return a[0] == b[0];
+}
+
+bool memcmp2(const char* a, const char* b)
+{
+  const uint16_t A = *reinterpret_cast<const uint16_t*>(a);
+  const uint16_t B = *reinterpret_cast<const uint16_t*>(b);
+  return A == B;
+}
+
+bool memcmp3(const char* a, const char* b)
+{
+  const uint32_t A = *reinterpret_cast<const uint32_t*>(a);
+  const uint32_t B = *reinterpret_cast<const uint32_t*>(b);
+  return (A & 0x00ffffff) == (B & 0x00ffffff);
+}
+
+bool memcmp4(const char* a, const char* b)
+{
+  const uint32_t A = *reinterpret_cast<const uint32_t*>(a);
+  const uint32_t B = *reinterpret_cast<const uint32_t*>(b);
+  return A == B;
+}
+
+bool memcmp5(const char* a, const char* b)
+{
+  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
+  return ((A ^ B) & 0x000000fffffffffflu) == 0;
+}
+
+bool memcmp6(const char* a, const char* b)
+{
+  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
+  return ((A ^ B) & 0x0000fffffffffffflu) == 0;
+}
+
+bool memcmp7(const char* a, const char* b)
+{
+  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
+  return ((A ^ B) & 0x00fffffffffffffflu) == 0;
+}
+
+bool memcmp8(const char* a, const char* b)
+{
+  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
+  return A == B;
+}
+
+bool memcmp9(const char* a, const char* b)
+{
+  const uint64_t A = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t B = *reinterpret_cast<const uint64_t*>(b);
+  return (A == B) & (a[8] == b[8]);
+}
+
+bool memcmp10(const char* a, const char* b)
+{
+  const uint64_t Aq = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t Bq = *reinterpret_cast<const uint64_t*>(b);
+  const uint16_t Aw = *reinterpret_cast<const uint16_t*>(a + 8);
+  const uint16_t Bw = *reinterpret_cast<const uint16_t*>(b + 8);
+  return (Aq == Bq) & (Aw == Bw);
+}
+
+bool memcmp11(const char* a, const char* b)
+{
+  const uint64_t Aq = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t Bq = *reinterpret_cast<const uint64_t*>(b);
+  const uint32_t Ad = *reinterpret_cast<const uint32_t*>(a + 8);
+  const uint32_t Bd = *reinterpret_cast<const uint32_t*>(b + 8);
+  return (Aq == Bq) & ((Ad & 0x00ffffff) == (Bd & 0x00ffffff));
+}
+
+bool memcmp12(const char* a, const char* b)
+{
+  const uint64_t Aq = *reinterpret_cast<const uint64_t*>(a);
+  const uint64_t Bq = *reinterpret_cast<const uint64_t*>(b);
+  const uint32_t Ad = *reinterpret_cast<const uint32_t*>(a + 8);
+  const uint32_t Bd = *reinterpret_cast<const uint32_t*>(b + 8);
+  return (Aq == Bq) & (Ad == Bd);
+}
+
+namespace bits
+{
+template<typename T>
+T clear_leftmost_set(const T value)
+{
+  assert(value != 0);
+
+  return value & (value - 1);
+}
+
+template<typename T>
+unsigned get_first_bit_set(const T value)
+{
+  assert(value != 0);
+
+  return __builtin_ctz(value);
+}
+
+template<>
+unsigned get_first_bit_set<uint64_t>(const uint64_t value)
+{
+  assert(value != 0);
+
+  return __builtin_ctzl(value);
+}
+
+template<typename T>
+unsigned popcount(const T value)
+{
+  return __builtin_popcountll(value);
+}
+
+}  // namespace bits
+
+// ---- ASCII case folding ------------------------------------------------
+
+FORCE_INLINE bool is_alpha(char c)
+{
+  return static_cast<unsigned char>((c | 0x20) - 'a') < 26;
+}
+
+FORCE_INLINE char to_lower(char c)
+{
+  return is_alpha(c) ? static_cast<char>(c | 0x20) : c;
+}
+
+/* OR-ing this into a haystack byte maps both cases of an ASCII letter onto
+ * the lowercase one; other anchors are compared exactly. */
+FORCE_INLINE char fold_bits(char c)
+{
+  return is_alpha(c) ? 0x20 : 0x00;
+}
+
+/* Lowercases every ASCII letter in a word at once; bytes >= 0x80 and
+ * non-letters are left alone. */
+template<typename T>
+FORCE_INLINE T to_lower_swar(T x)
+{
+  constexpr T ones = static_cast<T>(~T(0)) / 0xff;
+  constexpr T high = ones * 0x80;
+
+  const T heptets = x & ~high;
+  const T ge_A = heptets + ones * (0x80 - 'A');
+  const T gt_Z = heptets + ones * (0x80 - 'Z' - 1);
+  const T upper = ge_A & ~gt_Z & ~x & high;
+
+  return x | (upper >> 2);
+}
+
+template<typename T>
+FORCE_INLINE T load(const char* p)
+{
+  T value;
+  memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+/* Case-folding counterparts of memcmpN: compares N bytes of a, lowercased,
+ * against the lowercase needle bytes b. Loads are sized like memcmpN, so
+ * they never read more than 3 bytes past a + N or b + N. */
+template<size_t N>
+bool memcmp_fold(const char* a, const char* b)
+{
+  if constexpr (N == 0) {
+    return true;
+  } else if constexpr (N == 1) {
+    return to_lower(a[0]) == b[0];
+  } else if constexpr (N == 2) {
+    return to_lower_swar(load<uint16_t>(a)) == load<uint16_t>(b);
+  } else if constexpr (N <= 4) {
+    constexpr uint32_t mask = ~uint32_t(0) >> (8 * (4 - N));
+    return ((to_lower_swar(load<uint32_t>(a)) ^ load<uint32_t>(b)) & mask)
+        == 0;
+  } else if constexpr (N <= 8) {
+    constexpr uint64_t mask = ~uint64_t(0) >> (8 * (8 - N));
+    return ((to_lower_swar(load<uint64_t>(a)) ^ load<uint64_t>(b)) & mask)
+        == 0;
+  } else {
+    static_assert(N <= 12, "memcmp_fold covers the memcmpN range only");
+    return memcmp_fold<8>(a, b) && memcmp_fold<N - 8>(a + 8, b + 8);
+  }
+}
+
+bool memcmp_fold_n(const char* a, const char* b, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    if (to_lower_swar(load<uint64_t>(a + i)) != load<uint64_t>(b + i)) {
+      return false;
+    }
+  }
+  for (; i < n; ++i) {
+    if (to_lower(a[i]) != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ------------------------------------------------------------------------
+
+/* The memcmpN helpers load whole words and may read up to 3 bytes past the
+ * end of both of what they compare. On the haystack side, the vector loops
+ * stop early enough that neither those loads nor the block loads touch
+ * memory beyond s + n; the last few positions are handled by
+ * scalar_strstr. On the needle side, strstr_memcmp hands them a copy of
+ * the needle padded by verify_slack bytes. */
+constexpr size_t verify_slack = 4;
+
+template<bool fold>
+size_t scalar_strstr(
+    const char* s, size_t n, const char* needle, size_t k, size_t i)
+{
+  if constexpr (fold) {
+    for (; i + k <= n; ++i) {
+      if (to_lower(s[i]) == needle[0]
+          && memcmp_fold_n(s + i + 1, needle + 1, k - 1))
+      {
+        return i;
+      }
+    }
+  } else {
+    while (i + k <= n) {
+      const void* p = memchr(s + i, needle[0], n - k + 1 - i);
+      if (p == nullptr) {
+        break;
+      }
+
+      i = static_cast<size_t>(static_cast<const char*>(p) - s);
+      if (memcmp(s + i + 1, needle + 1, k - 1) == 0) {
+        return i;
+      }
+      ++i;
+    }
+  }
+
+  return std::string_view::npos;
+}
+
+// ------------------------------------------------------------------------
+
+/* Candidate mask for the block at s + i: bit j is set when both anchor
+ * bytes of the needle line up with position i + j */
+template<typename block, bool fold>
+struct anchors
+{
+  typename block::vector first;
+  typename block::vector second;
+  typename block::vector first_fold;
+  typename block::vector second_fold;
+  size_t first_offset;
+  size_t second_offset;
+
+  explicit anchors(const strstr_needle& needle)
+      : first(block::broadcast(needle.text[needle.first]))
+      , second(block::broadcast(needle.text[needle.second]))
+      , first_fold(
+            block::broadcast(fold ? fold_bits(needle.text[needle.first]) : 0))
+      , second_fold(
+            block::broadcast(fold ? fold_bits(needle.text[needle.second]) : 0))
+      , first_offset(needle.first)
+      , second_offset(needle.second)
+  {
+  }
+
+  FORCE_INLINE typename block::mask match(const char* s) const
+  {
+    const char* a = s + first_offset;
+    const char* b = s + second_offset;
+
+    if constexpr (fold) {
+      return block::match_fold(first, second, first_fold, second_fold, a, b);
+    } else {
+      return block::match(first, second, a, b);
+    }
+  }
+};
+
+// ------------------------------------------------------------------------
+
+/* Both anchors lie within the needle, so the loads of the block at s + i
+ * end before s + i + k - 1 + block::size. Candidates are verified over the
+ * whole needle, which keeps verification independent of the offsets. */
+
+template<typename block, bool fold>
+size_t FORCE_INLINE strstr_anysize(const char* s,
+                                   size_t n,
+                                   const strstr_needle& needle)
+{
+  const char* text = needle.text.data();
+  const size_t k = needle.text.size();
+
+  assert(k > 0);
+  assert(n > 0);
+
+  const anchors<block, fold> anchor(needle);
+
+  size_t i = 0;
+  for (; i + k - 1 + block::size + verify_slack <= n; i += block::size) {
+    auto mask = anchor.match(s + i);
+
+    while (mask != 0) {
+      const auto bitpos = bits::get_first_bit_set(mask);
+      const char* candidate = s + i + bitpos;
+
+      if (fold ? memcmp_fold_n(candidate, text, k)
+               : memcmp(candidate, text, k) == 0)
+      {
+        return i + bitpos;
+      }
+
+      mask = bits::clear_leftmost_set(mask);
+    }
+  }
+
+  return scalar_strstr<fold>(s, n, text, k, i);
+}
+
+// ------------------------------------------------------------------------
+
+template<typename block, bool fold, size_t k, typename MEMCMP>
+size_t FORCE_INLINE strstr_memcmp(const char* s,
+                                  size_t n,
+                                  const strstr_needle& needle,
+                                  MEMCMP memcmp_fun)
+{
+  // memcmp_fun loads whole words from the needle too, so it compares
+  // against a copy with room for them after the last byte
+  char text[k + verify_slack] = {};
+  memcpy(text, needle.text.data(), k);
+
+  assert(k > 0);
+  assert(n > 0);
+
+  const anchors<block, fold> anchor(needle);
+
+  size_t i = 0;
+  for (; i + k - 1 + block::size + verify_slack <= n; i += block::size) {
+    auto mask = anchor.match(s + i);
+
+    while (mask != 0) {
+      const auto bitpos = bits::get_first_bit_set(mask);
+
+      if (memcmp_fun(s + i + bitpos, text)) {
+        return i + bitpos;
+      }
+
+      mask = bits::clear_leftmost_set(mask);
+    }
+  }
+
+  return scalar_strstr<fold>(s, n, text, k, i);
+}
+
+// ------------------------------------------------------------------------
+
+/* Verification helper for a needle of length k */
+template<bool fold, size_t k, typename MEMCMP>
+FORCE_INLINE auto verifier(MEMCMP memcmp_fun)
+{
+  if constexpr (fold) {
+    return memcmp_fold<k>;
+  } else {
+    return memcmp_fun;
+  }
+}
+
+template<typename block, bool fold>
+size_t strstr_v2(const char* s, size_t n, const strstr_needle& needle)
+{
+  const size_t k = needle.text.size();
+  size_t result = std::string_view::npos;
+
+  if (n < k) {
+    return result;
+  }
+
+  switch (k) {
+    case 0:
+      return 0;
+
+    case 1: {
+      if constexpr (fold) {
+        return scalar_strstr<fold>(s, n, needle.text.data(), k, 0);
+      }
+      const void* res = memchr(s, needle.text[0], n);
+
+      return (res != nullptr) ? static_cast<const char*>(res) - s
+                              : std::string_view::npos;
+    }
+
+    case 2:
+      result = strstr_memcmp<block, fold, 2>(
+          s, n, needle, verifier<fold, 2>(memcmp2));
+      break;
+
+    case 3:
+      result = strstr_memcmp<block, fold, 3>(
+          s, n, needle, verifier<fold, 3>(memcmp3));
+      break;
+
+    case 4:
+      result = strstr_memcmp<block, fold, 4>(
+          s, n, needle, verifier<fold, 4>(memcmp4));
+      break;
+
+    case 5:
+      result = strstr_memcmp<block, fold, 5>(
+          s, n, needle, verifier<fold, 5>(memcmp5));
+      break;
+
+    case 6:
+      result = strstr_memcmp<block, fold, 6>(
+          s, n, needle, verifier<fold, 6>(memcmp6));
+      break;
+
+    case 7:
+      result = strstr_memcmp<block, fold, 7>(
+          s, n, needle, verifier<fold, 7>(memcmp7));
+      break;
+
+    case 8:
+      result = strstr_memcmp<block, fold, 8>(
+          s, n, needle, verifier<fold, 8>(memcmp8));
+      break;
+
+    case 9:
+      result = strstr_memcmp<block, fold, 9>(
+          s, n, needle, verifier<fold, 9>(memcmp9));
+      break;
+
+    case 10:
+      result = strstr_memcmp<block, fold, 10>(
+          s, n, needle, verifier<fold, 10>(memcmp10));
+      break;
+
+    case 11:
+      result = strstr_memcmp<block, fold, 11>(
+          s, n, needle, verifier<fold, 11>(memcmp11));
+      break;
+
+    case 12:
+      result = strstr_memcmp<block, fold, 12>(
+          s, n, needle, verifier<fold, 12>(memcmp12));
+      break;
+
+    default:
+      result = strstr_anysize<block, fold>(s, n, needle);
+      break;
+  }
+
+  if (result <= n - k) {
+    return result;
+  } else {
+    return std::string_view::npos;
+  }
+}
+
+/* Records the positions of up to max matches of needle in s, as
+ * repeated calls to strstr_v2 would find them, each one searched for from
+ * the end of the match before. Returns how many it recorded. Candidates
+ * are taken from every bit of a block's mask, so each block is loaded
+ * once however many matches it holds. */
+template<typename block, bool fold>
+size_t strstr_all(const char* s,
+                  size_t n,
+                  const strstr_needle& needle,
+                  size_t* positions,
+                  size_t max)
+{
+  const char* text = needle.text.data();
+  const size_t k = needle.text.size();
+  if (k == 0 || n < k || max == 0) {
+    return 0;
+  }
+
+  const anchors<block, fold> anchor(needle);
+
+  size_t count = 0;
+  // Where the next match may start, at the end of the one before
+  size_t next = 0;
+  size_t i = 0;
+  for (; i + k - 1 + block::size + verify_slack <= n; i += block::size) {
+    auto mask = anchor.match(s + i);
+
+    while (mask != 0) {
+      const auto position = i + bits::get_first_bit_set(mask);
+      mask = bits::clear_leftmost_set(mask);
+
+      if (position >= next
+          && (fold ? memcmp_fold_n(s + position, text, k)
+                   : memcmp(s + position, text, k) == 0))
+      {
+        positions[count++] = position;
+        if (count == max) {
+          return count;
+        }
+        next = position + k;
+      }
+    }
+  }
+
+  for (i = std::max(i, next); count < max;) {
+    const auto position = scalar_strstr<fold>(s, n, text, k, i);
+    if (position == std::string_view::npos) {
+      break;
+    }
+    positions[count++] = position;
+    i = position + k;
+  }
+  return count;
+}
+
+// ---- Byte counting -----------------------------------------------------
+
+template<typename block>
+size_t count_byte(const char* s, size_t n, char c)
+{
+  const auto needle = block::broadcast(c);
+
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 2 * block::size <= n; i += 2 * block::size) {
+    count += bits::popcount(block::equal(needle, s + i));
+    count += bits::popcount(block::equal(needle, s + i + block::size));
+  }
+  for (; i + block::size <= n; i += block::size) {
+    count += bits::popcount(block::equal(needle, s + i));
+  }
+  for (; i < n; ++i) {
+    count += s[i] == c;
+  }
+
+  return count;
+}
+
+}  // namespace
+}  // namespace search
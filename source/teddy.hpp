@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace search
+{
+/* Packed nibble tables for the Teddy fingerprint prefilter. Each pattern is
+ * assigned one of 8 buckets; bit b of lo[j][x] (resp. hi[j][x]) is set when
+ * some pattern in bucket b has x as the low (resp. high) nibble of its j-th
+ * byte. A position is a candidate for bucket b when all `length`
+ * fingerprint bytes agree on b. */
+struct teddy_masks
+{
+  alignas(16) uint8_t lo[3][16];
+  alignas(16) uint8_t hi[3][16];
+  size_t length;
+};
+
+/* Called for each candidate position with the set of buckets that fired.
+ * Returns true to stop the scan at pos. */
+using teddy_verify = bool (*)(void* context, size_t pos, unsigned buckets);
+
+/* Returns the first candidate position accepted by verify, or npos.
+ * Only available on x86 hosts with SSSE3 (pshufb). */
+size_t ssse3_teddy_find(const teddy_masks& masks,
+                        const char* s,
+                        size_t n,
+                        teddy_verify verify,
+                        void* context);
+
+}  // namespace search
@@ -32,17 +32,201 @@
 
 #include <atomic>  // std::atomic
 #include <chrono>  // std::chrono
+#include <condition_variable>  // std::condition_variable
 #include <cstdint>  // std::int_fast64_t, std::uint_fast32_t
 #include <functional>  // std::function
 #include <future>  // std::future, std::promise
 #include <iostream>  // std::cout, std::ostream
 #include <memory>  // std::shared_ptr, std::unique_ptr
-#include <mutex>  // std::mutex, std::scoped_lock
+#include <mutex>  // std::mutex, std::scoped_lock, std::unique_lock
 #include <queue>  // std::queue
+#include <vector>  // std::vector
+#if defined(__linux__)
+#  include <pthread.h>  // pthread_setaffinity_np
+#  include <sched.h>  // CPU_SET, sched_getaffinity
+#  include <sys/resource.h>  // getrusage
+#endif
 #include <thread>  // std::this_thread, std::thread
 #include <type_traits>  // std::common_type_t, std::decay_t, std::enable_if_t, std::is_void_v, std::invoke_result_t
 #include <utility>  // std::move
 
+// =============================================================================================
+// //
+//                                    Begin class work_deque //
+
+/**
+ * @brief A lock-free work-stealing deque of task pointers, after Chase and Lev,
+ * "Dynamic Circular Work-Stealing Deque" (SPAA 2005), with the memory orderings
+ * of Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * (PPoPP 2013). Its owner thread pushes and pops at the bottom, in LIFO order,
+ * and any other thread may steal from the top, in FIFO order.
+ *
+ * @tparam T The type of the elements, which are stored as pointers.
+ */
+template<typename T>
+class work_deque
+{
+  typedef std::int_fast64_t i64;
+
+public:
+  work_deque()
+      : array(new ring(initial_capacity))
+  {
+  }
+
+  ~work_deque()
+  {
+    delete array.load(std::memory_order_relaxed);
+  }
+
+  work_deque(const work_deque&) = delete;
+  work_deque& operator=(const work_deque&) = delete;
+
+  /**
+   * @brief Push an element at the bottom. Only the owner may call this.
+   *
+   * @param element The element to push.
+   */
+  void push(T* element)
+  {
+    const i64 b = bottom.load(std::memory_order_relaxed);
+    const i64 t = top.load(std::memory_order_acquire);
+    ring* a = array.load(std::memory_order_relaxed);
+    if (b - t > a->mask) {
+      a = grow(a, t, b);
+    }
+    a->put(b, element);
+    bottom.store(b + 1, std::memory_order_release);
+  }
+
+  /**
+   * @brief Pop the element at the bottom. Only the owner may call this.
+   *
+   * @return The element, or nullptr if the deque is empty.
+   */
+  T* pop()
+  {
+    const i64 b = bottom.load(std::memory_order_relaxed) - 1;
+    ring* a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T* element = a->get(b);
+    if (t == b) {
+      // The last element, which a thief may be taking at the same time
+      if (!top.compare_exchange_strong(
+              t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        element = nullptr;
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return element;
+  }
+
+  /**
+   * @brief Steal the element at the top. Any thread may call this.
+   *
+   * @return The element, or nullptr if the deque is empty or another thread
+   * took the element first.
+   */
+  T* steal()
+  {
+    i64 t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const i64 b = bottom.load(std::memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+    T* element = array.load(std::memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(
+            t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+      return nullptr;
+    return element;
+  }
+
+private:
+  static constexpr i64 initial_capacity = 256;
+
+  /**
+   * @brief A circular array with a power of two capacity. Arrays that were
+   * outgrown are kept until the deque is destroyed, since a thief may still be
+   * reading from one.
+   */
+  struct ring
+  {
+    explicit ring(i64 capacity)
+        : mask(capacity - 1)
+        , slots(new std::atomic<T*>[capacity])
+    {
+    }
+
+    T* get(i64 index) const
+    {
+      return slots[index & mask].load(std::memory_order_relaxed);
+    }
+
+    void put(i64 index, T* element)
+    {
+      slots[index & mask].store(element, std::memory_order_relaxed);
+    }
+
+    const i64 mask;
+    std::unique_ptr<std::atomic<T*>[]> slots;
+    std::unique_ptr<ring> previous;
+  };
+
+  ring* grow(ring* a, i64 t, i64 b)
+  {
+    ring* bigger = new ring((a->mask + 1) * 2);
+    for (i64 i = t; i < b; i++) {
+      bigger->put(i, a->get(i));
+    }
+    bigger->previous.reset(a);
+    array.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  alignas(64) std::atomic<i64> top = 0;
+  alignas(64) std::atomic<i64> bottom = 0;
+  std::atomic<ring*> array;
+};
+
+//                                     End class work_deque //
+// =============================================================================================
+// //
+
+// =============================================================================================
+// //
+//                                    Begin struct pool_task //
+
+/**
+ * @brief A task as the threads see it: a plain function pointer and its
+ * argument, with no type erasure. The storage belongs to whoever pushed the
+ * task, and must stay valid until function returns or discard is called;
+ * either of them may free it.
+ */
+struct pool_task
+{
+  /**
+   * @brief Executes the task; called exactly once, unless the task is
+   * discarded.
+   */
+  void (*function)(void* argument) = nullptr;
+  void* argument = nullptr;
+
+  /**
+   * @brief Called instead of function for a task that will never be executed,
+   * because the pool was destroyed while paused. May be nullptr.
+   */
+  void (*discard)(void* argument) = nullptr;
+};
+
+//                                     End struct pool_task //
+// =============================================================================================
+// //
+
 // =============================================================================================
 // //
 //                                    Begin class thread_pool //
@@ -53,11 +237,17 @@
  * and executes it. Each task is automatically assigned a future, which can be
  * used to wait for the task to finish executing and/or obtain its eventual
  * return value.
+ * @details Each thread has its own work_deque. Tasks pushed by a task running
+ * in the pool go to the deque of its thread, which pops its newest task first;
+ * tasks pushed from outside the pool go to a shared injector queue. A thread
+ * whose deque is empty takes from the injector queue, then steals the oldest
+ * task of another thread, starting from a random one.
  */
 class thread_pool
 {
   typedef std::uint_fast32_t ui32;
   typedef std::uint_fast64_t ui64;
+  typedef std::int_fast64_t i64;
 
 public:
   // ============================
@@ -75,9 +265,9 @@ public:
   thread_pool(const ui32& _thread_count = std::thread::hardware_concurrency())
       : thread_count(_thread_count ? _thread_count
                                    : std::thread::hardware_concurrency())
-      , threads(new std::thread[_thread_count
-                                    ? _thread_count
-                                    : std::thread::hardware_concurrency()])
+      , threads(new std::thread[thread_count])
+      , deques(new work_deque<pool_task>[thread_count])
+      , active_threads(thread_count)
   {
     create_threads();
   }
@@ -92,6 +282,10 @@ public:
     wait_for_tasks();
     running = false;
     destroy_threads();
+    for (pool_task* task : take_queued_tasks()) {
+      if (task->discard)
+        task->discard(task->argument);
+    }
   }
 
   // =======================
@@ -106,8 +300,7 @@ public:
    */
   ui64 get_tasks_queued() const
   {
-    const std::scoped_lock lock(queue_mutex);
-    return tasks.size();
+    return tasks_queued;
   }
 
   /**
@@ -141,6 +334,70 @@ public:
     return thread_count;
   }
 
+  /**
+   * @brief Get the number of threads that currently execute tasks. This is the
+   * number of threads in the pool, unless adapt_active_threads() was called.
+   *
+   * @return The number of active threads.
+   */
+  ui32 get_active_threads() const
+  {
+    return active_threads;
+  }
+
+  /**
+   * @brief Pin each thread to one CPU, going round the CPUs the process may
+   * run on in order, so that a thread keeps its caches and, on a NUMA machine,
+   * the memory it first touched stays local to it. Threads created by reset()
+   * are pinned as well. Does nothing on platforms other than Linux.
+   */
+  void pin_threads()
+  {
+    pinned = true;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+      return;
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    }
+    if (cpus.empty())
+      return;
+    for (ui32 i = 0; i < thread_count; i++) {
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpus[i % cpus.size()], &one);
+      pthread_setaffinity_np(threads[i].native_handle(), sizeof(one), &one);
+    }
+#endif
+  }
+
+  /**
+   * @brief Let the pool choose how many of its threads execute tasks, starting
+   * from min_active. Each thread measures the wall time, CPU time and context
+   * switches of the tasks it executes. When tasks spend much of their time off
+   * the CPU and mostly block rather than being preempted, as when reading from
+   * a cold disk or a network file system, more threads are activated, up to
+   * get_thread_count(), so that more reads are in flight. When they are mostly
+   * preempted, there are more active threads than CPUs to run them, and threads
+   * are deactivated again, down to min_active. Inactive threads sleep. The
+   * measurements need Linux; elsewhere min_active threads stay active.
+   *
+   * @param min_active The number of threads that are always active; typically
+   * the number of CPUs. Clamped to between 1 and get_thread_count().
+   */
+  void adapt_active_threads(ui32 min_active)
+  {
+    min_active_threads =
+        min_active == 0 ? 1 : (min_active < thread_count ? min_active
+                                                         : thread_count);
+    set_active_threads(min_active_threads);
+    window_start_ns = sample().wall_ns;
+    adaptive = true;
+  }
+
   /**
    * @brief Parallelize a loop by splitting it into blocks, submitting each
    * block separately to the thread pool, and waiting for all blocks to finish
@@ -192,6 +449,8 @@ public:
       num_blocks = (ui32)total_size > 1 ? (ui32)total_size : 1;
     }
     std::atomic<ui32> blocks_running = 0;
+    std::mutex loop_mutex;
+    std::condition_variable loop_done;
     for (ui32 t = 0; t < num_blocks; t++) {
       T start = ((T)(t * block_size) + the_first_index);
       T end = (t == num_blocks - 1)
@@ -199,31 +458,56 @@ public:
           : ((T)((t + 1) * block_size) + the_first_index);
       blocks_running++;
       push_task(
-          [start, end, &loop, &blocks_running]
+          [start, end, &loop, &blocks_running, &loop_mutex, &loop_done]
           {
             loop(start, end);
-            blocks_running--;
+            if (--blocks_running == 0) {
+              const std::scoped_lock lock(loop_mutex);
+              loop_done.notify_one();
+            }
           });
     }
-    while (blocks_running != 0) {
-      sleep_or_yield();
-    }
+    std::unique_lock lock(loop_mutex);
+    loop_done.wait(lock, [&blocks_running] { return blocks_running == 0; });
   }
 
   /**
    * @brief Push a function with no arguments or return value into the task
-   * queue.
+   * queue, and wake up an idle thread to execute it.
    *
    * @tparam F The type of the function.
    * @param task The function to push.
    */
   template<typename F>
   void push_task(const F& task)
+  {
+    callable_task<F>* pushed = new callable_task<F>(task);
+    push_task(pushed->header);
+  }
+
+  /**
+   * @brief Push a task whose storage is managed by the caller into the task
+   * queue, and wake up an idle thread to execute it. The pool allocates
+   * nothing for such a task.
+   *
+   * @param task The task to push. Must stay valid until its function is
+   * called.
+   */
+  void push_task(pool_task& task)
   {
     tasks_total++;
-    {
-      const std::scoped_lock lock(queue_mutex);
-      tasks.push(std::function<void()>(task));
+    if (current_pool == this) {
+      deques[current_index].push(&task);
+    } else {
+      const std::scoped_lock lock(injector_mutex);
+      injector.push(&task);
+      injector_size++;
+    }
+    tasks_queued++;
+    // Pairs with the increment of idle_threads in wait_for_work()
+    if (idle_threads != 0) {
+      const std::scoped_lock lock(signal_mutex);
+      task_available.notify_one();
     }
   }
 
@@ -267,12 +551,30 @@ public:
     wait_for_tasks();
     running = false;
     destroy_threads();
+    {
+      const std::scoped_lock lock(injector_mutex);
+      for (pool_task* task : take_queued_tasks()) {
+        injector.push(task);
+      }
+      injector_size = injector.size();
+      tasks_queued = injector.size();
+    }
     thread_count =
         _thread_count ? _thread_count : std::thread::hardware_concurrency();
     threads.reset(new std::thread[thread_count]);
+    deques.reset(new work_deque<pool_task>[thread_count]);
+    if (adaptive) {
+      if (min_active_threads > thread_count)
+        min_active_threads = thread_count;
+      active_threads = min_active_threads;
+    } else {
+      active_threads = thread_count;
+    }
     paused = was_paused;
     running = true;
     create_threads();
+    if (pinned)
+      pin_threads();
   }
 
   /**
@@ -358,16 +660,13 @@ public:
    */
   void wait_for_tasks()
   {
-    while (true) {
-      if (!paused) {
-        if (tasks_total == 0)
-          break;
-      } else {
-        if (get_tasks_running() == 0)
-          break;
-      }
-      sleep_or_yield();
-    }
+    std::unique_lock lock(signal_mutex);
+    task_done.wait(lock,
+                   [this]
+                   {
+                     return paused ? tasks_total == tasks_queued
+                                   : tasks_total == 0;
+                   });
   }
 
   // ===========
@@ -383,10 +682,11 @@ public:
   std::atomic<bool> paused = false;
 
   /**
-   * @brief The duration, in microseconds, that the worker function should sleep
-   * for when it cannot find any tasks in the queue. If set to 0, then instead
-   * of sleeping, the worker function will execute std::this_thread::yield() if
-   * there are no tasks in the queue. The default value is 1000.
+   * @brief The duration, in microseconds, that an idle worker sleeps for
+   * between checks of the variable paused while the pool is paused. Setting
+   * paused does not wake the threads up, so this bounds how long it takes for
+   * them to notice it was cleared. If the pool is not paused, workers block
+   * until a task is pushed and never poll. The default value is 1000.
    */
   ui32 sleep_duration = 1000;
 
@@ -395,13 +695,46 @@ private:
   // Private member functions
   // ========================
 
+  /**
+   * @brief A function object pushed with push_task(), allocated along with the
+   * pool_task that executes it and frees both.
+   *
+   * @tparam F The type of the function.
+   */
+  template<typename F>
+  struct callable_task
+  {
+    explicit callable_task(const F& _function)
+        : function(_function)
+    {
+      header.function = &run;
+      header.argument = this;
+      header.discard = &destroy;
+    }
+
+    static void run(void* argument)
+    {
+      std::unique_ptr<callable_task> task(
+          static_cast<callable_task*>(argument));
+      task->function();
+    }
+
+    static void destroy(void* argument)
+    {
+      delete static_cast<callable_task*>(argument);
+    }
+
+    pool_task header;
+    F function;
+  };
+
   /**
    * @brief Create the threads in the pool and assign a worker to each thread.
    */
   void create_threads()
   {
     for (ui32 i = 0; i < thread_count; i++) {
-      threads[i] = std::thread(&thread_pool::worker, this);
+      threads[i] = std::thread(&thread_pool::worker, this, i);
     }
   }
 
@@ -410,59 +743,241 @@ private:
    */
   void destroy_threads()
   {
+    {
+      // Workers check running under the lock, so none misses the wakeup
+      const std::scoped_lock lock(signal_mutex);
+    }
+    task_available.notify_all();
+    resumed.notify_all();
     for (ui32 i = 0; i < thread_count; i++) {
       threads[i].join();
     }
   }
 
   /**
-   * @brief Try to pop a new task out of the queue.
+   * @brief Take every task out of the deques and the injector queue. Only
+   * called while there are no threads.
    *
-   * @param task A reference to the task. Will be populated with a function if
-   * the queue is not empty.
-   * @return true if a task was found, false if the queue is empty.
+   * @return The tasks.
+   */
+  std::vector<pool_task*> take_queued_tasks()
+  {
+    std::vector<pool_task*> taken;
+    for (ui32 i = 0; i < thread_count; i++) {
+      while (pool_task* task = deques[i].steal()) {
+        taken.push_back(task);
+      }
+    }
+    while (!injector.empty()) {
+      taken.push_back(injector.front());
+      injector.pop();
+    }
+    injector_size = 0;
+    tasks_queued = 0;
+    return taken;
+  }
+
+  /**
+   * @brief Try to take a task: from the thread's own deque, then from the
+   * injector queue, then from the deque of another thread.
+   *
+   * @param index The index of the thread.
+   * @param seed The state of the thread's random number generator, used to
+   * pick the first thread to steal from.
+   * @return The task, or nullptr if none was found.
+   */
+  pool_task* find_task(ui32 index, ui32& seed)
+  {
+    if (pool_task* task = deques[index].pop())
+      return task;
+    if (injector_size != 0) {
+      const std::scoped_lock lock(injector_mutex);
+      if (!injector.empty()) {
+        pool_task* task = injector.front();
+        injector.pop();
+        injector_size--;
+        return task;
+      }
+    }
+    // xorshift32
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    const ui32 first = seed % thread_count;
+    for (ui32 i = 0; i < thread_count; i++) {
+      const ui32 victim = (first + i) % thread_count;
+      if (victim == index)
+        continue;
+      if (pool_task* task = deques[victim].steal())
+        return task;
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief Block until a task may have been queued, the thread is deactivated,
+   * or the pool is shutting down. While the pool is paused, wakes up every sleep_duration microseconds
+   * to check whether it still is, and lets wait_for_tasks() know that nothing
+   * more will start.
+   */
+  void wait_for_work(ui32 index)
+  {
+    std::unique_lock lock(signal_mutex);
+    // Pairs with the check of idle_threads in push_task(): either it sees this
+    // thread as idle, or this thread sees its task as queued
+    idle_threads++;
+    while (running && (paused || tasks_queued == 0)
+           && index < active_threads)
+    {
+      if (paused) {
+        task_done.notify_all();
+        task_available.wait_for(lock,
+                                std::chrono::microseconds(sleep_duration));
+      } else {
+        task_available.wait(lock);
+      }
+    }
+    idle_threads--;
+  }
+
+  /**
+   * @brief Set the number of active threads, and wake up the threads that
+   * were activated.
+   *
+   * @param count The number of active threads.
+   */
+  void set_active_threads(ui32 count)
+  {
+    {
+      const std::scoped_lock lock(signal_mutex);
+      active_threads = count;
+    }
+    resumed.notify_all();
+    // Deactivated threads that are idle go back to sleep as inactive
+    task_available.notify_all();
+  }
+
+  /**
+   * @brief The clocks and counters of the calling thread that
+   * adapt_active_threads() is based on.
    */
-  bool pop_task(std::function<void()>& task)
+  struct task_sample
+  {
+    i64 wall_ns = 0;
+    i64 cpu_ns = 0;
+    i64 blocked = 0;
+    i64 preempted = 0;
+  };
+
+  static task_sample sample()
   {
-    const std::scoped_lock lock(queue_mutex);
-    if (tasks.empty())
-      return false;
-    else {
-      task = std::move(tasks.front());
-      tasks.pop();
-      return true;
+    task_sample result;
+    result.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now().time_since_epoch())
+                         .count();
+#if defined(__linux__)
+    rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+      result.cpu_ns =
+          (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL
+          + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+      result.blocked = usage.ru_nvcsw;
+      result.preempted = usage.ru_nivcsw;
     }
+#endif
+    return result;
   }
 
   /**
-   * @brief Sleep for sleep_duration microseconds. If that variable is set to
-   * zero, yield instead.
+   * @brief Add the measurements of one task to the current window and, once
+   * the window is adapt_interval_ns long, change the number of active threads
+   * from what it holds. See adapt_active_threads().
    *
+   * @param before The sample taken before the task.
+   * @param after The sample taken after it.
    */
-  void sleep_or_yield()
+  void adapt(const task_sample& before, const task_sample& after)
   {
-    if (sleep_duration)
-      std::this_thread::sleep_for(std::chrono::microseconds(sleep_duration));
-    else
-      std::this_thread::yield();
+#if defined(__linux__)
+    window_wall_ns += after.wall_ns - before.wall_ns;
+    window_cpu_ns += after.cpu_ns - before.cpu_ns;
+    window_blocked += after.blocked - before.blocked;
+    window_preempted += after.preempted - before.preempted;
+
+    i64 start = window_start_ns;
+    if (after.wall_ns - start < adapt_interval_ns
+        || !window_start_ns.compare_exchange_strong(start, after.wall_ns))
+      return;
+    const i64 wall = window_wall_ns.exchange(0);
+    const i64 cpu = window_cpu_ns.exchange(0);
+    const i64 blocked = window_blocked.exchange(0);
+    const i64 preempted = window_preempted.exchange(0);
+    if (wall <= 0)
+      return;
+
+    const ui32 active = active_threads;
+    const bool off_cpu = (wall - cpu) * 4 > wall;
+    if (off_cpu && blocked > preempted && active < thread_count) {
+      const ui32 step = active / 4 ? active / 4 : 1;
+      set_active_threads(active + step < thread_count ? active + step
+                                                      : thread_count);
+    } else if (preempted > blocked && active > min_active_threads) {
+      set_active_threads(active - 1);
+    }
+#else
+    (void)before;
+    (void)after;
+#endif
   }
 
   /**
    * @brief A worker function to be assigned to each thread in the pool.
-   * Continuously pops tasks out of the queue and executes them, as long as the
-   * atomic variable running is set to true.
+   * Takes tasks and executes them, sleeping while there are none, until the
+   * atomic variable running is set to false. Wakes up wait_for_tasks() when
+   * the last task finishes, or when a task finishes while the pool is paused.
+   *
+   * @param index The index of the thread, and of its deque.
    */
-  void worker()
+  void worker(ui32 index)
   {
-    while (running) {
-      std::function<void()> task;
-      if (!paused && pop_task(task)) {
-        task();
-        tasks_total--;
+    current_pool = this;
+    current_index = index;
+    ui32 seed = index * 2654435761u + 1;
+    while (true) {
+      if (index >= active_threads) {
+        // Tasks left in the deque of an inactive thread are stolen
+        std::unique_lock lock(signal_mutex);
+        resumed.wait(lock,
+                     [this, index]
+                     { return !running || index < active_threads; });
+      }
+      pool_task* task = paused ? nullptr : find_task(index, seed);
+      if (task == nullptr) {
+        if (!running)
+          break;
+        if (!paused && tasks_queued != 0) {
+          // Queued, but lost to another thread or not yet visible
+          std::this_thread::yield();
+        } else {
+          wait_for_work(index);
+        }
+        continue;
+      }
+      tasks_queued--;
+      if (adaptive) {
+        const task_sample before = sample();
+        task->function(task->argument);
+        adapt(before, sample());
       } else {
-        sleep_or_yield();
+        task->function(task->argument);
+      }
+      if (--tasks_total == 0 || paused) {
+        // Taking the lock orders the decrement before the waiter's check
+        const std::scoped_lock lock(signal_mutex);
+        task_done.notify_all();
       }
     }
+    current_pool = nullptr;
   }
 
   // ============
@@ -470,10 +985,11 @@ private:
   // ============
 
   /**
-   * @brief A mutex to synchronize access to the task queue by different
-   * threads.
+   * @brief The pool whose worker the current thread is, if any, and the index
+   * of the thread in it. Tasks pushed by a worker go to its own deque.
    */
-  mutable std::mutex queue_mutex = {};
+  static inline thread_local const thread_pool* current_pool = nullptr;
+  static inline thread_local ui32 current_index = 0;
 
   /**
    * @brief An atomic variable indicating to the workers to keep running. When
@@ -481,11 +997,6 @@ private:
    */
   std::atomic<bool> running = true;
 
-  /**
-   * @brief A queue of tasks to be executed by the threads.
-   */
-  std::queue<std::function<void()>> tasks = {};
-
   /**
    * @brief The number of threads in the pool.
    */
@@ -496,6 +1007,82 @@ private:
    */
   std::unique_ptr<std::thread[]> threads;
 
+  /**
+   * @brief The deques of the threads, one per thread.
+   */
+  std::unique_ptr<work_deque<pool_task>[]> deques;
+
+  /**
+   * @brief A queue of tasks pushed from outside the pool, guarded by
+   * injector_mutex, and its size, to skip the lock when it is empty.
+   */
+  std::queue<pool_task*> injector = {};
+  std::mutex injector_mutex = {};
+  std::atomic<ui64> injector_size = 0;
+
+  /**
+   * @brief A mutex for the condition variables below, so that no wakeup is
+   * lost between checking for work and going to sleep.
+   */
+  std::mutex signal_mutex = {};
+
+  /**
+   * @brief A condition variable to wake up idle threads when a task is
+   * pushed or the pool shuts down.
+   */
+  std::condition_variable task_available = {};
+
+  /**
+   * @brief A condition variable to wake up wait_for_tasks() when tasks
+   * finish.
+   */
+  std::condition_variable task_done = {};
+
+  /**
+   * @brief A condition variable to wake up threads that were activated.
+   */
+  std::condition_variable resumed = {};
+
+  /**
+   * @brief The number of threads that execute tasks: those with an index
+   * below it. The others sleep.
+   */
+  std::atomic<ui32> active_threads;
+
+  /**
+   * @brief Whether adapt_active_threads() was called, and the number of
+   * threads it keeps active at least.
+   */
+  std::atomic<bool> adaptive = false;
+  ui32 min_active_threads = 1;
+
+  /**
+   * @brief Whether pin_threads() was called.
+   */
+  bool pinned = false;
+
+  /**
+   * @brief The length of a measurement window of adapt(), and the sums of the
+   * measurements of the tasks that finished in the current one.
+   */
+  static constexpr i64 adapt_interval_ns = 20000000;
+  std::atomic<i64> window_start_ns = 0;
+  std::atomic<i64> window_wall_ns = 0;
+  std::atomic<i64> window_cpu_ns = 0;
+  std::atomic<i64> window_blocked = 0;
+  std::atomic<i64> window_preempted = 0;
+
+  /**
+   * @brief The number of threads sleeping in wait_for_work().
+   */
+  std::atomic<ui32> idle_threads = 0;
+
+  /**
+   * @brief An atomic variable to keep track of the number of tasks waiting in
+   * a deque or in the injector queue.
+   */
+  std::atomic<ui64> tasks_queued = 0;
+
   /**
    * @brief An atomic variable to keep track of the total number of unfinished
    * tasks - either still in the queue, or running in a thread.
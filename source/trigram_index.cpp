@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <bitset>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <searcher.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <trigram_index.hpp>
+#include <unistd.h>
+
+namespace search
+{
+/* On-disk layout, in host byte order:
+ *
+ *   header
+ *   file_entry[file_count]
+ *   trigram_entry[trigram_count], sorted by trigram
+ *   uint32_t postings[posting_count], padded to 8 bytes
+ *   path bytes
+ */
+struct trigram_index::header
+{
+  char magic[8];
+  uint32_t file_count;
+  uint32_t trigram_count;
+  uint64_t posting_count;
+  uint64_t paths_size;
+  uint64_t reserved[4];
+};
+
+struct trigram_index::file_entry
+{
+  uint64_t size;
+  int64_t mtime;
+  uint64_t path_offset;
+  uint32_t path_length;
+  uint32_t reserved;
+};
+
+struct trigram_index::trigram_entry
+{
+  uint32_t trigram;
+  uint32_t count;
+  uint64_t offset;
+};
+
+namespace
+{
+constexpr char index_magic[8] = {'O', 'Y', 'S', 'T', 'R', 'I', 'X', '1'};
+
+constexpr uint32_t no_file = std::numeric_limits<uint32_t>::max();
+
+unsigned char fold(unsigned char c)
+{
+  return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+uint32_t make_trigram(unsigned char a, unsigned char b, unsigned char c)
+{
+  return (uint32_t {a} << 16) | (uint32_t {b} << 8) | c;
+}
+
+/* Collects the distinct trigrams of a text fed in pieces */
+class trigram_collector
+{
+public:
+  void add(const char* data, std::size_t size)
+  {
+    for (std::size_t i = 0; i < size; ++i) {
+      m_window = ((m_window << 8) | fold(data[i])) & 0xffffff;
+      if (++m_length >= 3 && !m_seen.test(m_window)) {
+        m_seen.set(m_window);
+        m_trigrams.push_back(m_window);
+      }
+    }
+  }
+
+  /* The trigrams added since the last call, after which the collector is
+   * ready for the next text */
+  std::vector<uint32_t> take()
+  {
+    for (const auto trigram : m_trigrams) {
+      m_seen.reset(trigram);
+    }
+    m_window = 0;
+    m_length = 0;
+    return std::move(m_trigrams);
+  }
+
+private:
+  std::bitset<1 << 24> m_seen;
+  std::vector<uint32_t> m_trigrams;
+  uint32_t m_window = 0;
+  std::size_t m_length = 0;
+};
+
+std::vector<uint32_t> read_trigrams(const char* path)
+{
+  // 2 MiB of bits each; kept per thread so a build allocates them once
+  thread_local auto collector = std::make_unique<trigram_collector>();
+  thread_local std::vector<char> buffer(1 << 20);
+
+  const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return {};
+  }
+  while (true) {
+    const auto result = ::read(fd, buffer.data(), buffer.size());
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    collector->add(buffer.data(), static_cast<std::size_t>(result));
+  }
+  ::close(fd);
+
+  return collector->take();
+}
+
+template<typename T>
+void write_all(std::FILE* file, const T* data, std::size_t count)
+{
+  if (count > 0 && std::fwrite(data, sizeof(T), count, file) != count) {
+    throw std::runtime_error(std::strerror(errno));
+  }
+}
+
+}  // namespace
+
+bool read_file_stamp(const char* path, file_stamp& stamp)
+{
+  struct stat info;
+  if (::stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+
+#if defined(__APPLE__)
+  const auto& mtime = info.st_mtimespec;
+#else
+  const auto& mtime = info.st_mtim;
+#endif
+  stamp.size = static_cast<uint64_t>(info.st_size);
+  stamp.mtime =
+      static_cast<int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+  return true;
+}
+
+trigram_index::trigram_index(const std::string& path)
+{
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open index '" + path
+                             + "': " + std::strerror(errno));
+  }
+
+  struct stat info;
+  if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+    m_size = static_cast<std::size_t>(info.st_size);
+    void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    m_data = data == MAP_FAILED ? nullptr : static_cast<const char*>(data);
+  }
+  ::close(fd);
+
+  const auto invalid = [&]()
+  { return std::runtime_error("'" + path + "' is not a valid index"); };
+
+  if (m_data == nullptr || m_size < sizeof(header)) {
+    unmap();
+    throw invalid();
+  }
+
+  // Check every offset once here, so that lookups need not
+  m_header = reinterpret_cast<const header*>(m_data);
+  const auto files_size = uint64_t {m_header->file_count} * sizeof(file_entry);
+  const auto trigrams_size =
+      uint64_t {m_header->trigram_count} * sizeof(trigram_entry);
+  const auto postings_size = (m_header->posting_count * 4 + 7) & ~uint64_t {7};
+  const auto total = sizeof(header) + files_size + trigrams_size
+      + postings_size + m_header->paths_size;
+  bool valid = std::memcmp(m_header->magic, index_magic, sizeof(index_magic))
+          == 0
+      && m_header->posting_count <= m_size && m_header->paths_size <= m_size
+      && total == m_size;
+
+  if (valid) {
+    m_files = reinterpret_cast<const file_entry*>(m_data + sizeof(header));
+    m_trigrams = reinterpret_cast<const trigram_entry*>(
+        reinterpret_cast<const char*>(m_files) + files_size);
+    m_postings = reinterpret_cast<const uint32_t*>(
+        reinterpret_cast<const char*>(m_trigrams) + trigrams_size);
+    m_paths = reinterpret_cast<const char*>(m_postings) + postings_size;
+
+    for (uint32_t i = 0; valid && i < m_header->trigram_count; ++i) {
+      const auto& entry = m_trigrams[i];
+      valid = entry.offset <= m_header->posting_count
+          && entry.count <= m_header->posting_count - entry.offset
+          && (i == 0 || m_trigrams[i - 1].trigram < entry.trigram);
+    }
+    for (uint32_t i = 0; valid && i < m_header->file_count; ++i) {
+      const auto& file = m_files[i];
+      valid = file.path_offset <= m_header->paths_size
+          && file.path_length <= m_header->paths_size - file.path_offset;
+      if (valid) {
+        m_ids.emplace(path_of(file), i);
+      }
+    }
+  }
+
+  if (!valid) {
+    unmap();
+    throw invalid();
+  }
+}
+
+trigram_index::~trigram_index()
+{
+  unmap();
+}
+
+void trigram_index::unmap()
+{
+  if (m_data != nullptr) {
+    ::munmap(const_cast<char*>(m_data), m_size);
+    m_data = nullptr;
+  }
+}
+
+std::string_view trigram_index::path_of(const file_entry& file) const
+{
+  return {m_paths + file.path_offset, file.path_length};
+}
+
+const trigram_index::trigram_entry* trigram_index::find_trigram(
+    uint32_t trigram) const
+{
+  const auto* end = m_trigrams + m_header->trigram_count;
+  const auto* found = std::lower_bound(
+      m_trigrams,
+      end,
+      trigram,
+      [](const trigram_entry& entry, uint32_t value)
+      { return entry.trigram < value; });
+  return found != end && found->trigram == trigram ? found : nullptr;
+}
+
+std::size_t trigram_index::size() const
+{
+  return m_header->file_count;
+}
+
+long trigram_index::find(std::string_view path) const
+{
+  const auto found = m_ids.find(path);
+  return found == m_ids.end() ? -1 : static_cast<long>(found->second);
+}
+
+bool trigram_index::is_current(uint32_t id, const file_stamp& stamp) const
+{
+  return m_files[id].size == stamp.size && m_files[id].mtime == stamp.mtime;
+}
+
+std::optional<std::vector<uint32_t>> trigram_index::candidates(
+    std::string_view literal) const
+{
+  if (literal.size() < 3) {
+    return std::nullopt;
+  }
+
+  std::vector<const trigram_entry*> lists;
+  for (std::size_t i = 0; i + 3 <= literal.size(); ++i) {
+    const auto* entry = find_trigram(make_trigram(
+        fold(literal[i]), fold(literal[i + 1]), fold(literal[i + 2])));
+    if (entry == nullptr) {
+      return std::vector<uint32_t> {};
+    }
+    lists.push_back(entry);
+  }
+
+  // Intersect from the shortest list, so the result only ever shrinks
+  std::sort(lists.begin(),
+            lists.end(),
+            [](const trigram_entry* a, const trigram_entry* b)
+            {
+              return a->count < b->count || (a->count == b->count && a < b);
+            });
+  lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+
+  const auto* first = m_postings + lists[0]->offset;
+  std::vector<uint32_t> result(first, first + lists[0]->count);
+  for (std::size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+    const auto* begin = m_postings + lists[i]->offset;
+    const auto* end = begin + lists[i]->count;
+    auto out = result.begin();
+    for (const auto id : result) {
+      begin = std::lower_bound(begin, end, id);
+      if (begin == end) {
+        break;
+      }
+      if (*begin == id) {
+        *out++ = id;
+      }
+    }
+    result.erase(out, result.end());
+  }
+  return result;
+}
+
+index_stats trigram_index::build(const std::string& root)
+{
+  auto index_path = root;
+  if (index_path.empty() || index_path.back() != '/') {
+    index_path += '/';
+  }
+  index_path += file_name;
+
+  std::unique_ptr<trigram_index> previous;
+  try {
+    previous = std::make_unique<trigram_index>(index_path);
+  } catch (const std::runtime_error&) {
+    // No usable index yet, so every file is read
+  }
+
+  struct indexed_file
+  {
+    std::string path;
+    file_stamp stamp;
+  };
+  std::vector<indexed_file> files;
+  std::vector<uint32_t> reused(previous ? previous->size() : 0, no_file);
+  std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+  std::mutex mutex;
+  index_stats stats;
+
+  const searcher::file_visitor visit =
+      [&](std::string_view path, std::size_t root_length)
+  {
+    const auto relative = path.substr(root_length);
+    file_stamp stamp;
+    if (relative == file_name || !read_file_stamp(path.data(), stamp)) {
+      return;
+    }
+
+    const long old_id = previous ? previous->find(relative) : -1;
+    if (old_id >= 0 && previous->is_current(old_id, stamp)) {
+      std::lock_guard<std::mutex> lock(mutex);
+      reused[old_id] = static_cast<uint32_t>(files.size());
+      files.push_back({std::string(relative), stamp});
+      return;
+    }
+
+    const auto trigrams = read_trigrams(path.data());
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto id = static_cast<uint32_t>(files.size());
+    files.push_back({std::string(relative), stamp});
+    for (const auto trigram : trigrams) {
+      postings[trigram].push_back(id);
+    }
+    ++stats.read;
+  };
+  searcher::walk_files(root.c_str(), visit);
+
+  // Carry over the postings of the files that did not change
+  if (previous) {
+    for (uint32_t i = 0; i < previous->m_header->trigram_count; ++i) {
+      const auto& entry = previous->m_trigrams[i];
+      const auto* ids = previous->m_postings + entry.offset;
+      for (uint32_t j = 0; j < entry.count; ++j) {
+        if (ids[j] < reused.size() && reused[ids[j]] != no_file) {
+          postings[entry.trigram].push_back(reused[ids[j]]);
+        }
+      }
+    }
+    previous.reset();
+  }
+
+  // Files were numbered as the walk found them, so lists are out of order
+  std::vector<uint32_t> trigrams;
+  trigrams.reserve(postings.size());
+  for (auto& [trigram, ids] : postings) {
+    std::sort(ids.begin(), ids.end());
+    trigrams.push_back(trigram);
+  }
+  std::sort(trigrams.begin(), trigrams.end());
+
+  header head = {};
+  std::memcpy(head.magic, index_magic, sizeof(index_magic));
+  head.file_count = static_cast<uint32_t>(files.size());
+  head.trigram_count = static_cast<uint32_t>(trigrams.size());
+
+  std::vector<file_entry> file_entries;
+  file_entries.reserve(files.size());
+  for (const auto& file : files) {
+    file_entries.push_back({file.stamp.size,
+                            file.stamp.mtime,
+                            head.paths_size,
+                            static_cast<uint32_t>(file.path.size()),
+                            0});
+    head.paths_size += file.path.size();
+  }
+
+  std::vector<trigram_entry> trigram_entries;
+  trigram_entries.reserve(trigrams.size());
+  for (const auto trigram : trigrams) {
+    const auto count = static_cast<uint32_t>(postings[trigram].size());
+    trigram_entries.push_back({trigram, count, head.posting_count});
+    head.posting_count += count;
+  }
+
+  // Written next to the index and renamed over it, so that a search never
+  // maps a half-written file
+  const auto temporary_path = index_path + ".tmp";
+  std::FILE* out = std::fopen(temporary_path.c_str(), "wb");
+  if (out == nullptr) {
+    throw std::runtime_error("cannot write '" + temporary_path
+                             + "': " + std::strerror(errno));
+  }
+  try {
+    write_all(out, &head, 1);
+    write_all(out, file_entries.data(), file_entries.size());
+    write_all(out, trigram_entries.data(), trigram_entries.size());
+    for (const auto trigram : trigrams) {
+      const auto& ids = postings[trigram];
+      write_all(out, ids.data(), ids.size());
+    }
+    const char padding[8] = {};
+    write_all(out, padding, (head.posting_count & 1) * 4);
+    for (const auto& file : files) {
+      write_all(out, file.path.data(), file.path.size());
+    }
+    if (std::fclose(out) != 0) {
+      out = nullptr;
+      throw std::runtime_error(std::strerror(errno));
+    }
+  } catch (const std::runtime_error& err) {
+    if (out != nullptr) {
+      std::fclose(out);
+    }
+    std::remove(temporary_path.c_str());
+    throw std::runtime_error("cannot write '" + temporary_path
+                             + "': " + err.what());
+  }
+
+  if (std::rename(temporary_path.c_str(), index_path.c_str()) != 0) {
+    const std::string error = std::strerror(errno);
+    std::remove(temporary_path.c_str());
+    throw std::runtime_error("cannot write '" + index_path + "': " + error);
+  }
+
+  stats.files = files.size();
+  stats.trigrams = trigrams.size();
+  return stats;
+}
+
+}  // namespace search
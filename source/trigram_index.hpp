@@ -0,0 +1,102 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace search
+{
+/* Size and modification time of a file; a file whose stamp is unchanged
+ * is assumed to have unchanged contents */
+struct file_stamp
+{
+  uint64_t size = 0;
+  int64_t mtime = 0;  // nanoseconds
+
+  bool operator==(const file_stamp& other) const
+  {
+    return size == other.size && mtime == other.mtime;
+  }
+};
+
+/* Stamp of the file at path; false if it cannot be stat'ed or is not a
+ * regular file */
+bool read_file_stamp(const char* path, file_stamp& stamp);
+
+struct index_stats
+{
+  std::size_t files = 0;
+  // Files that were read, because they were new or changed
+  std::size_t read = 0;
+  std::size_t trigrams = 0;
+};
+
+/* A trigram index of the files below a directory, stored in a single file
+ * at its root and used through a read-only mapping.
+ *
+ * For every trigram (three bytes, ASCII letters lowercased) that occurs in
+ * some file, the index holds the sorted ids of the files containing it. A
+ * literal can only occur in files that contain all of its trigrams, so
+ * intersecting their posting lists gives a small candidate set that the
+ * searcher then verifies. Each file is indexed with its stamp, so a
+ * rebuild only reads the files that changed and a query can tell which
+ * indexed entries are stale. */
+class trigram_index
+{
+public:
+  // Name of the index file in the indexed directory
+  static constexpr std::string_view file_name = ".oystr-index";
+
+  /* Maps the index file at path; throws std::runtime_error when it is
+   * missing or not a valid index */
+  explicit trigram_index(const std::string& path);
+  ~trigram_index();
+
+  trigram_index(const trigram_index&) = delete;
+  trigram_index& operator=(const trigram_index&) = delete;
+
+  /* Indexes the files that a directory search of root would search,
+   * reusing the entries of root's existing index for files whose stamp
+   * has not changed, and replaces the index file. Runs on searcher::m_ts.
+   * Throws std::runtime_error when the index cannot be written. */
+  static index_stats build(const std::string& root);
+
+  /* Number of files in the index */
+  std::size_t size() const;
+
+  /* Id of the file at path, relative to the indexed directory, or -1 */
+  long find(std::string_view path) const;
+
+  /* Whether file id was indexed with this stamp */
+  bool is_current(uint32_t id, const file_stamp& stamp) const;
+
+  /* Sorted ids of the files that may contain literal, ignoring ASCII case;
+   * nullopt when literal is too short to rule out any file */
+  std::optional<std::vector<uint32_t>> candidates(
+      std::string_view literal) const;
+
+private:
+  struct header;
+  struct file_entry;
+  struct trigram_entry;
+
+  void unmap();
+  std::string_view path_of(const file_entry& file) const;
+  const trigram_entry* find_trigram(uint32_t trigram) const;
+
+  const char* m_data = nullptr;
+  std::size_t m_size = 0;
+
+  const header* m_header = nullptr;
+  const file_entry* m_files = nullptr;
+  const trigram_entry* m_trigrams = nullptr;
+  const uint32_t* m_postings = nullptr;
+  const char* m_paths = nullptr;
+
+  std::unordered_map<std::string_view, uint32_t> m_ids;
+};
+
+}  // namespace search
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <uring.hpp>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#  define OYSTR_HAS_IO_URING 1
+#  include <fcntl.h>
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+namespace search
+{
+#if defined(OYSTR_HAS_IO_URING)
+
+struct uring::ring
+{
+  ~ring()
+  {
+    if (sqes != MAP_FAILED) {
+      ::munmap(sqes, sqes_size);
+    }
+    if (cq_map != MAP_FAILED && cq_map != sq_map) {
+      ::munmap(cq_map, cq_map_size);
+    }
+    if (sq_map != MAP_FAILED) {
+      ::munmap(sq_map, sq_map_size);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  int fd = -1;
+
+  void* sq_map = MAP_FAILED;
+  std::size_t sq_map_size = 0;
+  void* cq_map = MAP_FAILED;
+  std::size_t cq_map_size = 0;
+  void* sqes = MAP_FAILED;
+  std::size_t sqes_size = 0;
+
+  // Shared with the kernel
+  unsigned* sq_head = nullptr;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  io_uring_cqe* cqes = nullptr;
+  unsigned cq_mask = 0;
+
+  // Entries queued up to here, and handed to the kernel up to submitted
+  unsigned tail = 0;
+  unsigned submitted = 0;
+};
+
+namespace
+{
+constexpr uint8_t needed_operations[] = {
+    IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE};
+
+// The operation codes a probe asks about; more than there are
+constexpr unsigned probe_operations = 256;
+
+template<typename T>
+T* at(void* map, unsigned offset)
+{
+  return reinterpret_cast<T*>(static_cast<char*>(map) + offset);
+}
+
+void* map_ring(int fd, std::size_t size, off_t offset)
+{
+  return ::mmap(nullptr,
+                size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                fd,
+                offset);
+}
+
+bool supports_needed_operations(int fd)
+{
+  const auto size =
+      sizeof(io_uring_probe) + probe_operations * sizeof(io_uring_probe_op);
+  std::string bytes(size, '\0');
+  auto* probe = reinterpret_cast<io_uring_probe*>(bytes.data());
+  if (::syscall(__NR_io_uring_register,
+                fd,
+                IORING_REGISTER_PROBE,
+                probe,
+                probe_operations)
+      < 0)
+  {
+    return false;
+  }
+  for (const auto op : needed_operations) {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+int enter(int fd, unsigned to_submit, unsigned min_complete)
+{
+  return static_cast<int>(
+      ::syscall(__NR_io_uring_enter,
+                fd,
+                to_submit,
+                min_complete,
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0,
+                nullptr,
+                0));
+}
+
+}  // namespace
+
+std::unique_ptr<uring> uring::create(unsigned entries)
+{
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  auto r = std::make_unique<ring>();
+  r->fd = static_cast<int>(
+      ::syscall(__NR_io_uring_setup, entries, &params));
+  if (r->fd < 0 || !supports_needed_operations(r->fd)) {
+    return nullptr;
+  }
+
+  r->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_map_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    r->sq_map_size = r->cq_map_size =
+        std::max(r->sq_map_size, r->cq_map_size);
+  }
+  r->sq_map = map_ring(r->fd, r->sq_map_size, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) {
+    return nullptr;
+  }
+  r->cq_map = (params.features & IORING_FEAT_SINGLE_MMAP)
+      ? r->sq_map
+      : map_ring(r->fd, r->cq_map_size, IORING_OFF_CQ_RING);
+  r->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  r->sqes = map_ring(r->fd, r->sqes_size, IORING_OFF_SQES);
+  if (r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+    return nullptr;
+  }
+
+  r->sq_head = at<unsigned>(r->sq_map, params.sq_off.head);
+  r->sq_tail = at<unsigned>(r->sq_map, params.sq_off.tail);
+  r->sq_array = at<unsigned>(r->sq_map, params.sq_off.array);
+  r->sq_mask = *at<unsigned>(r->sq_map, params.sq_off.ring_mask);
+  r->sq_entries = params.sq_entries;
+  r->cq_head = at<unsigned>(r->cq_map, params.cq_off.head);
+  r->cq_tail = at<unsigned>(r->cq_map, params.cq_off.tail);
+  r->cqes = at<io_uring_cqe>(r->cq_map, params.cq_off.cqes);
+  r->cq_mask = *at<unsigned>(r->cq_map, params.cq_off.ring_mask);
+  r->tail = r->submitted = *r->sq_tail;
+
+  return std::unique_ptr<uring>(new uring(std::move(r)));
+}
+
+uring::uring(std::unique_ptr<ring> state)
+    : m_ring(std::move(state))
+{
+}
+
+uring::~uring() = default;
+
+io_uring_sqe& uring::next_entry()
+{
+  auto& r = *m_ring;
+  // Full; what the kernel takes frees the entries it was in
+  while (r.tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE) >= r.sq_entries)
+  {
+    submit(0);
+  }
+  const auto index = r.tail & r.sq_mask;
+  r.sq_array[index] = index;
+  ++r.tail;
+
+  auto& entry = static_cast<io_uring_sqe*>(r.sqes)[index];
+  std::memset(&entry, 0, sizeof(entry));
+  return entry;
+}
+
+void uring::prepare_open(const char* path, uint64_t user_data)
+{
+  auto& entry = next_entry();
+  entry.opcode = IORING_OP_OPENAT;
+  entry.fd = AT_FDCWD;
+  entry.addr = reinterpret_cast<uint64_t>(path);
+  entry.open_flags = O_RDONLY | O_CLOEXEC;
+  entry.user_data = user_data;
+}
+
+void uring::prepare_statx(const char* path,
+                          struct statx* info,
+                          uint64_t user_data)
+{
+  auto& entry = next_entry();
+  entry.opcode = IORING_OP_STATX;
+  entry.fd = AT_FDCWD;
+  entry.addr = reinterpret_cast<uint64_t>(path);
+  entry.len = STATX_TYPE | STATX_SIZE;
+  entry.off = reinterpret_cast<uint64_t>(info);
+  entry.user_data = user_data;
+}
+
+void uring::prepare_read(int fd,
+                         void* buffer,
+                         unsigned length,
+                         uint64_t offset,
+                         uint64_t user_data)
+{
+  auto& entry = next_entry();
+  entry.opcode = IORING_OP_READ;
+  entry.fd = fd;
+  entry.addr = reinterpret_cast<uint64_t>(buffer);
+  entry.len = length;
+  entry.off = offset;
+  entry.user_data = user_data;
+}
+
+void uring::prepare_close(int fd, uint64_t user_data)
+{
+  auto& entry = next_entry();
+  entry.opcode = IORING_OP_CLOSE;
+  entry.fd = fd;
+  entry.user_data = user_data;
+}
+
+void uring::submit(unsigned min_complete)
+{
+  auto& r = *m_ring;
+  __atomic_store_n(r.sq_tail, r.tail, __ATOMIC_RELEASE);
+  while (true) {
+    const auto result = enter(r.fd, r.tail - r.submitted, min_complete);
+    if (result >= 0) {
+      r.submitted += static_cast<unsigned>(result);
+      return;
+    }
+    // EAGAIN and EBUSY ask for completions to be reaped first, and the
+    // caller reaps next
+    if (errno == EAGAIN || errno == EBUSY) {
+      return;
+    }
+    if (errno != EINTR) {
+      throw std::runtime_error(std::string("io_uring_enter: ")
+                               + std::strerror(errno));
+    }
+  }
+}
+
+std::size_t uring::reap(completion* out, std::size_t max)
+{
+  auto& r = *m_ring;
+  auto head = *r.cq_head;
+  const auto tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+  std::size_t count = 0;
+  for (; head != tail && count < max; ++head, ++count) {
+    const auto& entry = r.cqes[head & r.cq_mask];
+    out[count] = {entry.user_data, entry.res};
+  }
+  __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+#else
+
+struct uring::ring
+{
+};
+
+std::unique_ptr<uring> uring::create(unsigned)
+{
+  return nullptr;
+}
+
+uring::uring(std::unique_ptr<ring> state)
+    : m_ring(std::move(state))
+{
+}
+
+uring::~uring() = default;
+
+void uring::prepare_open(const char*, uint64_t) {}
+
+void uring::prepare_statx(const char*, struct statx*, uint64_t) {}
+
+void uring::prepare_read(int, void*, unsigned, uint64_t, uint64_t) {}
+
+void uring::prepare_close(int, uint64_t) {}
+
+void uring::submit(unsigned) {}
+
+std::size_t uring::reap(completion*, std::size_t)
+{
+  return 0;
+}
+
+#endif
+
+}  // namespace search
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct io_uring_sqe;
+struct statx;
+
+namespace search
+{
+/* An io_uring set up and driven with the raw system calls, so that no
+ * liburing is needed, and with just the operations the searcher reads
+ * files with. Linux only.
+ *
+ * The prepare functions queue an operation, tagged with user_data, and
+ * submit() hands what is queued to the kernel; a full submission queue is
+ * submitted before more is queued. Whatever an operation points to has to
+ * stay valid until its completion is reaped. */
+class uring
+{
+public:
+  struct completion
+  {
+    uint64_t user_data;
+    // What the system call would return, or -errno
+    int result;
+  };
+
+  /* A ring of entries submission queue entries; nullptr when io_uring is
+   * not available, e.g. on a kernel older than 5.6, under a seccomp filter
+   * or with kernel.io_uring_disabled set */
+  static std::unique_ptr<uring> create(unsigned entries);
+
+  ~uring();
+
+  uring(const uring&) = delete;
+  uring& operator=(const uring&) = delete;
+
+  /* openat(AT_FDCWD, path, O_RDONLY | O_CLOEXEC) */
+  void prepare_open(const char* path, uint64_t user_data);
+  /* statx(AT_FDCWD, path, 0, STATX_TYPE | STATX_SIZE, info) */
+  void prepare_statx(const char* path, struct statx* info, uint64_t user_data);
+  /* pread(fd, buffer, length, offset) */
+  void prepare_read(int fd,
+                    void* buffer,
+                    unsigned length,
+                    uint64_t offset,
+                    uint64_t user_data);
+  void prepare_close(int fd, uint64_t user_data);
+
+  /* Submits the operations queued, and waits until at least min_complete
+   * completions are there to be reaped */
+  void submit(unsigned min_complete);
+
+  /* Moves up to max completions to out and returns how many */
+  std::size_t reap(completion* out, std::size_t max);
+
+private:
+  struct ring;
+
+  explicit uring(std::unique_ptr<ring> state);
+
+  /* A zeroed entry at the tail of the submission queue */
+  io_uring_sqe& next_entry();
+
+  std::unique_ptr<ring> m_ring;
+};
+
+}  // namespace search
@@ -0,0 +1,414 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <searcher.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <watch.hpp>
+#if defined(__linux__)
+#  include <sys/inotify.h>
+#endif
+
+namespace search
+{
+#if defined(__linux__)
+namespace
+{
+// Bytes before the searched offset of a file that are remembered, to tell
+// a file that grew from one that was rewritten
+constexpr std::size_t tail_size = 64;
+
+constexpr uint32_t directory_events = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE
+    | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR | IN_EXCL_UNLINK;
+constexpr uint32_t file_events = IN_MODIFY | IN_CLOSE_WRITE;
+// On the directory of a file named on the command line, to see the file
+// replaced; added to what a directory watch there already asks for
+constexpr uint32_t parent_events =
+    IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD;
+
+uint64_t hash_bytes(std::string_view bytes)
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325;
+  for (const unsigned char c : bytes) {
+    hash = (hash ^ c) * 0x100000001b3;
+  }
+  return hash;
+}
+
+std::string read_range(int fd, uint64_t start, uint64_t end)
+{
+  std::string text(end - start, '\0');
+  std::size_t length = 0;
+  while (length < text.size()) {
+    const auto result =
+        ::pread(fd, &text[length], text.size() - length, start + length);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    length += static_cast<std::size_t>(result);
+  }
+  text.resize(length);
+  return text;
+}
+
+class watch_session
+{
+public:
+  explicit watch_session(std::FILE* err)
+      : m_fd(::inotify_init1(IN_CLOEXEC))
+      , m_err(err)
+  {
+    if (m_fd < 0) {
+      throw std::runtime_error(std::string("inotify: ")
+                               + std::strerror(errno));
+    }
+  }
+
+  ~watch_session()
+  {
+    ::close(m_fd);
+  }
+
+  void add_root(const std::string& path)
+  {
+    struct stat info;
+    if (::stat(path.c_str(), &info) != 0) {
+      throw std::runtime_error("'" + path
+                               + "' is not a valid file or directory");
+    }
+
+    if (S_ISDIR(info.st_mode)) {
+      const auto root_length =
+          path.back() == '/' ? path.size() : path.size() + 1;
+      watch_tree(path, root_length, nullptr);
+      return;
+    }
+
+    watch_file(path);
+    watch_parent(path);
+    update_file(path);
+  }
+
+  int run()
+  {
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (!(searcher::m_mode == output_mode::quiet && searcher::m_matched)) {
+      std::fflush(searcher::m_out);
+
+      const auto length = ::read(m_fd, buffer, sizeof(buffer));
+      if (length < 0 && errno == EINTR) {
+        continue;
+      }
+      if (length <= 0) {
+        break;
+      }
+
+      // A burst of writes to a file is searched once per batch of events
+      m_changed.clear();
+      m_new_directories.clear();
+      for (long offset = 0; offset < length;) {
+        const auto* event =
+            reinterpret_cast<const inotify_event*>(buffer + offset);
+        offset += sizeof(inotify_event) + event->len;
+        handle(*event);
+      }
+
+      for (const auto& [path, root_length, rules] : m_new_directories) {
+        watch_tree(path, root_length, rules);
+      }
+      for (const auto& path : m_changed) {
+        update_file(path);
+      }
+    }
+
+    std::fflush(searcher::m_out);
+    return searcher::m_matched ? 0 : 1;
+  }
+
+private:
+  struct watched_directory
+  {
+    std::string path;
+    std::size_t root_length;
+    // In effect for the entries of the directory
+    std::shared_ptr<const ignore_rules> rules;
+  };
+
+  struct file_state
+  {
+    // Everything before offset is searched, and ends in a newline
+    uint64_t offset = 0;
+    uint64_t lines = 0;
+    uint64_t tail_hash = 0;
+    // The line at offset, still incomplete, was printed when the file was
+    // searched whole, so it is not printed again once it is complete
+    bool partial_reported = false;
+  };
+
+  /* Watches and searches everything below path, as a directory search of
+   * the root it is root_length bytes into would */
+  void watch_tree(const std::string& path,
+                  std::size_t root_length,
+                  std::shared_ptr<const ignore_rules> rules)
+  {
+    const searcher::directory_visitor enter =
+        [&](const std::string& directory,
+            const std::shared_ptr<const ignore_rules>& directory_rules)
+    {
+      const int wd =
+          ::inotify_add_watch(m_fd, directory.c_str(), directory_events);
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      if (wd >= 0) {
+        m_directories[wd] = {directory, root_length, directory_rules};
+      } else {
+        warn_watch_failed(directory);
+      }
+    };
+    searcher::walk_subdirectory(
+        path,
+        root_length,
+        std::move(rules),
+        [&](std::string_view file, std::size_t)
+        { update_file(std::string(file)); },
+        &enter);
+  }
+
+  void watch_file(const std::string& path)
+  {
+    const int wd = ::inotify_add_watch(m_fd, path.c_str(), file_events);
+    if (wd >= 0) {
+      m_files[wd] = path;
+    } else {
+      warn_watch_failed(path);
+    }
+  }
+
+  /* Editors save by renaming a new file over the old one, and the watch
+   * on the old one goes away with it. Watching the directory for the name
+   * lets the file be followed to the one that replaces it. */
+  void watch_parent(const std::string& path)
+  {
+    const auto slash = path.rfind('/');
+    const auto directory = slash == std::string::npos ? std::string(".")
+        : slash == 0                                   ? std::string("/")
+                                                       : path.substr(0, slash);
+    const auto name =
+        slash == std::string::npos ? path : path.substr(slash + 1);
+
+    const int wd =
+        ::inotify_add_watch(m_fd, directory.c_str(), parent_events);
+    if (wd >= 0) {
+      m_parents[wd][name] = path;
+    } else {
+      warn_watch_failed(directory);
+    }
+  }
+
+  void warn_watch_failed(const std::string& path)
+  {
+    if (errno == ENOSPC && !m_out_of_watches) {
+      m_out_of_watches = true;
+      fmt::print(m_err,
+                 "Warning: out of inotify watches, so changes below '{}' are "
+                 "missed; raise fs.inotify.max_user_watches\n",
+                 path);
+    }
+  }
+
+  void handle(const inotify_event& event)
+  {
+    if (event.mask & IN_Q_OVERFLOW) {
+      // Events were lost; look at every file there is a state for
+      for (const auto& [path, state] : m_states) {
+        m_changed.insert(path);
+      }
+      return;
+    }
+
+    const auto file = m_files.find(event.wd);
+    if (file != m_files.end()) {
+      if (event.mask & IN_IGNORED) {
+        m_files.erase(file);
+      } else {
+        m_changed.insert(file->second);
+      }
+      return;
+    }
+
+    const auto parent = m_parents.find(event.wd);
+    if (parent != m_parents.end()) {
+      if (event.mask & IN_IGNORED) {
+        m_parents.erase(parent);
+      } else if (event.len != 0 && (event.mask & (IN_CREATE | IN_MOVED_TO)))
+      {
+        const auto replaced = parent->second.find(event.name);
+        if (replaced != parent->second.end()) {
+          watch_file(replaced->second);
+          m_changed.insert(replaced->second);
+        }
+      }
+      // The directory may be searched as well, so go on
+    }
+
+    const auto found = m_directories.find(event.wd);
+    if (found == m_directories.end()) {
+      return;
+    }
+    if (event.mask & IN_IGNORED) {
+      m_directories.erase(found);
+      return;
+    }
+    if (event.len == 0) {
+      return;
+    }
+
+    const auto& directory = found->second;
+    const std::string_view name(event.name);
+    const auto path = (directory.path.back() == '/' ? directory.path
+                                                    : directory.path + '/')
+        + std::string(name);
+    const bool is_dir = (event.mask & IN_ISDIR) != 0;
+
+    if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+      if (!is_dir) {
+        m_states.erase(path);
+        m_changed.erase(path);
+      }
+      return;
+    }
+    if (!searcher::is_walked(
+            path, is_dir, directory.root_length, directory.rules.get()))
+    {
+      return;
+    }
+    if (!is_dir) {
+      m_changed.insert(path);
+    } else if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+      m_new_directories.push_back(
+          {path, directory.root_length, directory.rules});
+    }
+  }
+
+  /* Searches the complete lines appended to path since it was last
+   * searched, or all of it when it is new or was rewritten */
+  void update_file(const std::string& path)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+      ::close(fd);
+      return;
+    }
+    const auto size = static_cast<uint64_t>(info.st_size);
+
+    file_state state;
+    bool appended = false;
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      const auto found = m_states.find(path);
+      if (found != m_states.end()) {
+        state = found->second;
+        appended = size >= state.offset;
+      }
+    }
+    if (appended && state.offset > 0) {
+      const auto tail_start = state.offset - std::min<uint64_t>(
+                                  state.offset, tail_size);
+      appended = hash_bytes(read_range(fd, tail_start, state.offset))
+          == state.tail_hash;
+    }
+    if (!appended) {
+      state = file_state();
+    }
+
+    auto text = read_range(fd, state.offset, size);
+    // A line still being written is searched once it is complete; a new
+    // file is searched whole, like any other search would
+    const auto last_newline = text.rfind('\n');
+    const auto complete =
+        last_newline == std::string::npos ? 0 : last_newline + 1;
+    std::string_view searched = text;
+    auto first_line = state.lines + 1;
+    if (appended) {
+      searched = searched.substr(0, complete);
+      if (state.partial_reported && complete > 0) {
+        searched.remove_prefix(text.find('\n') + 1);
+        ++first_line;
+        state.partial_reported = false;
+      }
+    } else {
+      state.partial_reported = complete < text.size()
+          && searcher::has_match(std::string_view(text).substr(complete));
+    }
+
+    if (!searched.empty()) {
+      try {
+        searcher::file_search(path, searched, first_line);
+      } catch (const std::exception& e) {
+      }
+    }
+
+    state.lines += std::count(text.begin(), text.begin() + complete, '\n');
+    state.offset += complete;
+    const auto tail_start =
+        state.offset - std::min<uint64_t>(state.offset, tail_size);
+    state.tail_hash = hash_bytes(read_range(fd, tail_start, state.offset));
+    ::close(fd);
+
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    m_states[path] = state;
+  }
+
+  int m_fd;
+  std::FILE* m_err;
+  bool m_out_of_watches = false;
+
+  // Guards the maps below while an initial walk runs on the pool
+  std::mutex m_mutex;
+  std::unordered_map<int, watched_directory> m_directories;
+  // Watches on files named on the command line, and on their directories
+  // with the paths named there by file name
+  std::unordered_map<int, std::string> m_files;
+  std::unordered_map<int, std::unordered_map<std::string, std::string>>
+      m_parents;
+  std::unordered_map<std::string, file_state> m_states;
+
+  // Collected from one batch of events
+  std::unordered_set<std::string> m_changed;
+  std::vector<watched_directory> m_new_directories;
+};
+
+}  // namespace
+
+int watch(const std::vector<std::string>& paths, std::FILE* err)
+{
+  watch_session session(err);
+  for (const auto& path : paths) {
+    session.add_root(path);
+  }
+  return session.run();
+}
+
+#else
+
+int watch(const std::vector<std::string>&, std::FILE*)
+{
+  throw std::runtime_error("--watch needs inotify, which is Linux only");
+}
+
+#endif
+
+}  // namespace search
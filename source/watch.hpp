@@ -0,0 +1,16 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace search
+{
+/* --watch: searches paths once, then follows them with inotify and only
+ * searches what changes: lines appended to files already searched, and
+ * files that are created or rewritten. Matches are written as they are
+ * found. Returns the exit status once -q has seen a match; otherwise runs
+ * until killed. Warnings go to err. Throws std::runtime_error when the
+ * paths cannot be watched. */
+int watch(const std::vector<std::string>& paths, std::FILE* err);
+
+}  // namespace search
@@ -1,4 +1,1228 @@
+/* Checks that:
+ *  - searching a file allocates nothing from the heap once the read and
+ *    output buffers of the thread are warm, in each output mode. This is
+ *    the work done for every file of a directory search.
+ *  - -n numbers lines from 1, or from where input read line by line is.
+ *  - a file searched through a mapping, split across the pool or read in
+ *    chunks with --stream prints the same lines and line numbers as one
+ *    read whole, matches and long lines across chunk and range
+ *    boundaries included.
+ *  - ignore rules decide like git does for the cases a walk runs into.
+ *  - -g globs, --type groups and -f select the files they should, and
+ *    take precedence over each other in that order.
+ *  - the index narrows a search down to the files that contain every
+ *    trigram of the literal, searches files changed since it was built
+ *    anyway, and rereads only those when rebuilt.
+ *  - regexes find the matches they should, without trying every start
+ *    of a long line, extract the literals the prefilter looks for, and
+ *    reject the syntax they do not support.
+ *  - multiple -e patterns are found leftmost first, longest first at the
+ *    same position, by Teddy and by the automaton that takes over from it
+ *    past 32 patterns.
+ *  - matches are highlighted in one pass, each match found from the end
+ *    of the one before, adjacent ones included.
+ *  - every substring kernel the CPU supports finds what
+ *    std::string_view::find does, with and without -i, and reads nothing
+ *    past the end of the haystack or the needle. */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <file_filter.hpp>
+#include <ignore.hpp>
+#include <regex.hpp>
+#include <searcher.hpp>
+#include <sse2_strstr.hpp>
+#include <trigram_index.hpp>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+// Only the main thread searches, so a plain counter will do
+std::size_t allocations = 0;
+
+constexpr int searches = 100;
+
+void* allocate(std::size_t size, std::size_t alignment)
+{
+  ++allocations;
+  size = (std::max<std::size_t>(size, 1) + alignment - 1) / alignment
+      * alignment;
+  if (void* pointer = std::aligned_alloc(alignment, size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+/* Returns the number of heap allocations that searching path a number of
+ * times makes, after a first search that warms the buffers up */
+std::size_t allocations_in_searches(const std::string& path)
+{
+  using search::searcher;
+  searcher::read_file_and_search(path.c_str());
+  const auto before = allocations;
+  for (int i = 0; i < searches; ++i) {
+    searcher::read_file_and_search(path.c_str());
+  }
+  return allocations - before;
+}
+
+int check_allocations(const fs::path& root)
+{
+  const auto small = (root / "small.cpp").string();
+  std::ofstream(small) << "int x = 1;\nint needle = 2;\nint y = 3;\n";
+  const auto no_match = (root / "no_match.cpp").string();
+  std::ofstream(no_match) << "int x = 1;\n";
+  // Many matching lines, but below the size at which files are mapped
+  const auto large = (root / "large.cpp").string();
+  {
+    std::ofstream out(large);
+    for (int line = 0; line < 10000; ++line) {
+      out << "int needle_" << line << " = " << line << ";\n";
+    }
+  }
+
+  using search::output_mode;
+  using search::searcher;
+  searcher::m_query = "needle";
+  searcher::m_needle = search::compile_needle(searcher::m_query, false);
+  searcher::m_ignore_case = false;
+  searcher::m_is_path_from_terminal = true;
+  searcher::m_out = std::fopen("/dev/null", "w");
+
+  struct configuration
+  {
+    const char* name;
+    output_mode mode;
+    bool is_stdout;
+    bool line_number;
+  };
+  const configuration configurations[] = {
+      {"lines", output_mode::lines, false, false},
+      {"colored lines", output_mode::lines, true, true},
+      {"-l", output_mode::files_with_matches, false, false},
+      {"-c", output_mode::count, false, false},
+  };
+
+  int failures = 0;
+  for (const auto& configuration : configurations) {
+    searcher::m_mode = configuration.mode;
+    searcher::m_is_stdout = configuration.is_stdout;
+    searcher::m_line_number = configuration.line_number;
+    for (const auto& path : {small, no_match, large}) {
+      const auto count = allocations_in_searches(path);
+      if (count != 0) {
+        std::printf("%s: %zu allocations in %d searches of %s\n",
+                    configuration.name,
+                    count,
+                    searches,
+                    path.c_str());
+        ++failures;
+      }
+    }
+  }
+
+  std::fclose(searcher::m_out);
+  searcher::m_out = stdout;
+  return failures;
+}
+
+/* What run writes to the searcher's output */
+std::string captured_output(const std::function<void()>& run)
+{
+  using search::searcher;
+  std::FILE* out = std::tmpfile();
+  if (out == nullptr) {
+    throw std::bad_alloc();
+  }
+  searcher::m_out = out;
+  run();
+
+  std::string text(static_cast<std::size_t>(std::ftell(out)), '\0');
+  std::rewind(out);
+  text.resize(std::fread(text.data(), 1, text.size(), out));
+  std::fclose(out);
+  searcher::m_out = stdout;
+  return text;
+}
+
+/* What searching path with search writes */
+std::string search_output(const std::string& path, void (*search)(const char*))
+{
+  return captured_output([&] { search(path.c_str()); });
+}
+
+int check_line_numbers()
+{
+  using search::searcher;
+  searcher::m_query = "needle";
+  searcher::m_needle = search::compile_needle(searcher::m_query, false);
+  searcher::m_ignore_case = false;
+  searcher::m_mode = search::output_mode::lines;
+  searcher::m_is_stdout = false;
+  searcher::m_is_path_from_terminal = true;
+  searcher::m_line_number = true;
+
+  struct numbering_case
+  {
+    std::string text;
+    std::size_t first_line;
+    std::string expected;
+  };
+  std::vector<numbering_case> cases = {
+      {"needle\n", 1, "f:1:needle\n"},
+      {"a\nneedle\nb\nneedle needle\n", 1, "f:2:needle\nf:4:needle needle\n"},
+      // Empty lines, and a last line without a newline
+      {"\n\n\nneedle", 1, "f:4:needle\n"},
+      {"needle\nneedle\nneedle\n", 1, "f:1:needle\nf:2:needle\nf:3:needle\n"},
+      {"a\nb\n", 1, ""},
+      // Input read line by line starts at a later line
+      {"a\nneedle\n", 10, "f:11:needle\n"},
+  };
+
+  // Lines of every length between the matches, so that the newlines are
+  // counted across and within vector blocks
+  numbering_case many {"", 1, ""};
+  for (std::size_t line = 1; line <= 2000; ++line) {
+    std::string text(line % 150, 'x');
+    if (line % 97 == 0) {
+      text += "needle";
+      many.expected += "f:" + std::to_string(line) + ":" + text + "\n";
+    }
+    many.text += text + "\n";
+  }
+  cases.push_back(std::move(many));
+
+  int failures = 0;
+  for (const auto& check : cases) {
+    const auto output = captured_output(
+        [&] { searcher::file_search("f", check.text, check.first_line); });
+    if (output != check.expected) {
+      std::printf("-n numbers the lines of '%.40s' as '%.60s', not '%.60s'\n",
+                  check.text.c_str(),
+                  output.c_str(),
+                  check.expected.c_str());
+      ++failures;
+    }
+  }
+
+  searcher::m_line_number = false;
+  return failures;
+}
+
+int check_search_paths(const fs::path& root)
+{
+  // Short lines with and without matches, between lines longer than the
+  // stream chunk and the 64 KiB pieces they are printed in. Big enough to
+  // be split into several ranges.
+  const auto path = (root / "paths.txt").string();
+  {
+    std::mt19937 random(7);
+    const auto pick = [&](std::size_t bound)
+    { return static_cast<std::size_t>(random() % bound); };
+    constexpr std::string_view filler = "abc xyz_ ";
+    const std::string_view needles[] = {"needle", "NEEDLE", "NeEdLe"};
+    constexpr std::size_t piece_size = 1 << 16;
+
+    std::string text;
+    while (text.size() < (26 << 20)) {
+      const bool is_long = pick(200) == 0;
+      const auto length = is_long ? 5000 + pick(200000) : pick(80);
+      std::string line;
+      for (std::size_t i = 0; i < length; ++i) {
+        line += filler[pick(filler.size())];
+      }
+      // A third of the long lines are left without a match
+      const auto kind = pick(3);
+      if (is_long && kind == 0) {
+        // Only a match across the end of the first chunk of the line
+        line.replace(4096, 6, needles[pick(3)]);
+      } else if (!is_long || kind == 1) {
+        for (auto matches = pick(is_long ? 6 : 2); matches-- > 0;) {
+          const auto at = pick(4) == 0 ? (pick(2) == 0 ? 0 : line.size())
+                                       : pick(line.size() + 1);
+          line.insert(at, needles[pick(3)]);
+        }
+        // Matches across the pieces a long line is printed in
+        for (auto at = piece_size - 3; is_long && at + 6 <= line.size();
+             at += piece_size)
+        {
+          line.replace(at, 6, needles[pick(3)]);
+        }
+      }
+      text += line;
+      text += '\n';
+    }
+    std::ofstream(path, std::ios::binary) << text;
+  }
+
+  using search::output_mode;
+  using search::searcher;
+  searcher::m_ts = std::make_unique<thread_pool>(4);
+  searcher::m_is_path_from_terminal = true;
+  // Chunks that do not divide the 64 KiB pieces of a long line
+  searcher::m_stream_chunk_size = 4099;
+
+  struct configuration
+  {
+    const char* name;
+    output_mode mode;
+    bool ignore_case;
+    bool is_stdout;
+    bool line_number;
+  };
+  const configuration configurations[] = {
+      {"lines", output_mode::lines, false, false, false},
+      {"-n", output_mode::lines, false, false, true},
+      {"-i -n", output_mode::lines, true, false, true},
+      {"colored -n", output_mode::lines, false, true, true},
+      {"colored -i", output_mode::lines, true, true, false},
+      {"-c", output_mode::count, false, false, false},
+  };
+
+  struct search_path
+  {
+    const char* name;
+    bool stream;
+    long long mmap_threshold;
+    void (*search)(const char*);
+  };
+  const search_path paths[] = {
+      {"mapped", false, 0, searcher::read_file_and_search},
+      {"split", false, 0, searcher::read_file_and_search_split},
+      {"--stream", true, -1, searcher::read_file_and_search},
+  };
+
+  int failures = 0;
+  for (const auto& configuration : configurations) {
+    searcher::m_query = configuration.ignore_case ? "needle" : "NEEDLE";
+    searcher::m_needle = search::compile_needle(searcher::m_query,
+                                                configuration.ignore_case);
+    searcher::m_ignore_case = configuration.ignore_case;
+    searcher::m_mode = configuration.mode;
+    searcher::m_is_stdout = configuration.is_stdout;
+    searcher::m_line_number = configuration.line_number;
+
+    searcher::m_stream = false;
+    searcher::m_mmap_threshold = -1;
+    const auto expected =
+        search_output(path, searcher::read_file_and_search);
+    if (expected.empty()) {
+      std::printf("%s: nothing found to compare\n", configuration.name);
+      ++failures;
+      continue;
+    }
+
+    for (const auto& search_path : paths) {
+      searcher::m_stream = search_path.stream;
+      searcher::m_mmap_threshold = search_path.mmap_threshold;
+      auto output = search_output(path, search_path.search);
+
+      if (search_path.stream && configuration.is_stdout) {
+        // A long line goes out as it is read, so the file's header is
+        // printed again for the lines after it
+        const auto header = "\n\033[1;36m" + path + "\033[0m\n";
+        const auto first = output.find(header);
+        for (auto at = output.find(header, first + 1);
+             at != std::string::npos;
+             at = output.find(header, at))
+        {
+          output.erase(at, header.size());
+        }
+      }
+
+      if (output != expected) {
+        std::printf("%s: a %s search prints other lines than a plain one\n",
+                    configuration.name,
+                    search_path.name);
+        ++failures;
+      }
+    }
+  }
+
+  searcher::m_stream = false;
+  searcher::m_mmap_threshold = 1 << 20;
+  searcher::m_ts.reset();
+  return failures;
+}
+
+/* Names of the files an indexed search of top finds query in, sorted */
+std::vector<std::string> indexed_matches(const fs::path& top,
+                                         const char* query)
+{
+  using search::searcher;
+  searcher::m_query = query;
+  searcher::m_needle = search::compile_needle(searcher::m_query, true);
+  const auto output =
+      captured_output([&] { searcher::indexed_search(top.c_str()); });
+
+  std::vector<std::string> names;
+  for (std::size_t at = 0, end; at < output.size(); at = end + 1) {
+    end = output.find('\n', at);
+    names.push_back(fs::path(output.substr(at, end - at)).filename());
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+int check_index(const fs::path& root)
+{
+  using search::searcher;
+  using search::trigram_index;
+  const auto top = root / "indexed";
+  fs::create_directories(top / "sub");
+  std::ofstream(top / "a.txt") << "alpha beta\n";
+  std::ofstream(top / "b.txt") << "gamma delta\n";
+  std::ofstream(top / "sub" / "c.txt") << "ALPHABET soup\n";
+  // Each with two of the three trigrams of "alpha", so that no posting
+  // list on its own is the answer
+  std::ofstream(top / "d.txt") << "an alph\n";
+  std::ofstream(top / "f.txt") << "lpha\n";
+
+  searcher::m_ts = std::make_unique<thread_pool>(4);
+  searcher::m_ignore_case = true;
+  searcher::m_mode = search::output_mode::files_with_matches;
+  searcher::m_is_stdout = false;
+
+  int failures = 0;
+  const auto index_path = (top / trigram_index::file_name).string();
+  auto stats = trigram_index::build(top.string());
+  if (stats.files != 5 || stats.read != 5) {
+    std::printf("the first build indexed %zu files and read %zu, not 5\n",
+                stats.files,
+                stats.read);
+    ++failures;
+  }
+
+  {
+    const trigram_index index(index_path);
+    std::vector<uint32_t> expected = {
+        static_cast<uint32_t>(index.find("a.txt")),
+        static_cast<uint32_t>(index.find("sub/c.txt"))};
+    std::sort(expected.begin(), expected.end());
+    const auto alpha = index.candidates("Alpha");
+    if (!alpha || *alpha != expected) {
+      std::printf("the candidates for 'alpha' are not a.txt and c.txt\n");
+      ++failures;
+    }
+    const auto none = index.candidates("zzzz");
+    if (!none || !none->empty()) {
+      std::printf("a literal in no file still has candidates\n");
+      ++failures;
+    }
+    if (index.candidates("al")) {
+      std::printf("a literal shorter than a trigram rules files out\n");
+      ++failures;
+    }
+    if (index.find("missing.txt") != -1) {
+      std::printf("a file that was never indexed has an id\n");
+      ++failures;
+    }
+  }
+
+  stats = trigram_index::build(top.string());
+  if (stats.files != 5 || stats.read != 0) {
+    std::printf("a rebuild of unchanged files read %zu of them\n",
+                stats.read);
+    ++failures;
+  }
+
+  // Changed and added files are searched before the index catches up
+  std::ofstream(top / "b.txt") << "gamma alpha delta\n";
+  std::ofstream(top / "e.txt") << "alpha, new\n";
+  {
+    const trigram_index index(index_path);
+    search::file_stamp stamp;
+    const auto id = index.find("b.txt");
+    if (id < 0 || !search::read_file_stamp((top / "b.txt").c_str(), stamp)
+        || index.is_current(static_cast<uint32_t>(id), stamp))
+    {
+      std::printf("the entry of a changed file is not stale\n");
+      ++failures;
+    }
+  }
+  const std::vector<std::string> found = {"a.txt", "b.txt", "c.txt", "e.txt"};
+  if (indexed_matches(top, "alpha") != found) {
+    std::printf("an indexed search misses changed or added files\n");
+    ++failures;
+  }
+
+  stats = trigram_index::build(top.string());
+  if (stats.files != 6 || stats.read != 2) {
+    std::printf("a rebuild after a change read %zu of %zu files, not 2 of 6\n",
+                stats.read,
+                stats.files);
+    ++failures;
+  }
+  {
+    const trigram_index index(index_path);
+    const auto alpha = index.candidates("alpha");
+    if (!alpha || alpha->size() != 4) {
+      std::printf("the rebuilt index does not list the changed files\n");
+      ++failures;
+    }
+  }
+  if (indexed_matches(top, "alpha") != found
+      || indexed_matches(top, "soup") != std::vector<std::string> {"c.txt"}
+      || !indexed_matches(top, "zzzz").empty())
+  {
+    std::printf("an indexed search finds other files than it should\n");
+    ++failures;
+  }
+
+  searcher::m_ignore_case = false;
+  searcher::m_mode = search::output_mode::lines;
+  searcher::m_ts.reset();
+  return failures;
+}
+
+/* Loads the rules of the directory at path, as a walk entering it would */
+std::shared_ptr<const search::ignore_rules> load_rules(
+    const fs::path& path,
+    std::shared_ptr<const search::ignore_rules> parent)
+{
+  search::ignore_files files;
+  files.gitignore = fs::exists(path / ".gitignore");
+  files.ignore = fs::exists(path / ".ignore");
+  const int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  auto rules =
+      search::ignore_rules::load(fd, path.string(), files, std::move(parent));
+  ::close(fd);
+  return rules;
+}
+
+int check_ignore_rules(const fs::path& root)
+{
+  const auto top = root / "repo";
+  fs::create_directories(top / "sub" / "deeper");
+  std::ofstream(top / ".gitignore") << "# build output\n"
+                                       "*.log\n"
+                                       "!keep.log\n"
+                                       "/build\n"
+                                       "out/\n"
+                                       "docs/*.tmp\n"
+                                       "*.o\n";
+  std::ofstream(top / "sub" / ".gitignore") << "!*.log\n"
+                                               "local.txt\n";
+  // .ignore overrides .gitignore of the same directory
+  std::ofstream(top / "sub" / ".ignore") << "!local.txt\n"
+                                            "private/\n";
+
+  const auto top_rules = load_rules(top, nullptr);
+  const auto sub_rules = load_rules(top / "sub", top_rules);
+  const auto deeper_rules = load_rules(top / "sub" / "deeper", sub_rules);
+
+  int failures = 0;
+  if (top_rules == nullptr || sub_rules == top_rules) {
+    std::printf("ignore files were not loaded\n");
+    return 1;
+  }
+  // Without ignore files of its own, a directory shares its parent's rules
+  if (deeper_rules != sub_rules) {
+    std::printf("sub/deeper does not share the rules of sub\n");
+    ++failures;
+  }
+
+  struct ignore_case
+  {
+    const search::ignore_rules* rules;
+    const char* path;
+    bool is_dir;
+    bool ignored;
+  };
+  const ignore_case cases[] = {
+      // A pattern without a slash matches the name at any depth
+      {top_rules.get(), "a.log", false, true},
+      {top_rules.get(), "x/y/b.log", false, true},
+      {top_rules.get(), "a.txt", false, false},
+      // A later negation re-includes
+      {top_rules.get(), "keep.log", false, false},
+      {top_rules.get(), "x/keep.log", false, false},
+      // A leading slash anchors to the directory of the ignore file
+      {top_rules.get(), "build", true, true},
+      {top_rules.get(), "build", false, true},
+      {top_rules.get(), "x/build", true, false},
+      // A trailing slash matches directories only
+      {top_rules.get(), "out", true, true},
+      {top_rules.get(), "x/out", true, true},
+      {top_rules.get(), "out", false, false},
+      // A slash inside anchors as well
+      {top_rules.get(), "docs/a.tmp", false, true},
+      {top_rules.get(), "x/docs/a.tmp", false, false},
+      {top_rules.get(), "docs/a.txt", false, false},
+      // Deeper rules win over those of the directories above
+      {sub_rules.get(), "sub/c.log", false, false},
+      {top_rules.get(), "c.log", false, true},
+      // Rules of the directories above are inherited
+      {sub_rules.get(), "sub/z.o", false, true},
+      {deeper_rules.get(), "sub/deeper/z.o", false, true},
+      {deeper_rules.get(), "sub/deeper/c.log", false, false},
+      // .ignore wins over .gitignore of the same directory
+      {sub_rules.get(), "sub/local.txt", false, false},
+      {sub_rules.get(), "sub/private", true, true},
+      {sub_rules.get(), "sub/deeper/private", true, true},
+      {top_rules.get(), "private", true, false},
+  };
+
+  for (const auto& check : cases) {
+    const auto path = (top / check.path).string();
+    if (check.rules->is_ignored(path, check.is_dir) != check.ignored) {
+      std::printf("%s%s should %sbe ignored\n",
+                  check.path,
+                  check.is_dir ? "/" : "",
+                  check.ignored ? "" : "not ");
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+int check_file_filter()
+{
+  struct filter_case
+  {
+    std::vector<const char*> globs;
+    std::vector<const char*> types;
+    const char* pattern;
+    const char* path;
+    bool selected;
+  };
+  // Every path is below the searched directory "r/"
+  constexpr std::size_t root_length = 2;
+  const filter_case cases[] = {
+      // By default, source extensions and any name with a '.' in it
+      {{}, {}, nullptr, "r/a.cpp", true},
+      {{}, {}, nullptr, "r/notes.unknown", true},
+      {{}, {}, nullptr, "r/Makefile", false},
+      // A -g glob selects, and then only what some glob matches
+      {{"*.py"}, {}, nullptr, "r/x/a.py", true},
+      {{"*.py"}, {}, nullptr, "r/a.cpp", false},
+      // The last glob that matches decides
+      {{"*.cpp", "!test_*.cpp"}, {}, nullptr, "r/a.cpp", true},
+      {{"*.cpp", "!test_*.cpp"}, {}, nullptr, "r/test_a.cpp", false},
+      {{"!test_*.cpp", "*.cpp"}, {}, nullptr, "r/test_a.cpp", true},
+      // Excludes alone leave the rest to the defaults
+      {{"!*.md"}, {}, nullptr, "r/a.md", false},
+      {{"!*.md"}, {}, nullptr, "r/a.cpp", true},
+      // A glob with a slash matches the path below the searched directory
+      {{"src/*.h"}, {}, nullptr, "r/src/a.h", true},
+      {{"src/*.h"}, {}, nullptr, "r/lib/src/a.h", false},
+      // --type takes the globs of its group, and any of several groups
+      {{}, {"py"}, nullptr, "r/a.pyi", true},
+      {{}, {"py"}, nullptr, "r/a.cpp", false},
+      {{}, {"cmake"}, nullptr, "r/x/CMakeLists.txt", true},
+      {{}, {"cmake"}, nullptr, "r/x/notes.txt", false},
+      {{}, {"go", "rust"}, nullptr, "r/a.rs", true},
+      // -g globs win over --type
+      {{"!*.h"}, {"c"}, nullptr, "r/a.h", false},
+      {{"!*.h"}, {"c"}, nullptr, "r/a.c", true},
+      // -f matches the whole path, '*' across slashes as well
+      {{}, {}, "*test*", "r/test/a.cpp", true},
+      {{}, {}, "*test*", "r/a.cpp", false},
+  };
+
+  int failures = 0;
+  for (const auto& check : cases) {
+    search::file_filter filter;
+    for (const auto* glob : check.globs) {
+      filter.add_glob(glob);
+    }
+    for (const auto* type : check.types) {
+      filter.add_type(type);
+    }
+    if (check.pattern != nullptr) {
+      filter.set_pattern(check.pattern);
+    }
+    filter.compile();
+
+    if (filter.is_selected(check.path, root_length) != check.selected) {
+      std::printf("%s should %sbe selected\n",
+                  check.path,
+                  check.selected ? "" : "not ");
+      ++failures;
+    }
+  }
+
+  // Directories excluded by a glob are not walked at all
+  search::file_filter filter;
+  filter.add_glob("!build/");
+  filter.add_glob("*.cpp");
+  filter.compile();
+  if (!filter.is_excluded_directory("r/build", root_length)
+      || filter.is_excluded_directory("r/src", root_length)
+      || filter.is_selected("r/build", root_length))
+  {
+    std::printf("-g '!build/' should exclude the build directory only\n");
+    ++failures;
+  }
+
+  try {
+    search::file_filter().add_type("nonsense");
+    std::printf("--type nonsense should be rejected\n");
+    ++failures;
+  } catch (const std::invalid_argument&) {
+  }
+  return failures;
+}
+
+int check_regex()
+{
+  struct match_case
+  {
+    const char* pattern;
+    bool ignore_case;
+    const char* line;
+    // The leftmost-longest match, or nullptr when there is none
+    const char* match;
+  };
+  const match_case matches[] = {
+      {"abc", false, "xxabcxx", "abc"},
+      {"a.c", false, "abc", "abc"},
+      {"a.c", false, "ac", nullptr},
+      {"colou?r", false, "the color red", "color"},
+      {"colou?r", false, "the colour red", "colour"},
+      {"ab*", false, "xabbbby", "abbbb"},
+      {"ab+", false, "xay", nullptr},
+      {"^foo", false, "foo bar", "foo"},
+      {"^foo", false, "a foo", nullptr},
+      {"bar$", false, "foo bar", "bar"},
+      {"bar$", false, "bar foo", nullptr},
+      {"^$", false, "", ""},
+      {"[0-9]+", false, "abc 1234 x", "1234"},
+      {"[^a-z ]+", false, "abc DEF", "DEF"},
+      {"[[:upper:]]+", false, "abcXYZdef", "XYZ"},
+      {R"(\d{3}-\d{4})", false, "call 555-1234 now", "555-1234"},
+      {R"(\w+@\w+\.com)", false, "mail me@host.com today", "me@host.com"},
+      {R"(\s+)", false, "a \t b", " \t "},
+      {R"(\.)", false, "a.b", "."},
+      {"x{2,3}", false, "xxxxx", "xxx"},
+      {"x{2}", false, "x", nullptr},
+      {"(cat|dog)s?", false, "hotdogs", "dogs"},
+      {"(?:ab)+", false, "xababab", "ababab"},
+      {"a|ab|abc", false, "abcd", "abc"},
+      // The leftmost match, though another one ends first
+      {"abcd|c", false, "abcd", "abcd"},
+      // Lazy quantifiers behave like greedy ones
+      {"a+?", false, "aaa", "aaa"},
+      {"hello", true, "Say HELLO", "HELLO"},
+      {"[a-c]+", true, "xxABCaxx", "ABCa"},
+      {"HeLLo", true, "hello", "hello"},
+  };
+
+  int failures = 0;
+  for (const auto& check : matches) {
+    const search::regex re(check.pattern, check.ignore_case);
+    const std::string_view line = check.line;
+    const auto found = re.find(line);
+    const bool is_found = found.position != std::string_view::npos;
+    const auto text = is_found ? line.substr(found.position, found.length)
+                               : std::string_view();
+    if (is_found != (check.match != nullptr) || is_found != re.search(line)
+        || (is_found && text != check.match))
+    {
+      std::printf("regex '%s' on '%s' should find %s\n",
+                  check.pattern,
+                  check.line,
+                  check.match != nullptr ? check.match : "nothing");
+      ++failures;
+    }
+  }
+
+  // A line where the match could start almost anywhere but ends only at
+  // the last byte; trying every start takes time quadratic in its length
+  {
+    const search::regex re("a.*b|c");
+    const std::string line = std::string(1 << 20, 'a') + "c";
+    std::vector<search::literal_match> all;
+    re.find_all(line, true, all);
+    const auto found = re.find(line);
+    if (found.position != line.size() - 1 || found.length != 1
+        || all.size() != 1 || all.front().position != found.position)
+    {
+      std::printf("regex 'a.*b|c' should find the last byte of a long line\n");
+      ++failures;
+    }
+  }
+
+  struct literals_case
+  {
+    const char* pattern;
+    bool ignore_case;
+    std::vector<std::string> literals;
+  };
+  const literals_case literals[] = {
+      {"hello", false, {"hello"}},
+      {"HeLLo", true, {"hello"}},
+      {"foo(bar|baz)", false, {"foobar", "foobaz"}},
+      {"abc|abd", false, {"abc", "abd"}},
+      {"[ab]cd", false, {"acd", "bcd"}},
+      {"(cat|dog)s?", false, {"cat", "dog"}},
+      {"colou?r", false, {"colo"}},
+      {R"(\d{3}-\d{4})", false, {"-"}},
+      // Nothing every match must contain
+      {R"(\w+)", false, {}},
+  };
+  for (const auto& check : literals) {
+    const search::regex re(check.pattern, check.ignore_case);
+    if (re.literals() != check.literals) {
+      std::printf("regex '%s' has other literals than expected\n",
+                  check.pattern);
+      ++failures;
+    }
+  }
+
+  // Not supported, so rejected rather than silently misread
+  const char* const rejected[] = {
+      R"(\b)", R"(\B)", "(?i)a", "(?=a)", R"(\1)", "(a", "a)", "*a", "[a",
+      "a{3,2}", "[[:foo:]]", R"(a\)",
+  };
+  for (const auto* pattern : rejected) {
+    try {
+      search::regex re(pattern);
+      std::printf("regex '%s' should be rejected\n", pattern);
+      ++failures;
+    } catch (const search::regex_error&) {
+    }
+  }
+  return failures;
+}
+
+std::string to_lower(std::string text)
+{
+  for (auto& c : text) {
+    if (c >= 'A' && c <= 'Z') {
+      c = static_cast<char>(c | 0x20);
+    }
+  }
+  return text;
+}
+
+int check_multi_literal()
+{
+  // Teddy takes up to 32 patterns, the automaton any more
+  const std::size_t pattern_counts[] = {1, 2, 8, 32, 33, 100};
+  constexpr std::string_view alphabet = "aabbcAB#";
+  std::mt19937 random(11);
+  const auto pick = [&](std::size_t bound)
+  { return static_cast<std::size_t>(random() % bound); };
+  const auto make = [&](std::size_t length)
+  {
+    std::string text;
+    for (std::size_t i = 0; i < length; ++i) {
+      text += alphabet[pick(alphabet.size())];
+    }
+    return text;
+  };
+
+  int failures = 0;
+  for (const auto count : pattern_counts) {
+    for (int trial = 0; trial < 200; ++trial) {
+      const bool ignore_case = trial % 2 == 1;
+      // Distinct even with -i, as duplicates would be merged into fewer
+      std::vector<std::string> patterns;
+      while (patterns.size() < count) {
+        auto pattern = make(1 + pick(8));
+        const auto same = [&](const std::string& other)
+        { return to_lower(other) == to_lower(pattern); };
+        if (std::none_of(patterns.begin(), patterns.end(), same)) {
+          patterns.push_back(std::move(pattern));
+        }
+      }
+      const search::multi_literal literals(patterns, ignore_case);
+      const auto haystack = make(pick(200));
+
+      // Leftmost, and the longest of the patterns that start there
+      search::literal_match expected {std::string::npos, 0};
+      const auto text = ignore_case ? to_lower(haystack) : haystack;
+      for (std::size_t i = 0;
+           i < text.size() && expected.position == std::string::npos;
+           ++i)
+      {
+        for (const auto& pattern : patterns) {
+          const auto needle = ignore_case ? to_lower(pattern) : pattern;
+          if (text.compare(i, needle.size(), needle) == 0
+              && needle.size() > expected.length)
+          {
+            expected = {i, needle.size()};
+          }
+        }
+      }
+
+      const auto found = literals.find(haystack);
+      if (found.position != expected.position
+          || (found.position != std::string::npos
+              && found.length != expected.length))
+      {
+        std::printf("%zu patterns%s: found %zu+%zu in '%s' instead of "
+                    "%zu+%zu\n",
+                    count,
+                    ignore_case ? " with -i" : "",
+                    found.position,
+                    found.length,
+                    haystack.c_str(),
+                    expected.position,
+                    expected.length);
+        ++failures;
+      }
+    }
+  }
+  return failures;
+}
+
+int check_highlighting()
+{
+  using search::searcher;
+  struct highlight_case
+  {
+    std::vector<std::string> patterns;
+    bool use_regex;
+    bool ignore_case;
+    std::string line;
+    // The line with [ and ] where the highlighting should start and end
+    std::string expected;
+  };
+  std::vector<highlight_case> cases = {
+      {{"ab"}, false, false, "xabyab", "x[ab]y[ab]"},
+      // Overlapping occurrences are highlighted from the end of the last
+      {{"aa"}, false, false, "aaaaa", "[aa][aa]a"},
+      {{"aba"}, false, false, "ababa", "[aba]ba"},
+      // Adjacent ones each get their own escape codes
+      {{"ab"}, false, false, "abab", "[ab][ab]"},
+      {{"Ab"}, false, true, "aBAbab", "[aB][Ab][ab]"},
+      {{"ab", "abc", "b"}, false, false, "abcab b", "[abc][ab] [b]"},
+      {{"ab", "BC"}, false, true, "aBcBc", "[aB]c[Bc]"},
+      {{"a+"}, true, false, "aaa baa", "[aaa] b[aa]"},
+      {{"a|ab"}, true, false, "abab", "[ab][ab]"},
+      {{"b*c"}, true, false, "cbcbbc", "[c][bc][bbc]"},
+  };
+  // More matches than the kernel hands out at once, each one overlapping
+  // an occurrence that is not a match
+  highlight_case many {{"aa"}, false, false, "", ""};
+  for (int i = 0; i < 150; ++i) {
+    many.line += i % 7 == 0 ? "aax" : "aa";
+    many.expected += i % 7 == 0 ? "[aa]x" : "[aa]";
+  }
+  cases.push_back(std::move(many));
+
+  searcher::m_mode = search::output_mode::lines;
+  searcher::m_is_stdout = true;
+  searcher::m_line_number = false;
+
+  int failures = 0;
+  for (const auto& check : cases) {
+    // Configured as the command line does
+    searcher::m_ignore_case = check.ignore_case;
+    searcher::m_literals.reset();
+    searcher::m_regex.reset();
+    auto patterns = check.patterns;
+    if (check.use_regex) {
+      searcher::m_regex = std::make_unique<search::regex>(patterns.front(),
+                                                          check.ignore_case);
+      patterns = searcher::m_regex->literals();
+    } else if (check.ignore_case) {
+      std::transform(
+          patterns.begin(), patterns.end(), patterns.begin(), to_lower);
+    }
+    searcher::m_query = patterns.front();
+    searcher::m_needle =
+        search::compile_needle(searcher::m_query, check.ignore_case);
+    if (patterns.size() > 1) {
+      searcher::m_literals =
+          std::make_unique<search::multi_literal>(patterns, check.ignore_case);
+    }
+
+    std::string expected = "\n\033[1;36mf\033[0m\n";
+    for (const char c : check.expected) {
+      expected += c == '[' ? "\033[1;31m"
+          : c == ']'       ? "\033[0m"
+                           : std::string(1, c);
+    }
+    expected += '\n';
+    const auto output =
+        captured_output([&] { searcher::file_search("f", check.line + "\n"); });
+    if (output != expected) {
+      std::printf("highlighting %s in '%.40s' gives '%.80s'\n",
+                  check.patterns.front().c_str(),
+                  check.line.c_str(),
+                  output.c_str());
+      ++failures;
+    }
+  }
+
+  searcher::m_literals.reset();
+  searcher::m_regex.reset();
+  searcher::m_ignore_case = false;
+  searcher::m_is_stdout = false;
+  return failures;
+}
+
+#if defined(__SSE2__)
+/* A page followed by one that cannot be read, so that a kernel reading
+ * past the end of what is copied to the end of the first one faults */
+class guarded_page
+{
+public:
+  guarded_page()
+      : m_size(static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)))
+      , m_memory(::mmap(nullptr,
+                        2 * m_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0))
+  {
+    if (m_memory == MAP_FAILED
+        || ::mprotect(static_cast<char*>(m_memory) + m_size, m_size, PROT_NONE)
+            != 0)
+    {
+      throw std::bad_alloc();
+    }
+  }
+
+  ~guarded_page()
+  {
+    ::munmap(m_memory, 2 * m_size);
+  }
+
+  guarded_page(const guarded_page&) = delete;
+  guarded_page& operator=(const guarded_page&) = delete;
+
+  // A copy of text that ends where the unreadable page begins
+  std::string_view place(std::string_view text)
+  {
+    auto* start = static_cast<char*>(m_memory) + m_size - text.size();
+    std::memcpy(start, text.data(), text.size());
+    return {start, text.size()};
+  }
+
+private:
+  std::size_t m_size;
+  void* m_memory;
+};
+
+int check_kernels()
+{
+  using search::strstr_needle;
+  using find_fn =
+      std::size_t (*)(const char*, std::size_t, const strstr_needle&);
+  using find_all_fn = std::size_t (*)(const char*,
+                                      std::size_t,
+                                      const strstr_needle&,
+                                      std::size_t*,
+                                      std::size_t);
+
+  struct kernel
+  {
+    const char* name;
+    bool supported;
+    find_fn find;
+    find_fn find_fold;
+    find_all_fn find_all;
+    find_all_fn find_all_fold;
+  };
+  __builtin_cpu_init();
+  const kernel kernels[] = {
+      {"sse2",
+       true,
+       search::sse2_strstr,
+       search::sse2_strcasestr,
+       search::sse2_strstr_all,
+       search::sse2_strcasestr_all},
+      {"avx2",
+       __builtin_cpu_supports("avx2") != 0,
+       search::avx2_strstr,
+       search::avx2_strcasestr,
+       search::avx2_strstr_all,
+       search::avx2_strcasestr_all},
+      {"avx512bw",
+       __builtin_cpu_supports("avx512bw") != 0,
+       search::avx512bw_strstr,
+       search::avx512bw_strcasestr,
+       search::avx512bw_strstr_all,
+       search::avx512bw_strcasestr_all},
+      // What the searcher calls, whichever of the above it picked
+      {"dispatched",
+       true,
+       [](const char* s, std::size_t n, const strstr_needle& needle)
+       { return search::sse2_strstr_v2({s, n}, needle); },
+       [](const char* s, std::size_t n, const strstr_needle& needle)
+       { return search::sse2_strcasestr_v2({s, n}, needle); },
+       [](const char* s,
+          std::size_t n,
+          const strstr_needle& needle,
+          std::size_t* positions,
+          std::size_t max)
+       { return search::sse2_strstr_all_v2({s, n}, needle, positions, max); },
+       [](const char* s,
+          std::size_t n,
+          const strstr_needle& needle,
+          std::size_t* positions,
+          std::size_t max)
+       {
+         return search::sse2_strcasestr_all_v2(
+             {s, n}, needle, positions, max);
+       }},
+  };
+
+  // Few distinct bytes, so that anchors often line up and matches are
+  // common, and a few rare ones, for compile_needle to anchor on
+  constexpr std::string_view alphabet = "aaaabbbAAB  _e\nQz#";
+  std::mt19937 random(42);
+  const auto pick = [&](std::size_t bound)
+  { return static_cast<std::size_t>(random() % bound); };
+
+  guarded_page haystack_page;
+  guarded_page needle_page;
+  constexpr std::size_t max_positions = 512;
+  std::size_t positions[max_positions];
+
+  int failures = 0;
+  for (const auto& kernel : kernels) {
+    if (!kernel.supported) {
+      continue;
+    }
+
+    bool failed = false;
+    for (std::size_t k = 1; k <= 64 && !failed; ++k) {
+      for (int trial = 0; trial < 64 && !failed; ++trial) {
+        std::string text;
+        const auto length = pick(300);
+        for (std::size_t i = 0; i < length; ++i) {
+          text += alphabet[pick(alphabet.size())];
+        }
+
+        const bool fold = trial % 2 == 1;
+        std::string needle;
+        if (text.size() >= k && trial % 4 < 2) {
+          needle = text.substr(pick(text.size() - k + 1), k);
+        } else {
+          for (std::size_t i = 0; i < k; ++i) {
+            needle += alphabet[pick(alphabet.size())];
+          }
+        }
+        if (fold) {
+          needle = to_lower(needle);
+        }
+        if (trial % 8 < 3) {
+          // A match at the very end, against the unreadable page
+          auto last = needle;
+          if (fold) {
+            for (auto& c : last) {
+              if (c >= 'a' && c <= 'z' && pick(2) == 0) {
+                c = static_cast<char>(c & ~0x20);
+              }
+            }
+          }
+          text += last;
+        }
+
+        const auto haystack = haystack_page.place(text);
+        const auto compiled =
+            search::compile_needle(needle_page.place(needle), fold);
+        const std::string reference_text = fold ? to_lower(text) : text;
+
+        std::vector<std::size_t> expected;
+        for (auto at = reference_text.find(needle);
+             at != std::string::npos && expected.size() < max_positions;
+             at = reference_text.find(needle, at + k))
+        {
+          expected.push_back(at);
+        }
+        const auto first =
+            expected.empty() ? std::string::npos : expected.front();
+
+        const auto found = (fold ? kernel.find_fold : kernel.find)(
+            haystack.data(), haystack.size(), compiled);
+        const auto count = (fold ? kernel.find_all_fold : kernel.find_all)(
+            haystack.data(),
+            haystack.size(),
+            compiled,
+            positions,
+            max_positions);
+        if (found != first || count != expected.size()
+            || !std::equal(expected.begin(), expected.end(), positions))
+        {
+          std::printf("%s%s kernel finds other matches of a %zu byte "
+                      "needle in a %zu byte haystack than find does\n",
+                      kernel.name,
+                      fold ? " -i" : "",
+                      k,
+                      text.size());
+          ++failures;
+          failed = true;
+        }
+      }
+    }
+  }
+  return failures;
+}
+#endif
+
+}  // namespace
+
+void* operator new(std::size_t size)
+{
+  return allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept
+{
+  std::free(pointer);
+}
+
 auto main() -> int
 {
-  return 0;
+  const auto root = fs::temp_directory_path()
+      / ("oystr_test." + std::to_string(::getpid()));
+  fs::create_directories(root);
+
+  int failures = 0;
+  failures += check_allocations(root);
+  failures += check_line_numbers();
+  failures += check_search_paths(root);
+  failures += check_ignore_rules(root);
+  failures += check_file_filter();
+  failures += check_index(root);
+  failures += check_regex();
+  failures += check_multi_literal();
+  failures += check_highlighting();
+#if defined(__SSE2__)
+  failures += check_kernels();
+#endif
+
+  fs::remove_all(root);
+  return failures == 0 ? 0 : 1;
 }